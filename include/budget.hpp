@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace buxtehude
+{
+
+// Memory held in buffers across the process: fields being read, output waiting to
+// be written, pooled buffers, messages queued for the server, frames awaiting parse
+// workers, and servers' caches & key-value stores. The budget only keeps count;
+// servers decide what to do past its limits. A limit of 0 is no limit.
+class MemoryBudget
+{
+public:
+    static MemoryBudget& Global();
+
+    void SetLimits(size_t soft, size_t hard);
+    size_t SoftLimit() const { return soft_limit.load(std::memory_order_relaxed); }
+    size_t HardLimit() const { return hard_limit.load(std::memory_order_relaxed); }
+    bool Limited() const { return SoftLimit() || HardLimit(); }
+
+    size_t Used() const { return used.load(std::memory_order_relaxed); }
+    bool OverSoft() const;
+    bool OverHard() const;
+
+    void Charge(size_t bytes) { used.fetch_add(bytes, std::memory_order_relaxed); }
+    void Release(size_t bytes) { used.fetch_sub(bytes, std::memory_order_relaxed); }
+private:
+    std::atomic<size_t> used = 0, soft_limit = 0, hard_limit = 0;
+};
+
+// Bytes charged to the global budget on behalf of one owner, released along with it
+class MemoryCharge
+{
+public:
+    MemoryCharge() = default;
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge(MemoryCharge&& other) noexcept : bytes(std::exchange(other.bytes, 0)) {}
+    MemoryCharge& operator=(MemoryCharge&& other) noexcept
+    {
+        std::swap(bytes, other.bytes);
+        return *this;
+    }
+    ~MemoryCharge() { Set(0); }
+
+    // Charges or releases the difference from the amount last set
+    void Set(size_t new_bytes);
+    size_t Bytes() const { return bytes; }
+private:
+    size_t bytes = 0;
+};
+
+}
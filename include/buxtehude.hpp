@@ -6,4 +6,5 @@
 #include "core.hpp"
 #include "client.hpp"
 #include "server.hpp"
+#include "simulation.hpp"
 #include "validate.hpp"
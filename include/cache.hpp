@@ -0,0 +1,112 @@
+#pragma once
+
+#include "budget.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace buxtehude
+{
+
+using nlohmann::json;
+
+constexpr size_t DEFAULT_CACHE_CAPACITY = 1024 * 1024 * 4;
+constexpr size_t DEFAULT_DEDUP_CAPACITY = 1024 * 64;
+constexpr std::chrono::milliseconds DEFAULT_DEDUP_WINDOW { 60'000 };
+
+// Replies to requests sent to a team, keyed by the team, the type and the request's
+// content. Entries expire after their type's TTL, and the least recently used are
+// evicted once the estimated size exceeds the capacity.
+class ResponseCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A TTL of 0 stops caching the type and drops its entries
+    void SetTTL(std::string_view team, std::string_view type,
+                std::chrono::milliseconds ttl);
+    bool Cacheable(std::string_view team, std::string_view type) const;
+
+    // nullptr on a miss. Valid until the cache is next modified.
+    const json* Find(std::string_view team, std::string_view type, const json& request,
+                     Clock::time_point now);
+    void Insert(std::string_view team, std::string_view type, const json& request,
+                const json& reply, Clock::time_point now);
+
+    void SetCapacity(size_t bytes);
+    size_t Size() const { return entries.size(); }
+    size_t Bytes() const { return bytes; }
+private:
+    struct Entry
+    {
+        std::string key;
+        json request, reply;
+        Clock::time_point expires;
+        size_t bytes;
+    };
+
+    using EntryIter = std::list<Entry>::iterator;
+
+    static std::string Key(std::string_view team, std::string_view type,
+                           const json& request);
+    void Erase(EntryIter iter);
+    void Evict();
+
+    std::list<Entry> entries; // Most recently used first
+    std::unordered_map<std::string, EntryIter> index;
+    std::unordered_map<std::string, std::chrono::milliseconds> ttls; // By team & type
+    size_t capacity = DEFAULT_CACHE_CAPACITY;
+    size_t bytes = 0;
+    MemoryCharge charge; // For 'bytes'
+};
+
+struct DedupStats
+{
+    size_t entries = 0;
+    size_t bytes = 0; // Estimated
+    uint64_t duplicates = 0; // Messages dropped so far
+    // Chance of a fresh key being mistaken for a duplicate, at the current size
+    double false_positive_rate = 0;
+};
+
+// Idempotency keys seen recently, per team. Only 64-bit hashes are kept, so a fresh
+// key is mistaken for a duplicate with a probability of about entries / 2^64. Keys
+// are forgotten once the window passes or, oldest first, past the capacity.
+class DedupWindow
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Whether the key was seen within the window. Remembers it if not.
+    bool Seen(std::string_view team, std::string_view key, Clock::time_point now);
+
+    DedupStats Stats() const;
+
+    std::chrono::milliseconds window = DEFAULT_DEDUP_WINDOW;
+    size_t capacity = DEFAULT_DEDUP_CAPACITY; // Keys remembered at most
+private:
+    struct Entry
+    {
+        Clock::time_point seen;
+        uint64_t hash;
+    };
+
+    // A deque slot & a hash set node, the node holding its hash & a pointer
+    static constexpr size_t ENTRY_SIZE
+        = sizeof(Entry) + sizeof(uint64_t) + sizeof(void*) * 2;
+
+    std::deque<Entry> entries; // Oldest first
+    std::unordered_set<uint64_t> hashes;
+    uint64_t duplicates = 0;
+    MemoryCharge charge; // For the entries, as estimated by Stats()
+};
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include <cstdint>
+#include <string_view>
+
+namespace buxtehude
+{
+
+using nlohmann::json;
+
+// Optional protocol features, advertised in $$handshake messages. Names are
+// sent on the wire; bits are local to each process.
+enum class Feature : uint32_t
+{
+    COMPRESSION, BATCHING, BINARY_HEADER, HEARTBEAT, SHARED_MEMORY, ADAPTIVE_FORMAT,
+    DATAGRAM
+};
+
+constexpr std::string_view FEATURE_NAMES[] = {
+    "compression", "batching", "binary-header", "heartbeat", "shared-memory",
+    "adaptive-format", "datagram"
+};
+
+constexpr size_t FEATURE_COUNT = std::size(FEATURE_NAMES);
+
+class Capabilities
+{
+public:
+    Capabilities& Add(Feature f, const json& params = json::object());
+    Capabilities& Remove(Feature f);
+
+    bool Has(Feature f) const { return mask & Bit(f); }
+    bool Empty() const { return mask == 0; }
+    const json& Params(Feature f) const;
+
+    // The features supported by both sides, with their parameters agreed upon.
+    // Both sides compute the same result regardless of which one calls it:
+    // - numbers agree on the minimum
+    // - booleans agree on true only if both are true
+    // - arrays agree on their common elements, sorted and without duplicates
+    // - parameters that differ in any other way, or are missing on one side, are dropped
+    Capabilities Negotiate(const Capabilities& other) const;
+
+    friend void to_json(json& j, const Capabilities& c);
+    friend void from_json(const json& j, Capabilities& c);
+private:
+    static constexpr uint32_t Bit(Feature f) { return 1u << static_cast<uint32_t>(f); }
+
+    uint32_t mask = 0;
+    json params[FEATURE_COUNT];
+};
+
+}
@@ -2,22 +2,37 @@
 
 #include "core.hpp"
 #include "io.hpp"
+#include "parse.hpp"
+#include "ring.hpp"
+#include "server.hpp"
 #include "tb.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <mutex>
 #include <queue>
 #include <string>
 #include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <event2/event.h>
 
 namespace buxtehude
 {
 
-class Server;
-class ClientHandle;
+// Lets a Client reach any instantiation of BasicServer it connects to internally
+struct InternalServerLink
+{
+    void (*add)(void* server, Client& cl);
+    void (*remove)(void* server, Client& cl);
+    void (*receive)(void* server, Client& cl, const Message& msg);
+    // Takes over messages sent by the server, if set, instead of their being
+    // handled as they are written
+    void (*deliver)(void* server, Client& cl, const Message& msg) = nullptr;
+};
 
 class Client
 {
@@ -30,24 +45,58 @@ public:
     ~Client();
 
     tb::error<ConnectError> IPConnect(std::string_view hostname, uint16_t port);
-    tb::error<ConnectError> UnixConnect(std::string_view path);
-    tb::error<ConnectError> InternalConnect(Server& server);
+    tb::error<ConnectError> UnixConnect(std::string_view path,
+                                        SocketMode mode = SocketMode::STREAM);
+    template<typename Policies>
+    tb::error<ConnectError> InternalConnect(BasicServer<Policies>& server);
 
     void Disconnect();
 
     tb::error<WriteError> Write(const Message& msg);
+    tb::error<WriteError> Write(const PreparedMessage& msg);
+    // Prepares a message in the preferred format, filled in with our teamname
+    PreparedMessage Prepare(const Message& msg,
+                            std::initializer_list<json::json_pointer> slots = {});
     tb::error<WriteError> SetAvailable(std::string_view type, bool available);
 
+    // Batched $$membership updates for a team, or every team with $$all
+    tb::error<WriteError> Subscribe(std::string_view team, bool subscribe);
+    // Request a $$members snapshot of a team, or of every team if empty
+    tb::error<WriteError> RequestMembers(std::string_view team = "");
+    // Receive a sample of the messages sent to a team, or every team with $$all
+    tb::error<WriteError> Sample(std::string_view team, const SamplingRule& rule);
+    tb::error<WriteError> StopSampling(std::string_view team);
+    // Let the server answer repeated only_first requests of a type sent to our team
+    // with our earlier replies, for 'ttl'. A TTL of 0 stops caching.
+    tb::error<WriteError> Cache(std::string_view type, std::chrono::milliseconds ttl);
+
+    // Server key-value store - replies arrive at the handler of the same type
+    tb::error<WriteError> Get(std::string_view ns, std::string_view key);
+    tb::error<WriteError> Set(std::string_view ns, std::string_view key,
+                              const json& value);
+    tb::error<WriteError> CompareAndSet(std::string_view ns, std::string_view key,
+                                        const json& value, uint64_t version);
+    tb::error<WriteError> Delete(std::string_view ns, std::string_view key);
+    tb::error<WriteError> Watch(std::string_view ns, bool watch);
+
     void AddHandler(std::string_view type, Handler&& h);
+    // Receives messages of the type with their content left undecoded, unless the
+    // type also has a regular handler
+    void AddLazyHandler(std::string_view type, LazyHandler&& h);
     void SetDisconnectHandler(DisconnectHandler&& h);
     void EraseHandler(const std::string& type);
     void ClearHandlers();
 
     bool Connected() const;
+    // Features supported by both this client and the server
+    const Capabilities& Negotiated() const;
+    // Lossy messages dropped for want of room in the datagram socket
+    uint64_t DroppedDatagrams() const;
 
     ClientPreferences preferences;
 private: // Only for INTERNAL clients
-    friend ClientHandle;
+    friend InternalTransport;
+    friend Simulation;
     // Called by the Server ClientHandle when it sends a message
     void Internal_Receive(const Message& msg);
     void Internal_Disconnect();
@@ -56,8 +105,29 @@ private:
     tb::error<AllocError> SetupEvents();
     void StartListening();
     void Read();
+    void ReadPackets();
+    void HandleFrame(std::span<const uint8_t> frame);
+    void Decode(MessageFormat format, std::string_view body);
+    bool DispatchLazy(MessageFormat format, std::string_view body);
+    void DispatchDecoded();
+    tb::error<int> TryWrite(std::span<const uint8_t> frame);
     void Listen();
 
+    // Broadcasts read from shared memory, set up by the server with $$ring
+    void OpenRing(const Message& msg);
+    void ReadRing();
+    void WatchRing();
+    void StopWatchingRing();
+    void CloseRing();
+
+    // Lossy message types sent as datagrams, set up by the server with $$datagram
+    void OpenDatagrams(const Message& msg);
+    bool WriteDatagram(std::string_view type, std::span<const uint8_t> frame);
+    void SendDatagrams_NoLock();
+    void CloseDatagrams();
+
+    tb::error<ConnectError> ConnectInternal(void* server, const InternalServerLink& link);
+
     void HandleMessage(const Message& msg);
     tb::error<WriteError> Handshake();
     void SetupDefaultHandlers();
@@ -66,19 +136,57 @@ private:
 
     int client_socket = -1;
     Stream stream;
-    std::atomic<Server*> server_ptr = nullptr;
+    PacketStream packets; // SEQPACKET connections only
+    ParsePool decode_pool;
+    ParseQueue decoding; // Messages awaiting their handlers, in the order received
+    std::atomic<void*> server_ptr = nullptr;
+    const InternalServerLink* server_link = nullptr;
+
+    Capabilities negotiated;
 
     std::unordered_map<std::string, Handler> handlers;
+    std::unordered_map<std::string, LazyHandler> lazy_handlers;
     DisconnectHandler disconnect_handler;
 
     std::thread current_thread;
     std::atomic<bool> connected = false;
 
+    RingReader ring;
+    std::thread ring_thread; // Wakes the listening thread when broadcasts arrive
+    std::atomic<bool> watching_ring = false;
+
+    std::atomic<int> datagram_socket = -1;
+    uint64_t datagram_token = 0;
+    std::unordered_set<std::string> lossy_types;
+    std::vector<std::vector<uint8_t>> datagrams; // Sent by the listening thread
+    std::mutex datagram_mutex;
+    std::atomic<uint64_t> datagrams_dropped = 0;
+
     // Libevent internals
     UEventBase ebase;
-    UEvent read_event, interrupt_event, write_event;
+    UEvent read_event, interrupt_event, write_event, ring_event, datagram_event;
+    UEvent decode_event;
 
     EventCallbackData callback_data;
 };
 
+template<typename Policies>
+tb::error<ConnectError> Client::InternalConnect(BasicServer<Policies>& server)
+{
+    using ServerType = BasicServer<Policies>;
+    static constexpr InternalServerLink LINK {
+        .add = [] (void* s, Client& cl) {
+            static_cast<ServerType*>(s)->Internal_AddClient(cl);
+        },
+        .remove = [] (void* s, Client& cl) {
+            static_cast<ServerType*>(s)->Internal_RemoveClient(cl);
+        },
+        .receive = [] (void* s, Client& cl, const Message& msg) {
+            static_cast<ServerType*>(s)->Internal_ReceiveFrom(cl, msg);
+        }
+    };
+
+    return ConnectInternal(&server, LINK);
+}
+
 }
@@ -2,7 +2,9 @@
 
 #include <nlohmann/json.hpp>
 
+#include <array>
 #include <functional>
+#include <optional>
 #include <string>
 #include <string_view>
 
@@ -17,6 +19,7 @@
 
 #include <fmt/core.h>
 
+#include "capability.hpp"
 #include "validate.hpp"
 #include "io.hpp"
 
@@ -27,14 +30,108 @@ namespace buxtehude
 
 constexpr std::string_view MSG_ALL        = "$$all";
 constexpr std::string_view MSG_AVAILABLE  = "$$available";
+constexpr std::string_view MSG_CACHE      = "$$cache";
+constexpr std::string_view MSG_CAS        = "$$cas";
+constexpr std::string_view MSG_CHANGED    = "$$changed";
+constexpr std::string_view MSG_DATAGRAM   = "$$datagram";
+constexpr std::string_view MSG_DELETE     = "$$delete";
 constexpr std::string_view MSG_DISCONNECT = "$$disconnect";
 constexpr std::string_view MSG_ERROR      = "$$error";
+constexpr std::string_view MSG_GET        = "$$get";
 constexpr std::string_view MSG_HANDSHAKE  = "$$handshake";
 constexpr std::string_view MSG_INFO       = "$$info";
+constexpr std::string_view MSG_MEMBERS    = "$$members";
+constexpr std::string_view MSG_MEMBERSHIP = "$$membership";
+constexpr std::string_view MSG_RING       = "$$ring";
+constexpr std::string_view MSG_SAMPLE     = "$$sample";
 constexpr std::string_view MSG_SERVER     = "$$server";
+constexpr std::string_view MSG_SET        = "$$set";
 constexpr std::string_view MSG_SUBSCRIBE  = "$$subscribe";
+constexpr std::string_view MSG_WATCH      = "$$watch";
 constexpr std::string_view MSG_YOU        = "$$you";
 
+// Reserved keywords, classified by a perfect hash built at compile time
+enum class Reserved : uint8_t
+{
+    NONE, // Not a reserved keyword
+    ALL, AVAILABLE, CACHE, CAS, CHANGED, DATAGRAM, DELETE, DISCONNECT, ERROR, GET,
+    HANDSHAKE, INFO, MEMBERS, MEMBERSHIP, RING, SAMPLE, SERVER, SET, SUBSCRIBE, WATCH,
+    YOU
+};
+
+namespace detail
+{
+
+constexpr std::pair<std::string_view, Reserved> RESERVED_KEYWORDS[] = {
+    { MSG_ALL, Reserved::ALL }, { MSG_AVAILABLE, Reserved::AVAILABLE },
+    { MSG_CACHE, Reserved::CACHE }, { MSG_CAS, Reserved::CAS },
+    { MSG_CHANGED, Reserved::CHANGED }, { MSG_DATAGRAM, Reserved::DATAGRAM },
+    { MSG_DELETE, Reserved::DELETE }, { MSG_DISCONNECT, Reserved::DISCONNECT },
+    { MSG_ERROR, Reserved::ERROR }, { MSG_GET, Reserved::GET },
+    { MSG_HANDSHAKE, Reserved::HANDSHAKE }, { MSG_INFO, Reserved::INFO },
+    { MSG_MEMBERS, Reserved::MEMBERS }, { MSG_MEMBERSHIP, Reserved::MEMBERSHIP },
+    { MSG_RING, Reserved::RING }, { MSG_SAMPLE, Reserved::SAMPLE },
+    { MSG_SERVER, Reserved::SERVER }, { MSG_SET, Reserved::SET },
+    { MSG_SUBSCRIBE, Reserved::SUBSCRIBE }, { MSG_WATCH, Reserved::WATCH },
+    { MSG_YOU, Reserved::YOU }
+};
+
+constexpr size_t RESERVED_TABLE_BITS = 6;
+constexpr size_t RESERVED_TABLE_SIZE = 1 << RESERVED_TABLE_BITS;
+
+// Keywords are told apart by their length and the two characters following "$$",
+// mixed by multiplying with an odd 64-bit constant derived from the seed
+constexpr size_t ReservedHash(std::string_view s, uint64_t seed)
+{
+    uint64_t x = (static_cast<uint8_t>(s[2]) * 31 + static_cast<uint8_t>(s[3])) * 31
+        + s.size();
+    return x * (seed * 0x9e3779b97f4a7c15) >> (64 - RESERVED_TABLE_BITS);
+}
+
+constexpr uint64_t FindReservedSeed()
+{
+    for (uint64_t seed = 1; seed < 4096; ++seed) {
+        bool used[RESERVED_TABLE_SIZE] {};
+        bool collision = false;
+        for (const auto& [keyword, _] : RESERVED_KEYWORDS) {
+            size_t h = ReservedHash(keyword, seed);
+            if (used[h]) {
+                collision = true;
+                break;
+            }
+            used[h] = true;
+        }
+        if (!collision) return seed;
+    }
+    return 0;
+}
+
+constexpr uint64_t RESERVED_SEED = FindReservedSeed();
+static_assert(RESERVED_SEED != 0, "No perfect hash for the reserved keywords");
+
+constexpr auto RESERVED_TABLE = [] {
+    std::array<std::pair<std::string_view, Reserved>, RESERVED_TABLE_SIZE> table {};
+    for (const auto& entry : RESERVED_KEYWORDS)
+        table[ReservedHash(entry.first, RESERVED_SEED)] = entry;
+    return table;
+}();
+
+} // namespace detail
+
+// One table lookup & at most one string comparison
+constexpr Reserved Classify(std::string_view s)
+{
+    if (s.size() < 4 || s[0] != '$' || s[1] != '$') return Reserved::NONE;
+    const auto& [keyword, reserved] =
+        detail::RESERVED_TABLE[detail::ReservedHash(s, detail::RESERVED_SEED)];
+    return keyword == s ? reserved : Reserved::NONE;
+}
+
+static_assert(Classify(MSG_MEMBERSHIP) == Reserved::MEMBERSHIP);
+static_assert(Classify("$$members") == Reserved::MEMBERS);
+static_assert(Classify("$$nothing") == Reserved::NONE);
+static_assert(Classify("ping") == Reserved::NONE);
+
 constexpr uint32_t DEFAULT_MAX_MESSAGE_LENGTH = 1024 * 128;
 constexpr uint16_t DEFAULT_PORT = 1637;
 
@@ -48,12 +145,14 @@ class Client;
 enum class LogLevel { DEBUG = 0, INFO = 1, WARNING = 2, SEVERE = 3 };
 
 enum class ConnectionType { UNIX, INTERNET, INTERNAL };
+// SEQPACKET sends each frame as one packet, on UNIX domain sockets only
+enum class SocketMode { STREAM, SEQPACKET };
 enum class MessageFormat : uint8_t { JSON = 0, MSGPACK = 1 };
 
 enum class EventType
 {
     NEW_CONNECTION, READ_READY, TIMEOUT, INTERRUPT, INTERNAL_READ_READY,
-    WRITE_READY
+    WRITE_READY, NO_EVENT, MEMBERSHIP_TIMER, PARSE_READY, BUDGET_TIMER
 };
 
 enum class ConnectErrorType
@@ -140,28 +239,121 @@ struct Message
     std::string dest, src, type;
     json content;
     bool only_first = false;
+    // Messages repeating a recent key from the same team are dropped by the server
+    std::string idempotency_key;
 
     static Message Deserialise(MessageFormat f, std::string_view data);
-    static auto WriteToStream(Stream& stream, const Message& m, MessageFormat f)
-    -> tb::error<int>;
+    // Encodes the message into a complete frame, header included
+    // A non-empty src overrides the message's own.
+    static std::vector<uint8_t> Encode(const Message& m, MessageFormat f,
+                                       std::string_view src = {});
+    static auto WriteToStream(Stream& stream, const Message& m, MessageFormat f,
+                              std::string_view src = {}) -> tb::error<int>;
+};
+
+// A message being sent to many recipients, encoded at most once per format.
+class EncodedMessage
+{
+public:
+    using Encoder = std::vector<uint8_t> (*)(const Message&, MessageFormat,
+                                             std::string_view);
+
+    EncodedMessage(const Message& m, Encoder encoder = Message::Encode)
+        : message(m), encoder(encoder) {}
+
+    // The frame the message arrived in, if it decodes to the same message. The
+    // body must outlive this object.
+    void SetOriginal(MessageFormat f, std::string_view body);
+
+    // Whether a frame in this format is available without encoding
+    bool Ready(MessageFormat f) const
+    {
+        return frames[Index(f)] || (f == original_format && !original_body.empty());
+    }
+    const std::vector<uint8_t>& Frame(MessageFormat f);
+
+    const Message& message;
+private:
+    static constexpr size_t Index(MessageFormat f) { return static_cast<size_t>(f); }
+
+    Encoder encoder;
+    std::optional<std::vector<uint8_t>> frames[2];
+    std::string_view original_body;
+    MessageFormat original_format = MessageFormat::JSON;
 };
 
 void to_json(json& j, const Message& msg);
 void from_json(const json& j, Message& msg);
 
+// A message encoded once, for sending repeatedly. Patch slots are unsigned
+// integer fields in the content that have a fixed width once encoded, so that
+// they can be changed without encoding the message again. Throws
+// std::invalid_argument for slots that cannot be found once encoded, as when two
+// share a pointer.
+class PreparedMessage
+{
+public:
+    PreparedMessage(const Message& m, MessageFormat f,
+                    std::initializer_list<json::json_pointer> slots = {});
+
+    void Set(size_t slot, uint64_t value);
+
+    const std::vector<uint8_t>& Frame() const { return frame; }
+    const Message& GetMessage() const { return message; }
+    MessageFormat Format() const { return format; }
+private:
+    struct Slot
+    {
+        json::json_pointer pointer;
+        size_t offset;
+    };
+
+    Message message;
+    std::vector<uint8_t> frame;
+    std::vector<Slot> slots;
+    MessageFormat format;
+};
+
+// Recipients accepting several formats may receive whichever the server has at hand
+inline Capabilities DefaultCapabilities()
+{
+    return Capabilities {}.Add(Feature::ADAPTIVE_FORMAT, {
+        { "formats", { MessageFormat::JSON, MessageFormat::MSGPACK } }
+    });
+}
+
+// Which messages sent to a team an observer receives, when sampling it with $$sample
+struct SamplingRule
+{
+    uint32_t every = 1; // One in every N messages
+    uint32_t rate = 0; // At most this many messages per second, 0 for no limit
+    std::string key; // JSON pointer into the content, whose value is hashed...
+    double fraction = 1; // ...to sample this share of its values consistently
+};
+
 struct ClientPreferences
 {
     std::string teamname = "default";
     MessageFormat format = MessageFormat::MSGPACK;
     uint32_t max_msg_length = DEFAULT_MAX_MESSAGE_LENGTH;
+    // Optional features to advertise
+    Capabilities capabilities = DefaultCapabilities().Add(Feature::DATAGRAM);
+    // Messages of at least decode_threshold bytes are decoded by this many worker
+    // threads, off the thread reading the socket. Handlers still run in the order
+    // messages arrive. 0 decodes everything on the reading thread.
+    uint32_t decode_workers = 0;
+    uint32_t decode_threshold = 1024 * 16;
 };
 
 using Handler = std::function<void(Client&, const Message&)>;
 using LogCallback = void (*)(LogLevel, std::string_view);
 using SignalHandler = void (*)(int);
 
-// Must be called to initialise libevent, logging and SIGPIPE handling
-void Initialise(LogCallback cb = nullptr, SignalHandler sh = nullptr);
+// Must be called to initialise libevent, logging and SIGPIPE handling.
+// Without thread support libevent takes no locks of its own, which only suits
+// programs using nothing but SingleThreadedServer from one thread.
+void Initialise(LogCallback cb = nullptr, SignalHandler sh = nullptr,
+                bool thread_support = true);
 
 constinit inline LogCallback logger = nullptr;
 
@@ -191,6 +383,54 @@ inline const ValidationSeries VALIDATE_AVAILABLE = {
     { "/available"_json_pointer, predicates::IsBool }
 };
 
+inline const ValidationSeries VALIDATE_KV_KEY = {
+    { "/namespace"_json_pointer, predicates::NotEmpty },
+    { "/key"_json_pointer, predicates::NotEmpty }
+};
+
+inline const ValidationSeries VALIDATE_KV_SET = {
+    { "/namespace"_json_pointer, predicates::NotEmpty },
+    { "/key"_json_pointer, predicates::NotEmpty },
+    { "/value"_json_pointer, predicates::Exists }
+};
+
+inline const ValidationSeries VALIDATE_KV_CAS = {
+    { "/namespace"_json_pointer, predicates::NotEmpty },
+    { "/key"_json_pointer, predicates::NotEmpty },
+    { "/value"_json_pointer, predicates::Exists },
+    { "/version"_json_pointer, predicates::IsNumber }
+};
+
+inline const ValidationSeries VALIDATE_WATCH = {
+    { "/namespace"_json_pointer, predicates::NotEmpty },
+    { "/watch"_json_pointer, predicates::IsBool }
+};
+
+inline const ValidationSeries VALIDATE_SUBSCRIBE = {
+    { "/team"_json_pointer, predicates::NotEmpty },
+    { "/subscribe"_json_pointer, predicates::IsBool }
+};
+
+inline const ValidationSeries VALIDATE_CACHE = {
+    { "/type"_json_pointer, predicates::NotEmpty },
+    { "/ttl"_json_pointer, predicates::IsNumber },
+    { "/ttl"_json_pointer, predicates::GreaterEq<0> }
+};
+
+inline const ValidationSeries VALIDATE_DATAGRAM = {
+    { "/token"_json_pointer, predicates::IsNumber },
+    { "/types"_json_pointer, predicates::IsArray }
+};
+
+inline const ValidationSeries VALIDATE_RING = {
+    { "/attached"_json_pointer, predicates::IsBool }
+};
+
+inline const ValidationSeries VALIDATE_SAMPLE = {
+    { "/team"_json_pointer, predicates::NotEmpty },
+    { "/sample"_json_pointer, predicates::IsBool }
+};
+
 inline const ValidationSeries VALIDATE_SERVER_MESSAGE = {
     { ""_json_pointer, predicates::NotEmpty }
 };
@@ -198,6 +438,8 @@ inline const ValidationSeries VALIDATE_SERVER_MESSAGE = {
 namespace callbacks {
 
 constexpr timeval DEFAULT_TIMEOUT = { 60, 0 };
+constexpr timeval DEFAULT_MEMBERSHIP_INTERVAL = { 0, 100'000 };
+constexpr timeval DEFAULT_BUDGET_INTERVAL = { 0, 50'000 };
 
 void ConnectionCallback(evconnlistener* listener, evutil_socket_t fd,
                         sockaddr* addr, int addr_len, void* data);
@@ -208,6 +450,12 @@ void LoopInterruptCallback(evutil_socket_t fd, short what, void* data);
 
 void InternalReadCallback(evutil_socket_t fd, short what, void* data);
 
+void MembershipTimerCallback(evutil_socket_t fd, short what, void* data);
+
+void ParseReadyCallback(evutil_socket_t fd, short what, void* data);
+
+void BudgetTimerCallback(evutil_socket_t fd, short what, void* data);
+
 }
 
 }
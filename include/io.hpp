@@ -2,12 +2,16 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <functional>
 #include <list>
+#include <span>
 #include <tuple>
 #include <string_view>
 #include <ranges>
+#include <vector>
 
+#include "budget.hpp"
 #include "tb.hpp"
 
 #include <cstdint>
@@ -17,6 +21,13 @@
 namespace buxtehude
 {
 
+// A format byte followed by the length of the body
+constexpr size_t FRAME_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint32_t);
+
+constexpr size_t MAX_PACKET_SIZE = 1024 * 64;
+constexpr size_t MAX_DATAGRAM_SIZE = 65507; // The largest UDP payload
+constexpr size_t PACKET_BATCH = 8; // Packets received per system call, at most
+
 struct Field;
 class Stream;
 
@@ -35,7 +46,7 @@ struct Field
     FieldIterator self_iterator;
     Callback cb;
 
-    Field(size_t length) : length(length) { data.reserve(length); }
+    Field(size_t length) : length(length) {}
 
     Field(Field&&) noexcept = default;
     Field& operator=(Field&&) noexcept = default;
@@ -68,31 +79,12 @@ public:
 
     Stream(const Stream&) = delete;
 
+    // Buffers start small and grow as the field's bytes arrive, so a length
+    // announced up front costs nothing until it is sent
     template<typename T=void>
     Stream& Await(size_t len=sizeof(T))
     {
-        FieldIterator iter = fields.emplace(fields.end(), len);
-        Field& new_field = *iter;
-        new_field.self_iterator = iter;
-
-        if (deleted.empty()) {
-            new_field.data.reserve(len);
-        } else {
-            auto reusable = std::ranges::find_if(deleted,
-                [len] (const Field& f) {
-                    return f.data.capacity() >= len;
-                }
-            );
-
-            if (reusable == deleted.end()) {
-                new_field.data.reserve(len);
-                deleted.erase(deleted.begin());
-            } else {
-                new_field.data = std::move(reusable->data);
-                deleted.erase(reusable);
-            }
-        }
-
+        AddField(len);
         return *this;
     }
 
@@ -129,6 +121,7 @@ public:
                 std::begin(src) + bytes_written,
                 std::end(src));
         }
+        Account();
 
         if (output_buffer.size())
             return errno;
@@ -142,18 +135,31 @@ public:
             = fwrite(output_buffer.data(), 1, output_buffer.size(), file);
 
         output_buffer.erase(output_buffer.begin(), output_buffer.begin() + bytes_written);
+        Account();
         if (output_buffer.size())
             return errno;
         else
             return tb::ok;
     }
 
+    // Bytes waiting to be flushed
+    size_t Pending() const { return output_buffer.size(); }
+    // Bytes charged to the memory budget, for fields read & output alike
+    size_t Charged() const { return charge.Bytes(); }
+
     FILE* file = nullptr;
 private:
+    void AddField(size_t len);
+    void Grow(Field& f);
+    // Charges the memory budget for the buffers held, first freeing a large
+    // output buffer once it is emptied
+    void Account();
+
     Callback finally;
 
     std::list<Field> fields, deleted;
     std::vector<uint8_t> output_buffer;
+    MemoryCharge charge;
     FieldIterator current = fields.end();
     size_t data_offset = 0;
     StreamStatus status = StreamStatus::OKAY;
@@ -161,4 +167,71 @@ private:
     bool is_at_valid_field = false;
 };
 
+enum class PacketError { NONE_READY, REACHED_EOF, TOO_LONG, MALFORMED };
+
+// Receives up to PACKET_BATCH packets or datagrams into buffers of MAX_PACKET_SIZE
+// bytes taken from a per-thread pool, with one system call where the platform
+// allows. Sizes of truncated packets are SIZE_MAX. Returns the number received,
+// or -1 with errno set.
+int ReceiveBatch(int fd, std::vector<std::vector<uint8_t>>& buffers,
+                 size_t (&sizes)[PACKET_BATCH]);
+// Gives buffers back to the pool
+void ReleaseBatch(std::vector<std::vector<uint8_t>>& buffers);
+// Sends each packet or datagram on a connected socket without blocking. Returns
+// how many were sent before one would have blocked or failed.
+size_t SendBatch(int fd, std::span<const std::vector<uint8_t>> packets);
+
+// Frames over a SOCK_SEQPACKET socket. Each frame is sent as one packet, read whole
+// by a single receive into a pooled buffer, in batches where the platform allows.
+// Frames larger than a packet are split over consecutive packets and pieced back
+// together as a stream would be.
+class PacketStream
+{
+public:
+    PacketStream() = default;
+    PacketStream(int fd, uint32_t max_length) : fd(fd), max_length(max_length) {}
+
+    PacketStream(PacketStream&&) noexcept = default;
+    PacketStream& operator=(PacketStream&&) noexcept = default;
+
+    PacketStream(const PacketStream&) = delete;
+    ~PacketStream();
+
+    // The next frame, header included, valid until the next call. Frames with a
+    // body longer than 'max_length' are skipped.
+    tb::result<std::span<const uint8_t>, PacketError> Read();
+    // Whether frames were received that Read() has yet to return
+    bool Buffered() const { return next < received; }
+    // Bytes of pooled buffers holding received packets
+    size_t Held() const { return batch.size() * MAX_PACKET_SIZE; }
+
+    tb::error<int> TryWrite(std::span<const uint8_t> frame);
+    tb::error<int> Flush();
+    // Bytes waiting to be flushed
+    size_t Pending() const { return pending_bytes; }
+    // Bytes charged to the memory budget, for packets received & output alike
+    size_t Charged() const { return charge.Bytes(); }
+
+    int fd = -1;
+    uint32_t max_length = UINT32_MAX;
+private:
+    bool Receive();
+    void Queue(std::span<const uint8_t> data);
+    void Account() { charge.Set(partial.capacity() + pending_bytes + Held()); }
+
+    std::vector<std::vector<uint8_t>> batch; // Pooled buffers
+    size_t sizes[PACKET_BATCH] {};
+    size_t received = 0, next = 0;
+
+    // A frame spanning several packets
+    std::vector<uint8_t> partial;
+    size_t expected = 0; // Bytes of the frame being pieced together, if not 0
+    size_t skip = 0; // Bytes left of a frame too long to read
+    bool eof = false;
+
+    std::deque<std::vector<uint8_t>> output; // One packet each
+    size_t pending_bytes = 0;
+    MemoryCharge charge;
+};
+
 }
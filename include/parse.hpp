@@ -0,0 +1,116 @@
+#pragma once
+
+#include "budget.hpp"
+#include "core.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace buxtehude
+{
+
+// A frame to be decoded off the thread that read it. The reading thread keeps its
+// jobs in the order they were read and consumes them from the front once ready,
+// so no lock is taken between decoding and consuming a message.
+struct ParseJob
+{
+    ParseJob(MessageFormat format, std::string_view data)
+        : body(data.begin(), data.end()), format(format) { charge.Set(body.capacity()); }
+
+    std::string_view Body() const { return { body.data(), body.size() }; }
+
+    std::vector<char> body; // Kept for forwarding as it was received
+    MessageFormat format;
+    std::optional<Message> message; // Empty if the frame failed to parse
+    std::string error;
+    std::atomic<bool> ready = false; // Set by the decoding thread, with release
+    MemoryCharge charge; // For the copy of the body
+};
+
+using ParseQueue = std::deque<std::shared_ptr<ParseJob>>;
+
+// A message whose content is decoded only as far as lookups need. The other fields
+// are decoded up front. Lookups skip over unrelated parts of the content by their
+// length prefixes (MessagePack) or by scanning past their brackets and strings
+// (JSON), decoding only the value found.
+class LazyMessage
+{
+public:
+    // Over the body of a frame, which must outlive this object. Throws
+    // json::parse_error if the body is malformed.
+    LazyMessage(MessageFormat format, std::string_view body);
+    // Over a message already decoded, which must outlive this object
+    LazyMessage(const Message& message);
+
+    // The value at 'pointer' within the content, if there is one. Throws
+    // json::parse_error if the value found is malformed.
+    std::optional<json> At(const json::json_pointer& pointer) const;
+    std::optional<json> At(std::string_view pointer) const;
+
+    // Decodes the whole content
+    json Content() const;
+    Message Materialise() const;
+
+    std::string dest, src, type;
+    bool only_first = false;
+    std::string idempotency_key;
+private:
+    bool ScanJSON(std::string_view body);
+    bool ScanMsgpack(std::string_view body);
+    const json* Decoded() const { return owned ? &*owned : borrowed; }
+
+    MessageFormat format = MessageFormat::JSON;
+    std::string_view content; // Undecoded
+    const json* borrowed = nullptr;
+    std::optional<json> owned; // If the body could not be scanned
+};
+
+using LazyHandler = std::function<void(Client&, const LazyMessage&)>;
+
+// Worker threads decoding frames
+class ParsePool
+{
+public:
+    using Decoder = Message (*)(MessageFormat, std::string_view);
+
+    ParsePool() = default;
+    ParsePool(const ParsePool&) = delete;
+    ~ParsePool();
+
+    // on_ready() is called from the workers each time a job is done
+    void Start(uint32_t workers, Decoder decoder, std::function<void()>&& on_ready);
+    // Jobs already submitted are decoded before the workers exit
+    void Stop();
+    bool Running() const { return !threads.empty(); }
+
+    void Submit(std::shared_ptr<ParseJob> job);
+
+    // Decodes on the calling thread
+    static void Decode(ParseJob& job, Decoder decoder);
+    // Blocks until the job is done
+    static void Wait(const ParseJob& job);
+private:
+    void Work();
+
+    Decoder decoder = nullptr;
+    std::function<void()> on_ready;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<ParseJob>> jobs;
+    bool stopping = false;
+
+    std::vector<std::thread> threads;
+};
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "core.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace buxtehude
+{
+
+// Policies configuring BasicServer at compile time. A policy bundle provides:
+// - THREADED: whether the server runs its own thread, or is driven by calls to Poll().
+//   Unthreaded servers' event bases are created without libevent's locks.
+// - Lock: a mutex type guarding the server's state
+// - Storage: the random access container holding client handles
+// - Routing: whether a teamname matches a message destination
+// - Codec: decoding messages read from clients & encoding messages for them
+// - Clock: the time TTLs, windows and timers are measured in. Servers on any clock
+//   but std::chrono::steady_clock keep their timers themselves, firing them in Poll(),
+//   and must be unthreaded.
+
+struct NullLock
+{
+    constexpr void lock() {}
+    constexpr void unlock() {}
+    constexpr bool try_lock() { return true; }
+};
+
+struct TeamRouting
+{
+    static bool Matches(std::string_view teamname, std::string_view dest)
+    {
+        return teamname == dest || dest == MSG_ALL;
+    }
+};
+
+struct DefaultCodec
+{
+    static Message Decode(MessageFormat f, std::string_view data)
+    {
+        return Message::Deserialise(f, data);
+    }
+
+    static std::vector<uint8_t> Encode(const Message& m, MessageFormat f,
+                                       std::string_view src = {})
+    {
+        return Message::Encode(m, f, src);
+    }
+};
+
+// A clock that only moves when told to, for simulations. Its time points are
+// steady_clock's, so they can be handed to anything taking those.
+struct VirtualClock
+{
+    using duration = std::chrono::steady_clock::duration;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::steady_clock::time_point;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point { duration { ticks.load(std::memory_order_relaxed) } };
+    }
+
+    // Time never moves backwards
+    static void Advance(duration d)
+    {
+        if (d.count() > 0) ticks.fetch_add(d.count(), std::memory_order_relaxed);
+    }
+private:
+    static inline std::atomic<rep> ticks = 0;
+};
+
+struct ThreadedPolicies
+{
+    static constexpr bool THREADED = true;
+    using Lock = std::mutex;
+    template<typename T> using Storage = std::vector<T>;
+    using Routing = TeamRouting;
+    using Codec = DefaultCodec;
+    using Clock = std::chrono::steady_clock;
+};
+
+// For embedding a server in a single-threaded program. Nothing is locked, and
+// INTERNAL clients must be used from the thread calling Poll(). Debug builds
+// assert that the server is only used from the thread it was set up on.
+struct SingleThreadedPolicies
+{
+    static constexpr bool THREADED = false;
+    using Lock = NullLock;
+    template<typename T> using Storage = std::vector<T>;
+    using Routing = TeamRouting;
+    using Codec = DefaultCodec;
+    using Clock = std::chrono::steady_clock;
+};
+
+// For servers driven by a Simulation, on its virtual clock
+struct SimulatedPolicies
+{
+    static constexpr bool THREADED = false;
+    using Lock = NullLock;
+    template<typename T> using Storage = std::vector<T>;
+    using Routing = TeamRouting;
+    using Codec = DefaultCodec;
+    using Clock = VirtualClock;
+};
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace buxtehude
+{
+
+// A value read from any thread without locks, and replaced whole by one writer at a
+// time. Replaced values are freed by the writer once no reader can still hold them:
+// readers register under the current epoch, and values retired in an epoch are
+// freed when every reader of that epoch has left. The epoch only advances once the
+// readers of the one before it are gone, so two counters suffice.
+template<typename T>
+class Published
+{
+public:
+    class Reader
+    {
+    public:
+        Reader(const Reader&) = delete;
+        Reader(Reader&& other) noexcept
+            : cell(std::exchange(other.cell, nullptr)), value(other.value),
+              slot(other.slot) {}
+        ~Reader() { if (cell) cell->readers[slot].fetch_sub(1); }
+
+        const T& operator*() const { return *value; }
+        const T* operator->() const { return value; }
+    private:
+        friend Published;
+        Reader(const Published& cell, const T* value, uint32_t slot)
+            : cell(&cell), value(value), slot(slot) {}
+
+        const Published* cell;
+        const T* value;
+        uint32_t slot;
+    };
+
+    Published() : current(new T {}) {}
+    Published(const Published&) = delete;
+    // No readers may remain
+    ~Published() { delete current.load(); }
+
+    // From any thread. The value stays valid while the reader is held, and should
+    // not be held for long, as it keeps every value since from being freed.
+    Reader Read() const
+    {
+        while (true) {
+            uint64_t e = epoch.load();
+            uint32_t slot = e & 1;
+            readers[slot].fetch_add(1);
+            if (epoch.load() == e) return Reader { *this, current.load(), slot };
+            readers[slot].fetch_sub(1);
+        }
+    }
+
+    // Writers only
+    void Publish(std::unique_ptr<const T> value)
+    {
+        const T* old = current.exchange(value.release());
+        retired.emplace_back(epoch.load(), old);
+        Reclaim();
+    }
+
+    void Reclaim()
+    {
+        uint64_t e = epoch.load();
+        // The counter shared by the epochs either side of this one
+        if (readers[(e + 1) & 1].load() != 0) return;
+
+        std::erase_if(retired, [e] (const auto& r) { return r.first < e; });
+        if (!retired.empty()) epoch.store(e + 1);
+    }
+
+    size_t Retired() const { return retired.size(); }
+private:
+    std::atomic<const T*> current;
+    std::atomic<uint64_t> epoch = 0;
+    mutable std::atomic<uint32_t> readers[2] = { 0, 0 };
+    std::vector<std::pair<uint64_t, std::unique_ptr<const T>>> retired;
+};
+
+}
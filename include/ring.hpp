@@ -0,0 +1,220 @@
+#pragma once
+
+#include "core.hpp"
+#include "tb.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace buxtehude
+{
+
+// A single-writer, multi-reader ring of broadcast frames in shared memory. The
+// server publishes each frame once, tagged with its destination, and every reader
+// picks out the frames meant for its team at its own pace.
+//
+// Readers are never waited for. A reader about to be overwritten is detached
+// instead, and the frames it has yet to read are handed back to the writer so it
+// can deliver them some other way. A reader's position only advances by compare &
+// swap once it has copied a frame, so each frame is either read from the ring or
+// handed back, never both.
+
+constexpr uint32_t RING_READERS = 256;
+constexpr uint16_t RING_NO_READER = UINT16_MAX;
+constexpr uint64_t RING_DETACHED = UINT64_MAX;
+
+namespace detail
+{
+
+struct RingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+
+    alignas(64) std::atomic<uint64_t> write_pos;
+    alignas(64) std::atomic<uint32_t> sequence; // Futex word, bumped on publishing
+    std::atomic<uint32_t> waiters;
+    alignas(64) std::atomic<uint64_t> cursors[RING_READERS];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// Precedes every record. Records are 8-byte aligned and never wrap around the
+// end of the ring; the space left before the end is skipped by a padding record.
+struct RecordHeader
+{
+    uint32_t size; // Of the whole record
+    uint32_t frame_size; // UINT32_MAX for padding
+    uint16_t exclude; // The slot of a reader not to deliver to
+    uint16_t dest_size;
+};
+
+// A mapping of the ring, shared by the writer & reader
+class RingMapping
+{
+public:
+    RingMapping() = default;
+    RingMapping(const RingMapping&) = delete;
+    RingMapping(RingMapping&& other) noexcept;
+    RingMapping& operator=(RingMapping&& other) noexcept;
+    ~RingMapping();
+
+    tb::error<int> Map(int fd, size_t size);
+
+    // Moves 'pos' past the next record meant for 'team' and not excluding 'slot',
+    // or up to 'end' if there is none. The frame points into the ring.
+    bool Next(uint64_t& pos, uint64_t end, std::string_view team, int slot,
+              std::span<const uint8_t>& frame) const;
+
+    RingHeader* header = nullptr;
+    uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+}
+
+// The server's side
+class BroadcastRing
+{
+public:
+    // Creates the shared memory object 'name' (starting with a slash), of
+    // 'capacity' bytes rounded up to a multiple of 8, plus the header.
+    tb::error<int> Create(std::string_view name, size_t capacity);
+    void Destroy();
+    // A name for Create() no other ring in this process has been given
+    static std::string UniqueName();
+
+    const std::string& Name() const { return name; }
+    bool Open() const { return mapping.header; }
+
+    // A free reader slot starting at the current position, or -1 if there is none
+    int Attach();
+    // Returns where the reader was, for Unread(), or RING_DETACHED if it was not
+    // attached
+    uint64_t Detach(int slot);
+    uint32_t Readers() const { return readers; }
+
+    // Publishes a frame for every reader of the team 'dest' ($$all for every
+    // reader) but 'exclude'. Frames larger than a quarter of the ring are
+    // refused, and need delivering some other way.
+    //
+    // on_lagging(slot, pos) is called for each reader overwritten by this frame,
+    // after detaching it, with the position of the first frame it has yet to read.
+    // Unread() gives back those frames until the next call to Publish().
+    template<typename OnLagging>
+    bool Publish(std::string_view dest, int exclude, std::span<const uint8_t> frame,
+                 OnLagging&& on_lagging);
+
+    // Every frame published from 'pos' onwards, for a reader of team 'team'
+    void Unread(uint64_t pos, std::string_view team, int slot,
+                std::vector<std::vector<uint8_t>>& frames) const;
+private:
+    // Detaches readers whose unread frames start before 'pos' & returns their
+    // slots along with where they were
+    std::vector<std::pair<int, uint64_t>> DetachBefore(uint64_t pos);
+    void Write(uint64_t pos, const detail::RecordHeader& record, std::string_view dest,
+               std::span<const uint8_t> frame);
+    void Notify();
+
+    detail::RingMapping mapping;
+    std::string name;
+    uint64_t write_pos = 0;
+    bool attached[RING_READERS] {};
+    uint32_t readers = 0;
+};
+
+// A client's side
+class RingReader
+{
+public:
+    tb::error<int> Open(std::string_view name, int slot);
+    void Close();
+    bool Attached() const { return mapping.header && slot >= 0; }
+
+    // Calls deliver(frame) for every frame for 'team' published so far. Returns
+    // false once the reader has been detached.
+    template<typename Deliver>
+    bool Drain(std::string_view team, Deliver&& deliver);
+
+    // Whether anything was published past our position
+    bool Pending() const;
+    uint32_t Sequence() const;
+    // Blocks until something is published after 'sequence' or the timeout passes
+    void Wait(uint32_t sequence, std::chrono::milliseconds timeout);
+private:
+    detail::RingMapping mapping;
+    std::vector<uint8_t> buffer;
+    int slot = -1;
+};
+
+// Implementation
+
+template<typename OnLagging>
+bool BroadcastRing::Publish(std::string_view dest, int exclude,
+                            std::span<const uint8_t> frame, OnLagging&& on_lagging)
+{
+    uint64_t capacity = mapping.header->capacity;
+    size_t size = (sizeof(detail::RecordHeader) + dest.size() + frame.size() + 7) & ~7;
+    if (size > capacity / 4 || dest.size() > UINT16_MAX) return false;
+
+    uint64_t offset = write_pos % capacity;
+    uint64_t padding = capacity - offset < size ? capacity - offset : 0;
+    uint64_t end = write_pos + padding + size;
+
+    // Nothing is overwritten before lagging readers have been handed their frames
+    if (end > capacity) {
+        for (auto [slot, cursor] : DetachBefore(end - capacity))
+            on_lagging(slot, cursor);
+    }
+
+    if (padding >= sizeof(detail::RecordHeader)) {
+        Write(write_pos, { .size = static_cast<uint32_t>(padding),
+                           .frame_size = UINT32_MAX }, {}, {});
+    }
+
+    Write(write_pos + padding, {
+        .size = static_cast<uint32_t>(size),
+        .frame_size = static_cast<uint32_t>(frame.size()),
+        .exclude = exclude < 0 ? RING_NO_READER : static_cast<uint16_t>(exclude),
+        .dest_size = static_cast<uint16_t>(dest.size())
+    }, dest, frame);
+
+    write_pos = end;
+    mapping.header->write_pos.store(write_pos, std::memory_order_release);
+    Notify();
+    return true;
+}
+
+template<typename Deliver>
+bool RingReader::Drain(std::string_view team, Deliver&& deliver)
+{
+    if (!Attached()) return false;
+    std::atomic<uint64_t>& cursor = mapping.header->cursors[slot];
+
+    while (true) {
+        uint64_t pos = cursor.load(std::memory_order_acquire);
+        if (pos == RING_DETACHED) return false;
+
+        uint64_t next = pos;
+        std::span<const uint8_t> frame;
+        bool found = mapping.Next(next, mapping.header->write_pos.load(
+            std::memory_order_acquire), team, slot, frame);
+        if (next == pos) return true;
+        if (found) buffer.assign(frame.begin(), frame.end());
+
+        // Fails if the writer detached us while we were copying
+        if (!cursor.compare_exchange_strong(pos, next, std::memory_order_acq_rel))
+            return false;
+
+        if (found) deliver(std::span<const uint8_t> { buffer });
+    }
+}
+
+}
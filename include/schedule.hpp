@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace buxtehude
+{
+
+// Teams in a higher class are serviced first in every scheduling round
+enum class QoSClass { HIGH = 0, NORMAL = 1, LOW = 2 };
+
+constexpr size_t QOS_CLASS_COUNT = 3;
+
+struct TeamQoS
+{
+    QoSClass qos_class = QoSClass::NORMAL;
+    uint32_t weight = 1; // Units of work per round
+};
+
+// Deficit round-robin over teams. Each unit of work is identified by an integer
+// (a socket for the server) queued under the team it belongs to.
+class FairScheduler
+{
+public:
+    void SetQoS(std::string_view team, TeamQoS qos);
+    void Enqueue(std::string_view team, int id);
+    void Remove(int id);
+
+    bool Pending() const { return pending > 0; }
+
+    // Performs a single round, servicing at most 'budget' units of work. The
+    // service function returns whether the unit has more work, in which case it
+    // is queued again behind the rest of its team.
+    template<typename Service>
+    uint32_t Run(uint32_t budget, Service&& service)
+    {
+        uint32_t serviced = 0;
+        for (std::deque<TeamQueue*>& list : active) {
+            for (size_t n = list.size(); n > 0 && serviced < budget; --n) {
+                TeamQueue* team = list.front();
+                list.pop_front();
+
+                team->deficit += team->qos.weight;
+                while (team->deficit > 0 && serviced < budget && !team->ready.empty()) {
+                    int id = team->ready.front();
+                    team->ready.pop_front();
+                    --team->deficit;
+                    --pending;
+                    ++serviced;
+
+                    if (service(id)) {
+                        team->ready.push_back(id);
+                        ++pending;
+                    }
+                }
+
+                if (team->ready.empty()) {
+                    team->deficit = 0;
+                    team->active = false;
+                } else {
+                    list.push_back(team);
+                }
+            }
+        }
+        return serviced;
+    }
+private:
+    struct TeamQueue
+    {
+        TeamQoS qos;
+        std::deque<int> ready;
+        uint32_t deficit = 0;
+        bool active = false;
+    };
+
+    TeamQueue& GetTeam(std::string_view team);
+
+    std::unordered_map<std::string, TeamQueue> teams;
+    std::unordered_map<std::string, TeamQoS> configured;
+    std::deque<TeamQueue*> active[QOS_CLASS_COUNT];
+    size_t pending = 0;
+};
+
+// Decides which of a stream of messages an observer receives. A message is taken
+// if it passes every limit configured.
+class Sampler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // One in every 'every' messages, at most 'rate' per second (0 for no limit),
+    // and only 'fraction' of the key hashes if sampling by key.
+    Sampler(uint32_t every = 1, uint32_t rate = 0, double fraction = 1);
+
+    // key_hash is only consulted if fraction is below 1. The same hash is always
+    // either in or out of the sample.
+    bool Take(uint64_t key_hash, Clock::time_point now);
+private:
+    uint32_t every, rate;
+    uint64_t threshold; // Key hashes below this are sampled
+    uint32_t skipped = 0;
+    uint32_t taken_this_second = 0;
+    Clock::time_point second_start {};
+};
+
+}
@@ -1,16 +1,32 @@
 #pragma once
 
+#include "budget.hpp"
+#include "cache.hpp"
 #include "core.hpp"
 #include "io.hpp"
+#include "parse.hpp"
+#include "policy.hpp"
+#include "rcu.hpp"
+#include "ring.hpp"
+#include "schedule.hpp"
 #include "tb.hpp"
 
 #include <ctime>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <optional>
+#include <random>
+#include <ranges>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 
 #include <event2/event.h>
@@ -24,12 +40,75 @@ namespace buxtehude
 {
 
 class Client;
+class Simulation;
+
+// Transport state for UNIX/INTERNET connections
+struct SocketTransport
+{
+    tb::error<WriteError> Write(const Message& m, MessageFormat f);
+    tb::error<WriteError> Write(const std::vector<uint8_t>& frame);
+    void Close();
+
+    // Whichever of the stream & packets the connection uses
+    tb::error<int> TryWrite(std::span<const uint8_t> frame);
+    tb::error<int> Flush();
+    size_t Pending() const;
+    // Bytes charged to the memory budget on the connection's behalf, both ways
+    size_t Held() const;
+    bool Packets() const { return packets.fd != -1; }
+
+    Stream stream;
+    PacketStream packets; // SEQPACKET connections only
+    UEvent read_event, write_event;
+    int socket = -1;
+    int ring_slot = -1; // Reading broadcasts from shared memory, if not -1
+    uint64_t datagram_token = 0; // Identifies the client's datagrams, if not 0
+    bool local = false; // UNIX domain
+    bool frame_pending = false; // The last body read is still in the stream
+    std::span<const uint8_t> packet_frame; // The last body read, for packets
+    ParseQueue parsing; // Frames read but not yet routed, with parse workers
+    uint64_t bytes_read = 0; // Since the memory budget was last checked
+    bool paused = false; // Not read from while over the memory budget's soft limit
+    bool scheduled = false; // Queued with the fair scheduler
+    std::deque<Message> datagrams; // Awaiting the fair scheduler, served before reads
+    MemoryCharge datagram_charge; // For datagrams
+};
+
+// Transport state for INTERNAL connections
+struct InternalTransport
+{
+    tb::error<WriteError> Write(const Message& m);
+    void Close();
+
+    Client* client = nullptr;
+};
+
+// A request forwarded to a client, whose reply is to be cached
+struct CacheableRequest
+{
+    std::string from, type;
+    json content;
+};
+
+// A team whose messages an observer receives a sample of
+struct SampleSubscription
+{
+    std::string team;
+    std::optional<json::json_pointer> key;
+    Sampler sampler;
+};
+
+constexpr size_t MAX_CACHEABLE_REQUESTS = 64; // Per client awaiting replies
+constexpr size_t DEFAULT_KV_CAPACITY = 1024 * 1024 * 16;
+constexpr size_t MAX_QUEUED_DATAGRAMS = 64; // Per client, with fair scheduling
 
 class ClientHandle
 {
 public:
     ClientHandle(Client& iclient, std::string_view teamname);
-    ClientHandle(ConnectionType conn_type, FILE* ptr, uint32_t max_msg_len);
+    ClientHandle(FILE* ptr, uint32_t max_msg_len, const Capabilities& supported);
+    // A SOCK_SEQPACKET connection
+    ClientHandle(int packet_socket, uint32_t max_msg_len, const Capabilities& supported);
 
     ClientHandle(const ClientHandle&) = delete;
     ClientHandle& operator=(const ClientHandle&) = delete;
@@ -39,63 +118,358 @@ public:
     ~ClientHandle() = default;
 
     // Applicable to all types of ClientHandle
-    tb::error<WriteError> Handshake();
+    tb::error<WriteError> Handshake(const Capabilities& supported);
     tb::error<WriteError> Write(const Message& m);
+    tb::error<WriteError> Write(EncodedMessage& m);
     void Error(std::string_view errstr);
     void Disconnect(std::string_view reason="Disconnected by server");
     void Disconnect_NoWrite();
 
     bool Available(std::string_view type);
+    bool Watching(std::string_view ns);
+    bool Subscribed(std::string_view team);
+
+    bool Internal() const { return std::holds_alternative<InternalTransport>(transport); }
+    // The socket's file descriptor, or -1 for INTERNAL connections
+    int Socket() const;
+    // The connected client, or nullptr for UNIX/INTERNET connections
+    Client* InternalClient() const;
+    // The client's broadcast ring slot, or -1 if it does not read the ring
+    int RingSlot() const;
+
+    // Only for UNIX/INTERNET connections
+    SocketTransport& Sock() { return std::get<SocketTransport>(transport); }
 
     // Try to read a message from the socket - only for INTERNET/UNIX
+    template<typename Codec = DefaultCodec>
     tb::result<Message, ReadError> Read();
+    // Reads the next frame without decoding it, valid until the next call
+    tb::result<std::pair<MessageFormat, std::string_view>, ReadError> ReadFrame();
+    // The body of the last message read, valid until the next call to Read()
+    std::optional<std::pair<MessageFormat, std::string_view>> LastFrame();
+    void ParseError(std::string_view what);
 
-    Stream stream; // Only for UNIX/INTERNET
+    // The format to send a message in, given what the client accepts
+    MessageFormat ChooseFormat(EncodedMessage& m);
+
+    std::variant<SocketTransport, InternalTransport> transport;
     std::time_t last_error = 0;
 
     std::vector<std::string> unavailable;
-    UEvent read_event, write_event;
-    Client* client_ptr = nullptr; // Only for INTERNAL connections
+    std::vector<std::string> watching; // Key-value namespaces
+    std::vector<std::string> subscriptions; // Teams with membership updates
+    std::deque<CacheableRequest> cacheable_requests; // In the order forwarded
+    std::vector<SampleSubscription> samples;
 
-    ConnectionType conn_type;
     ClientPreferences preferences;
+    Capabilities capabilities; // Negotiated during the handshake
+    uint8_t accepted_formats = 0; // Bit per MessageFormat, if adaptive
 
-    int socket = -1;
-
+    uint64_t id = 0; // Unique within its server
     bool handshaken = false;
     bool connected = false;
 };
 
-class Server
+// Interceptors
+
+enum class InterceptStage
+{
+    INGRESS, // Every message from a client after its handshake
+    ROUTING, // Messages with a destination, before recipients are chosen
+    EGRESS   // Once per recipient, before writing
+};
+
+constexpr size_t INTERCEPT_STAGE_COUNT = 3;
+
+// REDIRECT replaces the destination with Envelope::redirect. Recipients are
+// already chosen at EGRESS, where it is equivalent to DROP.
+enum class Verdict { PASS, DROP, REDIRECT };
+
+class Envelope
 {
 public:
-    Server() = default;
-    Server(const Server& other) = delete;
-    ~Server();
+    Envelope(InterceptStage stage, const ClientHandle& from, Message& msg);
+    Envelope(const ClientHandle& from, const ClientHandle& to, const Message& msg);
+
+    const Message& View() const { return copy ? *copy : message; }
+    // At EGRESS, modifications apply to this recipient only.
+    Message& Modify();
+    bool Modified() const { return modified; }
+
+    const InterceptStage stage;
+    const ClientHandle& from;
+    const ClientHandle* const to = nullptr; // Only at EGRESS
+    std::string redirect;
+private:
+    const Message& message;
+    Message* mutable_message = nullptr;
+    std::optional<Message> copy;
+    bool modified = false;
+};
+
+using Interceptor = std::function<Verdict(Envelope&)>;
+
+struct KVEntry
+{
+    json value;
+    uint64_t version = 0;
+    size_t bytes = 0; // Estimated, key included
+};
+
+struct ShutdownStats
+{
+    size_t clients = 0;
+    size_t drained = 0; // Clients that received everything up to the disconnect
+    size_t bytes_dropped = 0; // Output still unwritten at the end of the grace period
+    std::chrono::milliseconds duration { 0 };
+};
+
+struct LossyStats
+{
+    uint64_t datagrams = 0; // Routed
+    uint64_t rejected = 0; // Malformed, from unknown clients, or of types not lossy
+    uint64_t dropped = 0; // Not delivered to recipients with output pending
+    uint64_t overflowed = 0; // Behind MAX_QUEUED_DATAGRAMS of the sender's own
+};
+
+// What the server does to clients' queues past the memory budget's hard limit
+enum class ShedPolicy
+{
+    DISCONNECT, // The clients with the most output queued are disconnected
+    DROP        // Messages for clients with output queued are dropped
+};
+
+struct BudgetStats
+{
+    size_t used = 0; // Bytes charged to the budget across the process
+    size_t paused = 0; // Clients currently not read from
+    uint64_t pauses = 0;
+    uint64_t disconnected = 0;
+    uint64_t dropped = 0; // Messages, including those from INTERNAL clients
+};
+
+struct MembershipDelta
+{
+    uint32_t joined = 0;
+    uint32_t left = 0;
+};
+
+// The handshaken clients of each team, by their position in the server's storage.
+// Rebuilt as a whole when clients join or leave, and read without locks.
+struct RoutingTable
+{
+    // Positions shift when clients are removed, so each is checked against the id
+    struct Member
+    {
+        uint32_t position;
+        uint64_t id;
+    };
+
+    struct Team
+    {
+        std::string name;
+        std::vector<Member> members; // In the order they connected
+    };
+
+    template<typename Routing>
+    bool Matches(std::string_view dest) const
+    {
+        return std::ranges::any_of(teams, [dest] (const Team& team) {
+            return Routing::Matches(team.name, dest);
+        });
+    }
+
+    std::vector<Team> teams; // In the order of their first member
+};
 
-    tb::error<ListenError> UnixServer(std::string_view path="buxtehude_unix");
+// Definitions are explicitly instantiated in server.cpp for ThreadedPolicies and
+// SingleThreadedPolicies. Other policy bundles need instantiating there too.
+template<typename Policies>
+class BasicServer
+{
+public:
+    using TimePoint = typename Policies::Clock::time_point;
+    static constexpr bool VIRTUAL_TIME
+        = !std::is_same_v<typename Policies::Clock, std::chrono::steady_clock>;
+    static_assert(!VIRTUAL_TIME || !Policies::THREADED,
+                  "Servers on a virtual clock must be driven by Poll()");
+
+    BasicServer() = default;
+    BasicServer(const BasicServer& other) = delete;
+    ~BasicServer();
+
+    tb::error<ListenError> UnixServer(std::string_view path="buxtehude_unix",
+                                      SocketMode mode=SocketMode::STREAM);
     tb::error<ListenError> IPServer(uint16_t port=DEFAULT_PORT);
     tb::error<AllocError> InternalServer();
+    // Messages of lossy types are also accepted as datagrams, from clients connected
+    // over UNIX domain sockets or from the loopback interface respectively
+    tb::error<ListenError> UnixDatagramServer(std::string_view path="buxtehude_dgram");
+    tb::error<ListenError> UDPServer(uint16_t port=DEFAULT_PORT);
 
-    void Close();
+    ShutdownStats Close();
+
+    // Handles every pending event without blocking - only for servers without
+    // their own thread.
+    void Poll() requires (!Policies::THREADED);
+    // When Poll() next has timers to fire, for servers on a virtual clock
+    std::optional<TimePoint> NextTimer() const requires (VIRTUAL_TIME);
+
+    // Sends a message to the clients its destination names, or every client
+    // if it has none, in the format it was prepared in where possible. Must not
+    // be called from handlers of INTERNAL clients, which run on the server thread.
+    void Broadcast(const PreparedMessage& msg);
+
+    // Interceptors run in the order they were added. Stages without any are skipped.
+    void AddInterceptor(InterceptStage stage, Interceptor&& interceptor);
+
+    // Only takes effect with fair_scheduling enabled
+    void SetTeamQoS(std::string_view team, TeamQoS qos);
+
+    // Bounds the memory used by replies cached on behalf of clients sending $$cache
+    void SetCacheCapacity(size_t bytes);
+
+    DedupStats DeduplicationStats();
+
+    // Messages of lossy types may arrive as datagrams, and are dropped instead of
+    // queued for recipients whose output is backed up. Clients learn of lossy
+    // types when they connect.
+    void SetLossy(std::string_view type, bool lossy);
+    LossyStats LossyDeliveryStats();
+
+    BudgetStats MemoryBudgetStats();
 
     uint32_t max_msg_length = DEFAULT_MAX_MESSAGE_LENGTH;
+    // Optional features to advertise to clients
+    Capabilities capabilities = DefaultCapabilities();
+
+    // Reads from socket-based clients are queued per team and serviced by
+    // weighted deficit round-robin, instead of in the order libevent reports them.
+    // Datagrams are queued under their sender's team in the same way.
+    bool fair_scheduling = false;
+    uint32_t schedule_budget = 256; // Messages read per scheduling round
+
+    // Bytes of shared memory for broadcasts to local clients supporting it, set
+    // before calling UnixServer(). 0 disables the broadcast ring.
+    size_t broadcast_ring_size = 0;
+
+    // Frames of at least parse_threshold bytes are decoded by this many worker
+    // threads, and routed in the order each client sent them. Set before
+    // listening; 0 decodes everything on the server thread. Threaded servers only.
+    uint32_t parse_workers = 0;
+    size_t parse_threshold = 1024;
+
+    // Idempotency keys are remembered per team for dedup_window, up to
+    // dedup_capacity keys in total
+    std::chrono::milliseconds dedup_window = DEFAULT_DEDUP_WINDOW;
+    size_t dedup_capacity = DEFAULT_DEDUP_CAPACITY;
+
+    // Estimated bytes the key-value store holds at most, keys included. Writes that
+    // would take it past this fail.
+    size_t kv_capacity = DEFAULT_KV_CAPACITY;
+
+    // How long Close() waits for clients' pending output to drain
+    std::chrono::milliseconds shutdown_grace { 1000 };
+
+    // Joins and leaves are batched over this interval before being sent to subscribers
+    timeval membership_interval = callbacks::DEFAULT_MEMBERSHIP_INTERVAL;
+
+    // Checked against MemoryBudget::Global() every budget_interval, if it has limits
+    // when the server starts listening. Over the soft limit, the clients that sent
+    // the most since the last check are no longer read from until usage falls back
+    // under it. Past the hard limit, queues are shed according to shed_policy, and
+    // messages from INTERNAL clients are dropped.
+    ShedPolicy shed_policy = ShedPolicy::DISCONNECT;
+    timeval budget_interval = callbacks::DEFAULT_BUDGET_INTERVAL;
 private: // For INTERNAL connections only.
     friend Client;
+    friend Simulation;
     void Internal_AddClient(Client& cl);
     void Internal_RemoveClient(Client& cl);
     void Internal_ReceiveFrom(Client& cl, const Message& msg);
 private:
-    using HandleIter = std::vector<ClientHandle>::iterator;
+    using Lock = typename Policies::Lock;
+    using Routing = typename Policies::Routing;
+    using Codec = typename Policies::Codec;
+    using Clock = typename Policies::Clock;
+    using Storage = typename Policies::template Storage<ClientHandle>;
+    using HandleIter = typename Storage::iterator;
+    using RoutesReader = typename Published<RoutingTable>::Reader;
+    static_assert(std::ranges::random_access_range<Storage>,
+                  "Routing tables refer to clients by position");
 
     void Run();
-    void Serve(HandleIter client_handle);
-    void HandleMessage(ClientHandle& client_handle, Message&& msg);
-    void Broadcast_NoLock(const Message& msg);
+    bool Serve(HandleIter client_handle);
+    void Schedule(ClientHandle& client_handle);
+    void RunScheduler();
+    // Disconnected clients are removed, returning false
+    bool Reap(HandleIter client_handle);
+    // 'frame' is the format and body the message arrived in, if at hand
+    void HandleMessage(ClientHandle& client_handle, Message&& msg,
+        std::optional<std::pair<MessageFormat, std::string_view>> frame = std::nullopt);
+    void Deliver(ClientHandle& destination, ClientHandle& source,
+                 EncodedMessage& encoded, bool lossy = false);
+    bool Intercept(Envelope& envelope);
+
+    // Team membership
+    void HandleSubscribe(ClientHandle& client_handle, const Message& msg);
+    void HandleMembers(ClientHandle& client_handle, const Message& msg);
+
+    // Response cache
+    void HandleCache(ClientHandle& client_handle, const Message& msg);
+    bool AnswerFromCache(ClientHandle& client_handle, const Message& msg);
+    void CacheReply(ClientHandle& client_handle, const Message& msg);
+
+    // Broadcast ring
+    void AttachRing(ClientHandle& client_handle);
+    void DetachRing(ClientHandle& client_handle);
+    void HandleRing(ClientHandle& client_handle, const Message& msg);
+    void ReplayRing(ClientHandle& client_handle, uint64_t pos);
+    bool ServeFromRing(ClientHandle& destination, int exclude, std::string_view dest,
+                       EncodedMessage& encoded, std::optional<bool>& published);
+
+    // Parse workers
+    bool SubmitFrame(ClientHandle& client_handle);
+    void RouteParsed();
+    void RouteParsed(ClientHandle& client_handle, bool wait);
+
+    // Lossy datagrams
+    tb::error<ListenError> ListenDatagrams(int fd, const sockaddr* addr,
+                                           socklen_t addr_size, UEvent& event);
+    void OfferDatagrams(ClientHandle& client_handle);
+    void ReadDatagrams(int fd);
+
+    // Memory budget
+    void CheckBudget();
+    void PauseProducers();
+    void ResumeProducers();
+    void ShedLargest();
+
+    // Sampled delivery to observers
+    void HandleSample(ClientHandle& client_handle, const Message& msg);
+    void DeliverSamples(ClientHandle& source, const Message& msg,
+                        EncodedMessage& encoded);
+
+    // Timers
+    void StartTimer(UEvent& event, const timeval& interval,
+                    std::optional<TimePoint>& due);
+    void RunDueTimers();
+
+    void MemberJoined(std::string_view team);
+    void MemberLeft(std::string_view team);
+    void FlushMembership_NoLock();
+
+    // Key-value store
+    void HandleKV(ClientHandle& client_handle, const Message& msg, Reserved op);
+    void NotifyWatchers_NoLock(std::string_view ns, std::string_view key,
+        const KVEntry& entry, bool deleted);
 
     // Only if listening sockets are opened
     tb::error<AllocError> SetupEvents();
     void Listen();
+    // Debug builds only - unthreaded servers must stay on one thread
+    void CheckThread();
+    EventType HandleEvent(int flags);
     void AddConnection(int fd, sa_family_t addr_type);
 
     // Retrieving clients
@@ -104,25 +478,79 @@ private:
     HandleIter GetFirstAvailable(std::string_view team, std::string_view type,
         const ClientHandle& exclude);
 
-    std::vector<ClientHandle> clients;
+    // Routing table, republished before it is read if clients joined or left since
+    RoutesReader Routes();
+    void PublishRoutes();
+    // The member's handle, or clients.end() if it has been removed
+    HandleIter Resolve(const RoutingTable::Member& member);
+
+    Storage clients; // In order of id, being appended & erased in place
+    Published<RoutingTable> routes;
+    uint64_t next_client_id = 0;
+    std::atomic<bool> routes_stale = false; // Set with clients_mutex held
     std::vector<std::pair<Client*, Message>> internal_messages;
-    std::mutex clients_mutex, internal_mutex;
+    MemoryCharge internal_charge; // For internal_messages
+    uint64_t internal_dropped = 0; // Guarded by internal_mutex
+
+    // Keyed by namespace and key separated by a null character
+    std::unordered_map<std::string, KVEntry> kv_store;
+    uint64_t kv_version = 0;
+    MemoryCharge kv_charge; // For kv_store
+
+    ResponseCache response_cache;
+    DedupWindow dedup;
+    bool sampling = false; // Whether any client has sampled a team
+
+    BroadcastRing ring;
+
+    std::unordered_set<std::string> lossy_types;
+    LossyStats lossy_stats;
+    // Tokens are drawn straight from the OS, as anyone who can predict one can send
+    // datagrams as its client
+    std::random_device token_source;
+    // Token → the client it was offered to, whose position is updated when it moves
+    std::unordered_map<uint64_t, RoutingTable::Member> datagram_clients;
+    std::vector<std::vector<uint8_t>> datagram_batch;
+
+    ParsePool parse_pool;
+    std::vector<int> parsing_clients; // Sockets of clients with frames being parsed
+
+    BudgetStats budget_stats;
+
+    Lock clients_mutex, internal_mutex;
+
+    FairScheduler scheduler;
+
+    std::vector<Interceptor> interceptors[INTERCEPT_STAGE_COUNT];
+
+    std::unordered_map<std::string, uint32_t> team_sizes;
+    std::unordered_map<std::string, MembershipDelta> membership_changes;
 
     std::thread current_thread;
+    std::thread::id owner_thread; // Set by CheckThread()
     bool started = false;
 
     // File descriptors for listening sockets
     int unix_server = -1;
     int ip_server = -1;
+    int unix_datagram = -1;
+    int udp_datagram = -1;
+    uint16_t udp_port = 0;
 
-    std::string unix_path;
+    std::string unix_path, unix_datagram_path;
 
     // Libevent internals
     UEventBase ebase;
     UEvconnListener ip_listener, unix_listener;
-    UEvent interrupt_event, read_internal_event;
+    UEvent interrupt_event, read_internal_event, membership_event;
+    UEvent unix_datagram_event, udp_datagram_event, parse_event, budget_event;
+    std::optional<TimePoint> membership_due, budget_due; // On a virtual clock only
 
     EventCallbackData callback_data;
 };
 
+using Server = BasicServer<ThreadedPolicies>;
+using SingleThreadedServer = BasicServer<SingleThreadedPolicies>;
+using SimulatedServer = BasicServer<SimulatedPolicies>;
+
 }
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "client.hpp"
+#include "core.hpp"
+#include "policy.hpp"
+#include "server.hpp"
+#include "tb.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <vector>
+
+namespace buxtehude
+{
+
+// How messages travel between a simulated client and the server, in each direction
+struct LinkProfile
+{
+    std::chrono::microseconds latency { 0 };
+    std::chrono::microseconds jitter { 0 }; // Up to this much extra latency, at random
+    uint64_t bandwidth = 0; // Bytes per second, 0 for no limit
+};
+
+// A SimulatedServer with INTERNAL clients connected over simulated links, driven
+// from one thread on the VirtualClock. Nothing sleeps: the clock jumps to each event
+// as it runs. Events falling due together run in an order drawn from the seed, so
+// a seed replays a run exactly and different seeds try different interleavings.
+// Only one Simulation may run at a time, as the clock is shared.
+class Simulation
+{
+public:
+    using Clock = VirtualClock;
+    using Event = std::function<void()>;
+
+    explicit Simulation(uint64_t seed);
+    Simulation(const Simulation&) = delete;
+    ~Simulation();
+
+    tb::error<AllocError> Start();
+
+    // The client's handshake travels over its link like any other message
+    Client& AddClient(const ClientPreferences& preferences, LinkProfile profile = {});
+
+    // Runs 'event' once 'delay' of virtual time has passed
+    void Schedule(Clock::duration delay, Event&& event);
+
+    // Advances the clock to the next event and runs it. Returns false if there was
+    // none.
+    bool Step();
+    void RunFor(Clock::duration duration);
+    // Runs until done() holds, for at most 'limit'. Returns done().
+    bool RunUntil(const std::function<bool()>& done, Clock::duration limit);
+    // Runs until nothing is scheduled. A server with a memory budget always has
+    // its budget timer scheduled, so this never returns for one.
+    void RunUntilIdle();
+
+    Clock::time_point Now() const { return Clock::now(); }
+    size_t Pending() const { return events.size(); }
+    uint64_t Random() { return random(); }
+
+    SimulatedServer server;
+private:
+    struct Link;
+
+    // Each direction of a link delivers its messages in the order they were sent
+    struct Direction
+    {
+        std::deque<Message> in_flight;
+        Clock::time_point busy_until {}, last_due {};
+    };
+
+    struct Scheduled
+    {
+        Clock::time_point due;
+        uint64_t tiebreak, sequence;
+        Event event;
+    };
+
+    void Send(Link& link, Direction& direction, const Message& msg, bool upstream);
+    void Schedule(Clock::time_point due, Event&& event);
+    void WakeServer();
+
+    std::mt19937_64 random;
+    std::vector<Scheduled> events; // A heap, earliest first
+    uint64_t sequence = 0;
+    std::optional<Clock::time_point> server_wake;
+
+    // Destroyed before the server, disconnecting from it
+    std::vector<std::unique_ptr<Link>> links;
+};
+
+}
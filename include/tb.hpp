@@ -77,6 +77,10 @@ constexpr auto operator|(View&& view, range_to_t<T>&&)
     return T { view.begin(), view.end() };
 }
 
+// Combines lambdas into one visitor for std::visit
+template<typename... Lambdas>
+struct overloaded : Lambdas... { using Lambdas::operator()...; };
+
 template<typename Lambda> requires std::invocable<Lambda>
 struct scoped_guard
 {
@@ -0,0 +1,41 @@
+#include "budget.hpp"
+
+namespace buxtehude
+{
+
+// MemoryBudget
+
+MemoryBudget& MemoryBudget::Global()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+void MemoryBudget::SetLimits(size_t soft, size_t hard)
+{
+    soft_limit.store(soft, std::memory_order_relaxed);
+    hard_limit.store(hard, std::memory_order_relaxed);
+}
+
+bool MemoryBudget::OverSoft() const
+{
+    size_t limit = SoftLimit();
+    return limit && Used() > limit;
+}
+
+bool MemoryBudget::OverHard() const
+{
+    size_t limit = HardLimit();
+    return limit && Used() > limit;
+}
+
+// MemoryCharge
+
+void MemoryCharge::Set(size_t new_bytes)
+{
+    if (new_bytes > bytes) MemoryBudget::Global().Charge(new_bytes - bytes);
+    else if (new_bytes < bytes) MemoryBudget::Global().Release(bytes - new_bytes);
+    bytes = new_bytes;
+}
+
+}
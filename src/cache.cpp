@@ -0,0 +1,156 @@
+#include "cache.hpp"
+
+#include <functional>
+
+namespace buxtehude
+{
+
+// Team & type separated by a null character
+static std::string TypeKey(std::string_view team, std::string_view type)
+{
+    std::string key;
+    key.reserve(team.size() + type.size() + 1);
+    key.append(team).push_back('\0');
+    key.append(type);
+    return key;
+}
+
+void ResponseCache::SetTTL(std::string_view team, std::string_view type,
+                           std::chrono::milliseconds ttl)
+{
+    std::string type_key = TypeKey(team, type);
+    if (ttl.count() > 0) {
+        ttls.insert_or_assign(std::move(type_key), ttl);
+        return;
+    }
+
+    ttls.erase(type_key);
+    type_key.push_back('\0');
+    for (auto iter = entries.begin(); iter != entries.end();) {
+        auto next = std::next(iter);
+        if (iter->key.starts_with(type_key)) Erase(iter);
+        iter = next;
+    }
+}
+
+bool ResponseCache::Cacheable(std::string_view team, std::string_view type) const
+{
+    return !ttls.empty() && ttls.contains(TypeKey(team, type));
+}
+
+const json* ResponseCache::Find(std::string_view team, std::string_view type,
+                                const json& request, Clock::time_point now)
+{
+    auto found = index.find(Key(team, type, request));
+    if (found == index.end()) return nullptr;
+
+    EntryIter iter = found->second;
+    if (iter->expires <= now) {
+        Erase(iter);
+        return nullptr;
+    }
+    // Different requests with the same hash
+    if (iter->request != request) return nullptr;
+
+    entries.splice(entries.begin(), entries, iter);
+    return &iter->reply;
+}
+
+void ResponseCache::Insert(std::string_view team, std::string_view type,
+                           const json& request, const json& reply, Clock::time_point now)
+{
+    auto ttl = ttls.find(TypeKey(team, type));
+    if (ttl == ttls.end()) return;
+
+    std::string key = Key(team, type, request);
+    auto found = index.find(key);
+    if (found != index.end()) Erase(found->second);
+
+    // An estimate, the encoded sizes being close to what is held in memory
+    size_t size = key.size() + request.dump().size() + reply.dump().size();
+    if (size > capacity) return;
+
+    // TTLs too long for the clock never expire, rather than overflowing it
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::time_point::max() - now);
+    Clock::time_point expires = ttl->second < left ? now + ttl->second
+                                                   : Clock::time_point::max();
+
+    entries.push_front({ key, request, reply, expires, size });
+    index.emplace(std::move(key), entries.begin());
+    bytes += size;
+    Evict();
+    charge.Set(bytes);
+}
+
+void ResponseCache::SetCapacity(size_t new_capacity)
+{
+    capacity = new_capacity;
+    Evict();
+}
+
+std::string ResponseCache::Key(std::string_view team, std::string_view type,
+                               const json& request)
+{
+    std::string key = TypeKey(team, type);
+    key.push_back('\0');
+    size_t hash = std::hash<json> {}(request);
+    key.append(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    return key;
+}
+
+void ResponseCache::Erase(EntryIter iter)
+{
+    bytes -= iter->bytes;
+    index.erase(iter->key);
+    entries.erase(iter);
+    charge.Set(bytes);
+}
+
+void ResponseCache::Evict()
+{
+    while (bytes > capacity && !entries.empty())
+        Erase(std::prev(entries.end()));
+}
+
+// DedupWindow
+
+bool DedupWindow::Seen(std::string_view team, std::string_view key,
+                       Clock::time_point now)
+{
+    while (!entries.empty() && entries.front().seen + window <= now) {
+        hashes.erase(entries.front().hash);
+        entries.pop_front();
+    }
+    charge.Set(entries.size() * ENTRY_SIZE);
+
+    uint64_t hash = std::hash<std::string_view> {}(team);
+    hash ^= std::hash<std::string_view> {}(key) + 0x9e3779b97f4a7c15 + (hash << 6)
+        + (hash >> 2);
+
+    if (!hashes.insert(hash).second) {
+        ++duplicates;
+        return true;
+    }
+
+    entries.push_back({ now, hash });
+    while (entries.size() > capacity) {
+        hashes.erase(entries.front().hash);
+        entries.pop_front();
+    }
+    charge.Set(entries.size() * ENTRY_SIZE);
+
+    return false;
+}
+
+DedupStats DedupWindow::Stats() const
+{
+    return {
+        .entries = entries.size(),
+        .bytes = entries.size() * ENTRY_SIZE,
+        .duplicates = duplicates,
+        .false_positive_rate = entries.size() / 18446744073709551616.0
+    };
+}
+
+}
@@ -0,0 +1,93 @@
+#include "capability.hpp"
+
+#include <algorithm>
+
+namespace buxtehude
+{
+
+namespace
+{
+
+json AgreeOn(const json& a, const json& b)
+{
+    if (a.is_number() && b.is_number()) return std::min(a, b);
+    if (a.is_boolean() && b.is_boolean()) return a.get<bool>() && b.get<bool>();
+
+    if (a.is_array() && b.is_array()) {
+        json result = json::array();
+        for (const json& x : a)
+            if (std::ranges::find(b, x) != b.end()) result.push_back(x);
+        // Duplicates are dropped, so that either side may hold them
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    if (a.is_object() && b.is_object()) {
+        json result = json::object();
+        for (auto& [key, value] : a.items()) {
+            if (!b.contains(key)) continue;
+            json agreed = AgreeOn(value, b[key]);
+            if (!agreed.is_discarded()) result[key] = std::move(agreed);
+        }
+        return result;
+    }
+
+    if (a == b) return a;
+    return json::value_t::discarded;
+}
+
+}
+
+Capabilities& Capabilities::Add(Feature f, const json& p)
+{
+    mask |= Bit(f);
+    params[static_cast<size_t>(f)] = p.is_object() ? p : json::object();
+    return *this;
+}
+
+Capabilities& Capabilities::Remove(Feature f)
+{
+    mask &= ~Bit(f);
+    params[static_cast<size_t>(f)] = json::object();
+    return *this;
+}
+
+const json& Capabilities::Params(Feature f) const
+{
+    return params[static_cast<size_t>(f)];
+}
+
+Capabilities Capabilities::Negotiate(const Capabilities& other) const
+{
+    Capabilities result;
+    for (size_t i = 0; i < FEATURE_COUNT; ++i) {
+        auto f = static_cast<Feature>(i);
+        if (!Has(f) || !other.Has(f)) continue;
+        result.Add(f, AgreeOn(params[i], other.params[i]));
+    }
+    return result;
+}
+
+void to_json(json& j, const Capabilities& c)
+{
+    j = json::object();
+    for (size_t i = 0; i < FEATURE_COUNT; ++i) {
+        if (c.Has(static_cast<Feature>(i)))
+            j[std::string { FEATURE_NAMES[i] }] = c.params[i];
+    }
+}
+
+void from_json(const json& j, Capabilities& c)
+{
+    c = {};
+    if (!j.is_object()) return;
+
+    // Features unknown to this version are ignored
+    for (size_t i = 0; i < FEATURE_COUNT; ++i) {
+        auto iter = j.find(std::string { FEATURE_NAMES[i] });
+        if (iter != j.end()) c.Add(static_cast<Feature>(i), *iter);
+    }
+}
+
+}
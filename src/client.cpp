@@ -6,6 +6,8 @@
 
 #include <fmt/core.h>
 
+#include <unistd.h>
+
 namespace buxtehude
 {
 
@@ -17,6 +19,10 @@ Client::~Client()
         && std::this_thread::get_id() != current_thread.get_id()) {
         current_thread.join();
     }
+
+    CloseRing();
+    CloseDatagrams();
+    decode_pool.Stop();
 }
 
 Client::Client(const ClientPreferences& preferences) : preferences(preferences) {}
@@ -71,13 +77,14 @@ tb::error<ConnectError> Client::IPConnect(std::string_view hostname, uint16_t po
     return tb::ok;
 }
 
-tb::error<ConnectError> Client::UnixConnect(std::string_view path)
+tb::error<ConnectError> Client::UnixConnect(std::string_view path, SocketMode mode)
 {
     if (connected) return ConnectError { ConnectErrorType::ALREADY_CONNECTED };
 
     conn_type = ConnectionType::UNIX;
 
-    client_socket = socket(PF_LOCAL, SOCK_STREAM, 0);
+    client_socket = socket(PF_LOCAL,
+        mode == SocketMode::SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM, 0);
     if (client_socket == -1)
         return ConnectError { ConnectErrorType::SOCKET_ERROR, errno };
 
@@ -108,14 +115,16 @@ tb::error<ConnectError> Client::UnixConnect(std::string_view path)
     return tb::ok;
 }
 
-tb::error<ConnectError> Client::InternalConnect(Server& server)
+tb::error<ConnectError> Client::ConnectInternal(void* server,
+                                                const InternalServerLink& link)
 {
     if (connected) return ConnectError { ConnectErrorType::ALREADY_CONNECTED };
 
     conn_type = ConnectionType::INTERNAL;
 
-    server_ptr = &server;
-    server.Internal_AddClient(*this);
+    server_link = &link;
+    server_ptr = server;
+    link.add(server, *this);
     connected = true;
 
     // This can only fail if the server closes between the AddClient call and
@@ -137,20 +146,46 @@ tb::error<WriteError> Client::Write(const Message& msg)
     if (!connected) return WriteError {};
 
     if (conn_type == ConnectionType::INTERNAL) {
-        if (!server_ptr) return WriteError {};
-        server_ptr.load()->Internal_ReceiveFrom(*this, msg);
+        void* server = server_ptr;
+        if (!server) return WriteError {};
+        server_link->receive(server, *this, msg);
         return tb::ok;
     }
 
-    clearerr(stream.file);
+    // Filling in our own teamname lets the server forward the frame untouched
+    std::vector<uint8_t> frame = Message::Encode(msg, preferences.format,
+                                                 preferences.teamname);
+    if (WriteDatagram(msg.type, frame)) return tb::ok;
 
-    Message::WriteToStream(stream, msg, preferences.format).if_err([&] (int) {
+    TryWrite(frame).if_err([&] (int) {
         event_add(write_event.get(), nullptr);
     });
 
     return tb::ok;
 }
 
+tb::error<WriteError> Client::Write(const PreparedMessage& msg)
+{
+    if (!connected) return WriteError {};
+
+    if (conn_type == ConnectionType::INTERNAL) return Write(msg.GetMessage());
+    if (WriteDatagram(msg.GetMessage().type, msg.Frame())) return tb::ok;
+
+    TryWrite(msg.Frame()).if_err([&] (int) {
+        event_add(write_event.get(), nullptr);
+    });
+
+    return tb::ok;
+}
+
+PreparedMessage Client::Prepare(const Message& msg,
+                                std::initializer_list<json::json_pointer> slots)
+{
+    Message copy = msg;
+    copy.src = preferences.teamname;
+    return { copy, preferences.format, slots };
+}
+
 tb::error<WriteError> Client::Handshake()
 {
     SetupDefaultHandlers();
@@ -161,7 +196,8 @@ tb::error<WriteError> Client::Handshake()
             { "format", preferences.format },
             { "teamname", preferences.teamname },
             { "version", CURRENT_VERSION },
-            { "max-message-length", preferences.max_msg_length }
+            { "max-message-length", preferences.max_msg_length },
+            { "capabilities", preferences.capabilities }
         }
     });
 }
@@ -175,9 +211,24 @@ void Client::SetupDefaultHandlers()
             return;
         }
 
+        // Servers predating capabilities advertise none
+        c.negotiated = {};
+        if (m.content.contains("capabilities")) {
+            c.negotiated = c.preferences.capabilities.Negotiate(
+                m.content["capabilities"].get<Capabilities>());
+        }
+
         c.EraseHandler(std::string { MSG_HANDSHAKE });
     });
 
+    AddHandler(MSG_RING, [] (Client& c, const Message& m) {
+        c.OpenRing(m);
+    });
+
+    AddHandler(MSG_DATAGRAM, [] (Client& c, const Message& m) {
+        c.OpenDatagrams(m);
+    });
+
     AddHandler(MSG_ERROR, [] (Client& c, const Message& m) {
         if (!ValidateJSON(m.content, VALIDATE_SERVER_MESSAGE)) {
             logger(LogLevel::WARNING, "Erroneous server message");
@@ -200,6 +251,124 @@ tb::error<WriteError> Client::SetAvailable(std::string_view type, bool available
     });
 }
 
+tb::error<WriteError> Client::Subscribe(std::string_view team, bool subscribe)
+{
+    return Write({
+        .type { MSG_SUBSCRIBE },
+        .content = {
+            { "team", team },
+            { "subscribe", subscribe }
+        }
+    });
+}
+
+tb::error<WriteError> Client::RequestMembers(std::string_view team)
+{
+    Message request { .type { MSG_MEMBERS } };
+    if (!team.empty()) request.content = { { "team", team } };
+    return Write(request);
+}
+
+tb::error<WriteError> Client::Sample(std::string_view team, const SamplingRule& rule)
+{
+    Message request {
+        .type { MSG_SAMPLE },
+        .content = {
+            { "team", team },
+            { "sample", true },
+            { "every", rule.every },
+            { "rate", rule.rate }
+        }
+    };
+    if (!rule.key.empty()) {
+        request.content["key"] = rule.key;
+        request.content["fraction"] = rule.fraction;
+    }
+    return Write(request);
+}
+
+tb::error<WriteError> Client::StopSampling(std::string_view team)
+{
+    return Write({
+        .type { MSG_SAMPLE },
+        .content = {
+            { "team", team },
+            { "sample", false }
+        }
+    });
+}
+
+tb::error<WriteError> Client::Cache(std::string_view type, std::chrono::milliseconds ttl)
+{
+    return Write({
+        .type { MSG_CACHE },
+        .content = {
+            { "type", type },
+            { "ttl", ttl.count() }
+        }
+    });
+}
+
+tb::error<WriteError> Client::Get(std::string_view ns, std::string_view key)
+{
+    return Write({
+        .type { MSG_GET },
+        .content = {
+            { "namespace", ns },
+            { "key", key }
+        }
+    });
+}
+
+tb::error<WriteError> Client::Set(std::string_view ns, std::string_view key,
+                                  const json& value)
+{
+    return Write({
+        .type { MSG_SET },
+        .content = {
+            { "namespace", ns },
+            { "key", key },
+            { "value", value }
+        }
+    });
+}
+
+tb::error<WriteError> Client::CompareAndSet(std::string_view ns, std::string_view key,
+                                            const json& value, uint64_t version)
+{
+    return Write({
+        .type { MSG_CAS },
+        .content = {
+            { "namespace", ns },
+            { "key", key },
+            { "value", value },
+            { "version", version }
+        }
+    });
+}
+
+tb::error<WriteError> Client::Delete(std::string_view ns, std::string_view key)
+{
+    return Write({
+        .type { MSG_DELETE },
+        .content = {
+            { "namespace", ns },
+            { "key", key }
+        }
+    });
+}
+
+tb::error<WriteError> Client::Watch(std::string_view ns, bool watch)
+{
+    return Write({
+        .type { MSG_WATCH },
+        .content = {
+            { "namespace", ns },
+            { "watch", watch }
+        }
+    });
+}
+
 void Client::HandleMessage(const Message& msg)
 {
     if (msg.type.empty()) {
@@ -207,7 +376,14 @@ void Client::HandleMessage(const Message& msg)
         return;
     }
 
-    if (handlers.contains(msg.type)) handlers[msg.type](*this, msg);
+    auto iter = handlers.find(msg.type);
+    if (iter != handlers.end()) {
+        iter->second(*this, msg);
+        return;
+    }
+
+    auto lazy = lazy_handlers.find(msg.type);
+    if (lazy != lazy_handlers.end()) lazy->second(*this, LazyMessage { msg });
 }
 
 // Handlers
@@ -217,17 +393,34 @@ void Client::AddHandler(std::string_view type, Handler&& h)
     handlers.emplace(type, std::forward<Handler>(h));
 }
 
+void Client::AddLazyHandler(std::string_view type, LazyHandler&& h)
+{
+    lazy_handlers.emplace(type, std::move(h));
+}
+
 void Client::SetDisconnectHandler(DisconnectHandler&& h)
 {
     disconnect_handler = std::move(h);
 }
 
-void Client::EraseHandler(const std::string& type) { handlers.erase(type); }
+void Client::EraseHandler(const std::string& type)
+{
+    handlers.erase(type);
+    lazy_handlers.erase(type);
+}
 
-void Client::ClearHandlers() { handlers.clear(); }
+void Client::ClearHandlers()
+{
+    handlers.clear();
+    lazy_handlers.clear();
+}
 
 bool Client::Connected() const { return connected; }
 
+const Capabilities& Client::Negotiated() const { return negotiated; }
+
+uint64_t Client::DroppedDatagrams() const { return datagrams_dropped; }
+
 void Client::StartListening()
 {
     if (conn_type != ConnectionType::INTERNAL) {
@@ -240,14 +433,20 @@ void Client::Disconnect()
 {
     if (!connected) return;
     connected = false;
+    // The listening thread may be reading the ring, so it unmaps it when interrupted
+    StopWatchingRing();
+    CloseDatagrams();
 
     logger(LogLevel::DEBUG, "Disconnecting client");
 
-    if (conn_type != ConnectionType::INTERNAL && stream.file) {
+    if (conn_type != ConnectionType::INTERNAL && packets.fd != -1) {
+        event_active(interrupt_event.get(), 0, 0);
+        close(packets.fd);
+    } else if (conn_type != ConnectionType::INTERNAL && stream.file) {
         event_active(interrupt_event.get(), 0, 0);
         fclose(stream.file);
     } else if (conn_type == ConnectionType::INTERNAL && server_ptr) {
-        server_ptr.load()->Internal_RemoveClient(*this);
+        server_link->remove(server_ptr, *this);
     }
 
     if (disconnect_handler) disconnect_handler(*this);
@@ -266,13 +465,17 @@ void Client::Internal_Disconnect()
 
 void Client::Internal_Receive(const Message& msg)
 {
-    HandleMessage(msg);
+    if (server_link->deliver && server_ptr) server_link->deliver(server_ptr, *this, msg);
+    else HandleMessage(msg);
 }
 
 // Socket-based connections only
 
 tb::error<AllocError> Client::SetupEvents()
 {
+    decode_pool.Stop();
+    decoding.clear();
+
     ebase = make<UEventBase>(event_base_new());
     callback_data.ebase = ebase.get();
 
@@ -291,19 +494,44 @@ tb::error<AllocError> Client::SetupEvents()
                   callbacks::LoopInterruptCallback, &callback_data)
     );
 
-    if (!ebase || !read_event || !write_event || !interrupt_event) {
+    ring_event = make<UEvent>(
+        event_new(ebase.get(), -1, 0, callbacks::InternalReadCallback, &callback_data)
+    );
+
+    decode_event = make<UEvent>(
+        event_new(ebase.get(), -1, 0, callbacks::ParseReadyCallback, &callback_data)
+    );
+
+    if (!ebase || !read_event || !write_event || !interrupt_event || !ring_event
+        || !decode_event) {
         logger(LogLevel::WARNING, "Failed to create one or more libevent structures");
         return AllocError {};
     }
 
-    event_add(read_event.get(), &callbacks::DEFAULT_TIMEOUT);
+    if (preferences.decode_workers) {
+        decode_pool.Start(preferences.decode_workers, &Message::Deserialise, [this] {
+            event_active(decode_event.get(), 0, 0);
+        });
+    }
 
-    stream.file = fdopen(client_socket, "r+");
+    event_add(read_event.get(), &callbacks::DEFAULT_TIMEOUT);
 
-    setvbuf(stream.file, nullptr, _IONBF, 0);
     int flags = fcntl(client_socket, F_GETFL);
     fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
 
+    int socket_type = SOCK_STREAM;
+    socklen_t type_size = sizeof(socket_type);
+    getsockopt(client_socket, SOL_SOCKET, SO_TYPE, &socket_type, &type_size);
+    if (socket_type == SOCK_SEQPACKET) {
+        packets = PacketStream { client_socket, preferences.max_msg_length };
+        stream.file = nullptr;
+        return tb::ok;
+    }
+
+    packets = {};
+    stream.file = fdopen(client_socket, "r+");
+    setvbuf(stream.file, nullptr, _IONBF, 0);
+
     stream.ClearFields();
     stream.Await<MessageFormat>().Await<uint32_t>()
           .Then([this] (Stream& stream, Field& f) {
@@ -327,21 +555,138 @@ tb::error<AllocError> Client::SetupEvents()
 
 void Client::Read()
 {
+    if (packets.fd != -1) {
+        ReadPackets();
+        return;
+    }
+
     if (!stream.Read()) {
         if (stream.Status() == StreamStatus::REACHED_EOF) Disconnect();
         return;
     }
 
-    std::string_view data = stream[2].GetView();
+    Decode(stream[0].Get<MessageFormat>(), stream[2].GetView());
+
+    stream.Delete(stream[2]);
+    stream.Reset();
+}
+
+// Every packet of the batch received is handled at once
+void Client::ReadPackets()
+{
+    do {
+        auto packet = packets.Read();
+        if (packet.is_ok()) {
+            HandleFrame(packet.get_unchecked());
+            continue;
+        }
+
+        switch (packet.get_error()) {
+        case PacketError::REACHED_EOF:
+            Disconnect();
+            return;
+        case PacketError::TOO_LONG:
+            logger(LogLevel::WARNING, "Buffer size too big!");
+            break;
+        case PacketError::MALFORMED:
+            logger(LogLevel::WARNING, "Malformed packet!");
+            break;
+        case PacketError::NONE_READY:
+            return;
+        }
+    } while (packets.Buffered());
+}
+
+// A frame read whole, header included
+void Client::HandleFrame(std::span<const uint8_t> frame)
+{
+    MessageFormat format;
+    memcpy(&format, frame.data(), sizeof(MessageFormat));
+    if (format != MessageFormat::JSON && format != MessageFormat::MSGPACK) {
+        logger(LogLevel::WARNING, "Invalid message type!");
+        return;
+    }
+
+    Decode(format, {
+        reinterpret_cast<const char*>(frame.data()) + FRAME_HEADER_SIZE,
+        frame.size() - FRAME_HEADER_SIZE
+    });
+}
+
+// Large messages go to the decode workers. Messages after one still being decoded
+// wait behind it, however small.
+void Client::Decode(MessageFormat format, std::string_view body)
+{
+    if (!lazy_handlers.empty() && decoding.empty() && DispatchLazy(format, body)) return;
+
+    bool large = body.size() >= preferences.decode_threshold;
+    if (decode_pool.Running() && (large || !decoding.empty())) {
+        auto job = std::make_shared<ParseJob>(format, body);
+        if (large) decode_pool.Submit(job);
+        else ParsePool::Decode(*job, &Message::Deserialise);
+        decoding.push_back(std::move(job));
+        return;
+    }
 
     try {
-        HandleMessage(Message::Deserialise(stream[0].Get<MessageFormat>(), data));
+        HandleMessage(Message::Deserialise(format, body));
     } catch (const json::parse_error& e) {
         logger(LogLevel::WARNING, fmt::format("Error parsing message: {}", e.what()));
     }
+}
 
-    stream.Delete(stream[2]);
-    stream.Reset();
+// Messages for lazy handlers are handed over without decoding their content, and
+// messages no handler takes are dropped undecoded. The rest have only their content
+// left to decode. Returns false for large ones, left to the decode workers.
+bool Client::DispatchLazy(MessageFormat format, std::string_view body)
+{
+    std::optional<LazyMessage> msg;
+    try {
+        msg.emplace(format, body);
+    } catch (const json::parse_error& e) {
+        logger(LogLevel::WARNING, fmt::format("Error parsing message: {}", e.what()));
+        return true;
+    }
+
+    if (msg->type.empty()) return false;
+
+    if (!handlers.contains(msg->type)) {
+        auto iter = lazy_handlers.find(msg->type);
+        if (iter != lazy_handlers.end()) iter->second(*this, *msg);
+        return true;
+    }
+
+    if (decode_pool.Running() && body.size() >= preferences.decode_threshold)
+        return false;
+
+    try {
+        HandleMessage(msg->Materialise());
+    } catch (const json::parse_error& e) {
+        logger(LogLevel::WARNING, fmt::format("Error parsing message: {}", e.what()));
+    }
+    return true;
+}
+
+void Client::DispatchDecoded()
+{
+    while (!decoding.empty() && decoding.front()->ready.load(std::memory_order_acquire)) {
+        std::shared_ptr<ParseJob> job = std::move(decoding.front());
+        decoding.pop_front();
+
+        if (job->message) {
+            HandleMessage(*job->message);
+        } else {
+            logger(LogLevel::WARNING, fmt::format("Error parsing message: {}",
+                job->error));
+        }
+    }
+}
+
+tb::error<int> Client::TryWrite(std::span<const uint8_t> frame)
+{
+    if (packets.fd != -1) return packets.TryWrite(frame);
+    clearerr(stream.file);
+    return stream.TryWrite(frame);
 }
 
 void Client::Listen()
@@ -351,10 +696,22 @@ void Client::Listen()
         case EventType::READ_READY:
             Read();
             break;
+        case EventType::INTERNAL_READ_READY:
+            ReadRing();
+            break;
+        case EventType::PARSE_READY:
+            DispatchDecoded();
+            break;
         case EventType::INTERRUPT:
+            ring.Close();
             return;
         case EventType::WRITE_READY:
-            stream.Flush().if_err([&] (int) {
+            if (callback_data.fd == datagram_socket) {
+                std::lock_guard<std::mutex> guard(datagram_mutex);
+                SendDatagrams_NoLock();
+                break;
+            }
+            (packets.fd != -1 ? packets.Flush() : stream.Flush()).if_err([&] (int) {
                 event_add(write_event.get(), nullptr);
             });
             break;
@@ -364,4 +721,173 @@ void Client::Listen()
     }
 }
 
+// Broadcast ring
+
+void Client::OpenRing(const Message& msg)
+{
+    if (conn_type == ConnectionType::INTERNAL) return;
+    CloseRing();
+
+    auto leave = [this] () {
+        return Write({ .type { MSG_RING }, .content = { { "attached", false } } });
+    };
+
+    if (!msg.content.contains("name") || !msg.content["name"].is_string()
+        || !msg.content.contains("slot") || !msg.content["slot"].is_number_integer()) {
+        logger(LogLevel::WARNING, "Erroneous $$ring message");
+        leave().ignore_error();
+        return;
+    }
+
+    std::string name = msg.content["name"];
+    if (ring.Open(name, msg.content["slot"]).is_error()) {
+        logger(LogLevel::WARNING, fmt::format("Failed to open broadcast ring {}", name));
+        leave().ignore_error();
+        return;
+    }
+
+    watching_ring = true;
+    ring_thread = std::thread(&Client::WatchRing, this);
+}
+
+void Client::ReadRing()
+{
+    bool attached = ring.Drain(preferences.teamname, [this] (std::span<const uint8_t> f) {
+        if (connected) HandleFrame(f);
+    });
+
+    // Once detached, the server sends everything over the socket again
+    if (!attached) watching_ring = false;
+}
+
+void Client::WatchRing()
+{
+    while (watching_ring) {
+        uint32_t sequence = ring.Sequence();
+        if (ring.Pending()) event_active(ring_event.get(), 0, 0);
+        ring.Wait(sequence, std::chrono::milliseconds { 100 });
+    }
+}
+
+// Never called from the watching thread itself
+void Client::StopWatchingRing()
+{
+    watching_ring = false;
+    if (ring_thread.joinable()) ring_thread.join();
+}
+
+// Only once the listening thread is done with the ring
+void Client::CloseRing()
+{
+    StopWatchingRing();
+    ring.Close();
+}
+
+// Lossy datagrams
+
+void Client::OpenDatagrams(const Message& msg)
+{
+    if (conn_type == ConnectionType::INTERNAL) return;
+    CloseDatagrams();
+
+    if (!ValidateJSON(msg.content, VALIDATE_DATAGRAM)) {
+        logger(LogLevel::WARNING, "Erroneous $$datagram message");
+        return;
+    }
+
+    int fd = -1;
+    if (conn_type == ConnectionType::UNIX && msg.content.contains("path")
+        && msg.content["path"].is_string()) {
+        sockaddr_un addr;
+        addr.sun_family = AF_LOCAL;
+        std::string path = msg.content["path"];
+        size_t path_len = std::min(path.size(), sizeof(addr.sun_path) - 1);
+        memcpy(addr.sun_path, path.data(), path_len);
+        addr.sun_path[path_len] = '\0';
+
+        fd = socket(PF_LOCAL, SOCK_DGRAM, 0);
+        if (fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (conn_type == ConnectionType::INTERNET && msg.content.contains("port")
+               && msg.content["port"].is_number_unsigned()) {
+        sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(msg.content["port"].get<uint16_t>());
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(PF_INET, SOCK_DGRAM, 0);
+        if (fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd == -1) {
+        logger(LogLevel::WARNING, "Failed to open the datagram socket");
+        return;
+    }
+    evutil_make_socket_nonblocking(fd);
+
+    std::lock_guard<std::mutex> guard(datagram_mutex);
+    datagram_event = make<UEvent>(
+        event_new(ebase.get(), fd, 0, callbacks::ReadWriteCallback, &callback_data)
+    );
+    if (!datagram_event) {
+        close(fd);
+        return;
+    }
+
+    datagram_token = msg.content["token"];
+    lossy_types.clear();
+    for (const json& type : msg.content["types"]) {
+        if (type.is_string()) lossy_types.emplace(type.get<std::string>());
+    }
+    datagram_socket = fd;
+}
+
+// Queues the frame to be sent as a datagram, false if it must go over the socket
+bool Client::WriteDatagram(std::string_view type, std::span<const uint8_t> frame)
+{
+    if (datagram_socket == -1) return false;
+
+    std::lock_guard<std::mutex> guard(datagram_mutex);
+    if (datagram_socket == -1 || lossy_types.empty()
+        || !lossy_types.contains(std::string { type })
+        || sizeof(uint64_t) + frame.size() > MAX_DATAGRAM_SIZE) {
+        return false;
+    }
+
+    if (datagrams.size() == PACKET_BATCH) SendDatagrams_NoLock();
+
+    std::vector<uint8_t>& datagram = datagrams.emplace_back(sizeof(uint64_t));
+    memcpy(datagram.data(), &datagram_token, sizeof(uint64_t));
+    datagram.insert(datagram.end(), frame.begin(), frame.end());
+
+    // The listening thread sends the batch on its next pass
+    if (datagrams.size() == 1) event_active(datagram_event.get(), EV_WRITE, 0);
+    return true;
+}
+
+// Whatever the socket has no room for is dropped, never queued
+void Client::SendDatagrams_NoLock()
+{
+    if (datagram_socket == -1 || datagrams.empty()) return;
+    size_t sent = SendBatch(datagram_socket, datagrams);
+    datagrams_dropped += datagrams.size() - sent;
+    datagrams.clear();
+}
+
+void Client::CloseDatagrams()
+{
+    std::lock_guard<std::mutex> guard(datagram_mutex);
+    datagrams.clear();
+    lossy_types.clear();
+    datagram_event.reset();
+    if (datagram_socket != -1) close(datagram_socket);
+    datagram_socket = -1;
+    datagram_token = 0;
+}
+
 }
@@ -1,8 +1,12 @@
 #include "core.hpp"
 
 #include <fmt/core.h>
+#include <fmt/format.h>
 #include <event2/thread.h>
 
+#include <algorithm>
+#include <stdexcept>
+
 #include <signal.h>
 
 namespace buxtehude
@@ -16,6 +20,7 @@ void to_json(json& j, const Message& msg)
     if (!msg.dest.empty()) j["dest"] = msg.dest;
     if (!msg.src.empty()) j["src"] = msg.src;
     if (!msg.content.empty()) j["content"] = msg.content;
+    if (!msg.idempotency_key.empty()) j["idempotency_key"] = msg.idempotency_key;
 }
 
 void from_json(const json& j, Message& msg)
@@ -25,6 +30,7 @@ void from_json(const json& j, Message& msg)
     if (j.contains("type")) j["type"].get_to(msg.type);
     if (j.contains("only_first")) j["only_first"].get_to(msg.only_first);
     if (j.contains("content")) j["content"].get_to(msg.content);
+    if (j.contains("idempotency_key")) j["idempotency_key"].get_to(msg.idempotency_key);
 }
 
 // Logging & Library initialisation
@@ -37,12 +43,12 @@ void DefaultLog(LogLevel l, std::string_view message)
     fmt::print("[{}] {}\n", LEVEL_NAMES[static_cast<size_t>(l)], message);
 }
 
-void Initialise(LogCallback logcb, SignalHandler sigh)
+void Initialise(LogCallback logcb, SignalHandler sigh, bool thread_support)
 {
 #ifdef EVTHREAD_USE_PTHREADS_IMPLEMENTED
-    evthread_use_pthreads();
+    if (thread_support) evthread_use_pthreads();
 #elif EVTHREAD_USE_WINDOWS_THREADS_IMPLEMENTED
-    evthread_use_windows_threads();
+    if (thread_support) evthread_use_windows_threads();
 #else
     static_assert(0,
         "Buxtehude requires Libevent to have been built with thread support");
@@ -72,37 +78,128 @@ Message Message::Deserialise(MessageFormat f, std::string_view data)
     }
 }
 
-auto Message::WriteToStream(Stream& stream, const Message& message, MessageFormat f)
--> tb::error<int>
+std::vector<uint8_t> Message::Encode(const Message& message, MessageFormat f,
+                                     std::string_view src)
 {
-    constexpr size_t HEADER_SIZE = sizeof(uint32_t) + sizeof(MessageFormat);
-
     json object = message;
+    if (!src.empty()) object["src"] = src;
+    std::vector<uint8_t> data;
+
     switch (f) {
     case MessageFormat::JSON: {
         // nlohmann JSON does not offer a function for parsing JSON & writing through
         // an output adapter.
-        std::string data = object.dump();
-        uint32_t msg_len = data.size();
-
-        data.insert(data.begin(), HEADER_SIZE, '\0');
-        memcpy(data.data(), &f, sizeof(MessageFormat));
-        memcpy(data.data() + sizeof(MessageFormat), &msg_len, sizeof(uint32_t));
-
-        return stream.TryWrite(data);
+        std::string text = object.dump();
+        data.resize(FRAME_HEADER_SIZE + text.size());
+        memcpy(data.data() + FRAME_HEADER_SIZE, text.data(), text.size());
+        break;
     }
-    case MessageFormat::MSGPACK: {
-        std::vector<uint8_t> data;
+    case MessageFormat::MSGPACK:
         data.reserve(1024);
-        data.insert(data.begin(), HEADER_SIZE, '\0');
+        data.insert(data.begin(), FRAME_HEADER_SIZE, '\0');
         json::to_msgpack(object, data);
+        break;
+    }
+
+    uint32_t msg_len = data.size() - FRAME_HEADER_SIZE;
+    memcpy(data.data(), &f, sizeof(MessageFormat));
+    memcpy(data.data() + sizeof(MessageFormat), &msg_len, sizeof(uint32_t));
+
+    return data;
+}
+
+auto Message::WriteToStream(Stream& stream, const Message& message, MessageFormat f,
+                            std::string_view src) -> tb::error<int>
+{
+    return stream.TryWrite(Encode(message, f, src));
+}
+
+// EncodedMessage
+
+void EncodedMessage::SetOriginal(MessageFormat f, std::string_view body)
+{
+    original_format = f;
+    original_body = body;
+}
+
+const std::vector<uint8_t>& EncodedMessage::Frame(MessageFormat f)
+{
+    auto& frame = frames[Index(f)];
+    if (frame) return *frame;
+
+    if (f == original_format && !original_body.empty()) {
+        uint32_t msg_len = original_body.size();
+        frame.emplace(FRAME_HEADER_SIZE + msg_len);
+        memcpy(frame->data(), &f, sizeof(MessageFormat));
+        memcpy(frame->data() + sizeof(MessageFormat), &msg_len, sizeof(uint32_t));
+        memcpy(frame->data() + FRAME_HEADER_SIZE, original_body.data(), msg_len);
+    } else {
+        frame = encoder(message, f, {});
+    }
+
+    return *frame;
+}
+
+// PreparedMessage
+
+namespace
+{
 
-        uint32_t msg_len = data.size() - HEADER_SIZE;
-        memcpy(data.data(), &f, sizeof(MessageFormat));
-        memcpy(data.data() + sizeof(MessageFormat), &msg_len, sizeof(uint32_t));
+// Placeholders written into the slots, all 20 digits wide when written in decimal
+// and 8 bytes wide when written in MessagePack.
+constexpr uint64_t SLOT_SENTINEL = 18'000'000'000'000'000'000u;
+constexpr size_t JSON_SLOT_WIDTH = 20;
 
-        return stream.TryWrite(data);
+}
+
+PreparedMessage::PreparedMessage(const Message& m, MessageFormat f,
+                                 std::initializer_list<json::json_pointer> pointers)
+    : message(m), format(f)
+{
+    std::vector<uint64_t> initial;
+    uint64_t sentinel = SLOT_SENTINEL;
+    for (const json::json_pointer& ptr : pointers) {
+        json& value = message.content[ptr];
+        initial.push_back(value.is_number_unsigned() ? value.get<uint64_t>() : 0);
+        value = sentinel++;
     }
+
+    frame = Message::Encode(message, format);
+
+    // Find where each placeholder ended up in the frame
+    sentinel = SLOT_SENTINEL;
+    for (const json::json_pointer& ptr : pointers) {
+        std::vector<uint8_t> needle;
+        if (format == MessageFormat::JSON) {
+            std::string digits = std::to_string(sentinel);
+            needle.assign(digits.begin(), digits.end());
+        } else {
+            needle.push_back(0xcf); // uint64
+            for (int shift = 56; shift >= 0; shift -= 8)
+                needle.push_back(static_cast<uint8_t>(sentinel >> shift));
+        }
+        auto found = std::ranges::search(frame, needle);
+        if (found.empty())
+            throw std::invalid_argument("Slot missing from the encoded message");
+        slots.push_back({ ptr, static_cast<size_t>(found.begin() - frame.begin()) });
+        ++sentinel;
+    }
+
+    for (size_t i = 0; i < slots.size(); ++i) Set(i, initial[i]);
+}
+
+void PreparedMessage::Set(size_t slot, uint64_t value)
+{
+    Slot& s = slots[slot];
+    message.content[s.pointer] = value;
+
+    uint8_t* dest = frame.data() + s.offset;
+    if (format == MessageFormat::JSON) {
+        // Leading whitespace is valid JSON
+        fmt::format_to_n(dest, JSON_SLOT_WIDTH, "{:>{}}", value, JSON_SLOT_WIDTH);
+    } else {
+        for (int shift = 56; shift >= 0; shift -= 8)
+            *++dest = static_cast<uint8_t>(value >> shift);
     }
 }
 
@@ -154,6 +251,27 @@ void InternalReadCallback(evutil_socket_t fd, short what, void* data)
     event_base_loopbreak(ecdata->ebase);
 }
 
+void MembershipTimerCallback(evutil_socket_t fd, short what, void* data)
+{
+    auto* ecdata = static_cast<EventCallbackData*>(data);
+    ecdata->type = EventType::MEMBERSHIP_TIMER;
+    event_base_loopbreak(ecdata->ebase);
+}
+
+void ParseReadyCallback(evutil_socket_t fd, short what, void* data)
+{
+    auto* ecdata = static_cast<EventCallbackData*>(data);
+    ecdata->type = EventType::PARSE_READY;
+    event_base_loopbreak(ecdata->ebase);
+}
+
+void BudgetTimerCallback(evutil_socket_t fd, short what, void* data)
+{
+    auto* ecdata = static_cast<EventCallbackData*>(data);
+    ecdata->type = EventType::BUDGET_TIMER;
+    event_base_loopbreak(ecdata->ebase);
+}
+
 }
 
 }
@@ -1,10 +1,85 @@
 #include "io.hpp"
 
+#include <bit>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+
+#include <sys/socket.h>
 
 namespace buxtehude
 {
 
+namespace
+{
+
+constexpr size_t POOLED_SIZE_MIN = 1024 * 4;
+constexpr size_t POOL_CLASSES = 9; // 4 KiB to 1 MiB
+constexpr size_t POOL_CLASS_LIMIT = PACKET_BATCH * 4;
+
+// Each thread reads its own sockets, so buffers are pooled per thread. Buffers are
+// kept by power-of-two size classes and shared between field bodies and packets.
+thread_local MemoryCharge pool_charge;
+thread_local std::vector<std::vector<uint8_t>> buffer_pool[POOL_CLASSES];
+
+// The smallest class whose buffers hold 'size' bytes
+size_t SizeClass(size_t size)
+{
+    if (size <= POOLED_SIZE_MIN) return 0;
+    return std::bit_width((size - 1) / POOLED_SIZE_MIN);
+}
+
+// A buffer of 'size' bytes, with its capacity rounded up to a size class
+std::vector<uint8_t> TakeBuffer(size_t size)
+{
+    std::vector<uint8_t> buffer;
+    size_t size_class = SizeClass(size);
+    if (size_class >= POOL_CLASSES) {
+        buffer.resize(size);
+        return buffer;
+    }
+
+    auto& pool = buffer_pool[size_class];
+    if (pool.empty()) {
+        buffer.reserve(POOLED_SIZE_MIN << size_class);
+    } else {
+        buffer = std::move(pool.back());
+        pool.pop_back();
+        pool_charge.Set(pool_charge.Bytes() - buffer.capacity());
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+// Leaves 'released' empty, its buffer freed unless pooled
+void ReleaseBuffer(std::vector<uint8_t>&& released)
+{
+    std::vector<uint8_t> buffer = std::move(released);
+    // Once memory is short, buffers are freed rather than kept, pooled ones too
+    if (MemoryBudget::Global().OverSoft()) {
+        if (pool_charge.Bytes()) {
+            for (auto& pool : buffer_pool) pool.clear();
+            pool_charge.Set(0);
+        }
+        return;
+    }
+
+    size_t capacity = buffer.capacity();
+    if (capacity < POOLED_SIZE_MIN) return;
+
+    // The largest class the buffer can serve
+    size_t size_class = std::bit_width(capacity / POOLED_SIZE_MIN) - 1;
+    if (size_class >= POOL_CLASSES) return;
+
+    auto& pool = buffer_pool[size_class];
+    if (pool.size() >= POOL_CLASS_LIMIT) return;
+    buffer.clear();
+    pool.emplace_back(std::move(buffer));
+    pool_charge.Set(pool_charge.Bytes() + capacity);
+}
+
+}
+
 // Field
 
 Field& Field::operator[](int offset)
@@ -34,12 +109,71 @@ void Stream::Finally(Callback&& cb) { finally = std::move(cb); }
 FieldIterator Stream::Delete(Field& f)
 {
     FieldIterator iter_to_erase = f.self_iterator;
+    // Bodies go back to the pool, for whichever stream needs one next
+    if (f.data.capacity() >= POOLED_SIZE_MIN) ReleaseBuffer(std::move(f.data));
     deleted.emplace_back(std::move(f));
     return fields.erase(iter_to_erase);
 }
 
+void Stream::AddField(size_t len)
+{
+    FieldIterator iter = fields.emplace(fields.end(), len);
+    Field& new_field = *iter;
+    new_field.self_iterator = iter;
+
+    // Small fields, such as headers, are kept in 'deleted' for reuse
+    size_t initial = std::min(len, POOLED_SIZE_MIN);
+    if (deleted.empty()) {
+        new_field.data.reserve(initial);
+        return;
+    }
+
+    auto reusable = std::ranges::find_if(deleted,
+        [initial] (const Field& f) {
+            return f.data.capacity() >= initial;
+        }
+    );
+
+    if (reusable == deleted.end()) {
+        new_field.data.reserve(initial);
+        deleted.erase(deleted.begin());
+    } else {
+        new_field.data = std::move(reusable->data);
+        new_field.data.clear();
+        deleted.erase(reusable);
+    }
+}
+
+void Stream::Grow(Field& f)
+{
+    // Doubling, so a body takes a logarithmic number of reads and never more than
+    // twice the memory of what has arrived
+    size_t size = std::min(f.length, std::max(POOLED_SIZE_MIN, f.data.size() * 2));
+    if (size <= f.data.capacity()) {
+        f.data.resize(size);
+        return;
+    }
+
+    std::vector<uint8_t> buffer = TakeBuffer(size);
+    memcpy(buffer.data(), f.data.data(), data_offset);
+    ReleaseBuffer(std::move(f.data));
+    f.data = std::move(buffer);
+}
+
+void Stream::Account()
+{
+    if (output_buffer.empty() && output_buffer.capacity() > POOLED_SIZE_MIN)
+        std::vector<uint8_t>().swap(output_buffer);
+
+    size_t bytes = output_buffer.capacity();
+    for (const Field& f : fields) bytes += f.data.capacity();
+    for (const Field& f : deleted) bytes += f.data.capacity();
+    charge.Set(bytes);
+}
+
 bool Stream::Read()
 {
+    tb::scoped_guard account = [this] () { Account(); };
     done = false;
     while (true) {
         if (fields.empty()) {
@@ -49,21 +183,23 @@ bool Stream::Read()
 
         if (!is_at_valid_field || current == fields.end()) current = fields.begin();
         is_at_valid_field = true;
-        size_t expected = current->length - data_offset;
 
-        // Evil writing to vector through the data pointer, but we
-        // don't care about vector::size() anyways. cppreference says data()
-        // "may or may not" return nullptr. I think reserve() should guarantee
-        // a valid data pointer given no allocation failure.
-        size_t bytes_read
-            = fread(reinterpret_cast<uint8_t*>(current->data.data()) + data_offset, 1,
-                    expected, file);
+        // The field's data is sized to the room read into so far
+        Field& field = *current;
+        if (data_offset == field.data.size()) Grow(field);
+
+        size_t expected = field.data.size() - data_offset;
+        size_t bytes_read = fread(field.data.data() + data_offset, 1, expected, file);
 
         if (feof(file)) status = StreamStatus::REACHED_EOF;
         else status = StreamStatus::OKAY;
 
         data_offset += bytes_read;
-        if (data_offset < current->length) return false;
+        if (data_offset < field.length) {
+            // The room ran out before the data did
+            if (bytes_read == expected && status == StreamStatus::OKAY) continue;
+            return false;
+        }
 
         data_offset = 0;
         FieldIterator old_current = current;
@@ -103,6 +239,7 @@ void Stream::ClearFields()
     current = fields.end();
     status = StreamStatus::OKAY;
     data_offset = 0;
+    Account();
 }
 
 Field& Stream::operator[](int offset)
@@ -112,4 +249,221 @@ Field& Stream::operator[](int offset)
     return *iter;
 }
 
+// PacketStream
+
+namespace
+{
+
+bool WouldBlock(int error)
+{
+    return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS || error == EINTR;
+}
+
+}
+
+int ReceiveBatch(int fd, std::vector<std::vector<uint8_t>>& buffers,
+                 size_t (&sizes)[PACKET_BATCH])
+{
+    ReleaseBatch(buffers);
+
+#ifdef __linux__
+    mmsghdr messages[PACKET_BATCH] {};
+    iovec iovs[PACKET_BATCH];
+    for (size_t i = 0; i < PACKET_BATCH; ++i) {
+        std::vector<uint8_t>& buffer = buffers.emplace_back(TakeBuffer(MAX_PACKET_SIZE));
+        iovs[i] = { buffer.data(), MAX_PACKET_SIZE };
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(fd, messages, PACKET_BATCH, MSG_DONTWAIT, nullptr);
+    for (int i = 0; i < count; ++i) {
+        sizes[i] = messages[i].msg_hdr.msg_flags & MSG_TRUNC
+            ? SIZE_MAX : messages[i].msg_len;
+    }
+#else
+    std::vector<uint8_t>& buffer = buffers.emplace_back(TakeBuffer(MAX_PACKET_SIZE));
+    ssize_t size = recv(fd, buffer.data(), MAX_PACKET_SIZE, MSG_DONTWAIT);
+    int count = size < 0 ? -1 : 1;
+    if (count == 1) sizes[0] = size;
+#endif
+
+    // Buffers left empty go straight back to the pool
+    size_t filled = count > 0 ? count : 0;
+    while (buffers.size() > filled) {
+        ReleaseBuffer(std::move(buffers.back()));
+        buffers.pop_back();
+    }
+    return count;
+}
+
+void ReleaseBatch(std::vector<std::vector<uint8_t>>& buffers)
+{
+    for (auto& buffer : buffers) ReleaseBuffer(std::move(buffer));
+    buffers.clear();
+}
+
+size_t SendBatch(int fd, std::span<const std::vector<uint8_t>> packets)
+{
+    size_t sent = 0;
+#ifdef __linux__
+    mmsghdr messages[PACKET_BATCH] {};
+    iovec iovs[PACKET_BATCH];
+    while (sent < packets.size()) {
+        size_t count = std::min(PACKET_BATCH, packets.size() - sent);
+        for (size_t i = 0; i < count; ++i) {
+            const std::vector<uint8_t>& packet = packets[sent + i];
+            iovs[i] = { const_cast<uint8_t*>(packet.data()), packet.size() };
+            messages[i].msg_hdr.msg_iov = &iovs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int result = sendmmsg(fd, messages, count, MSG_DONTWAIT);
+        if (result <= 0) break;
+        sent += result;
+        if (static_cast<size_t>(result) < count) break;
+    }
+#else
+    for (; sent < packets.size(); ++sent) {
+        const std::vector<uint8_t>& packet = packets[sent];
+        if (send(fd, packet.data(), packet.size(), MSG_DONTWAIT) == -1) break;
+    }
+#endif
+    return sent;
+}
+
+PacketStream::~PacketStream()
+{
+    ReleaseBatch(batch);
+}
+
+auto PacketStream::Read() -> tb::result<std::span<const uint8_t>, PacketError>
+{
+    tb::scoped_guard account = [this] () { Account(); };
+
+    // The frame returned last time is no longer needed
+    if (!expected) {
+        if (partial.capacity() > MAX_PACKET_SIZE) std::vector<uint8_t>().swap(partial);
+        partial.clear();
+    }
+    // Nor are the packets received, once every one has been read
+    if (next == received) ReleaseBatch(batch);
+
+    while (true) {
+        if (next == received && !Receive())
+            return eof ? PacketError::REACHED_EOF : PacketError::NONE_READY;
+
+        size_t size = sizes[next];
+        std::span<const uint8_t> packet { batch[next].data(), size };
+        ++next;
+
+        // Truncated, which only happens if the peer ignores MAX_PACKET_SIZE
+        if (size > MAX_PACKET_SIZE) {
+            expected = 0;
+            return PacketError::MALFORMED;
+        }
+
+        if (skip) {
+            skip -= std::min(skip, size);
+            continue;
+        }
+
+        if (expected) {
+            partial.insert(partial.end(), packet.begin(), packet.end());
+            if (partial.size() < expected) continue;
+
+            bool complete = partial.size() == expected;
+            expected = 0;
+            if (!complete) return PacketError::MALFORMED;
+            return std::span<const uint8_t> { partial };
+        }
+
+        if (size < FRAME_HEADER_SIZE) return PacketError::MALFORMED;
+
+        uint32_t length;
+        memcpy(&length, packet.data() + sizeof(uint8_t), sizeof(uint32_t));
+        size_t frame_size = FRAME_HEADER_SIZE + length;
+
+        if (length > max_length) {
+            skip = frame_size - std::min(frame_size, size);
+            return PacketError::TOO_LONG;
+        }
+
+        if (size == frame_size) return packet;
+        if (size > frame_size) return PacketError::MALFORMED;
+
+        partial.reserve(frame_size);
+        partial.assign(packet.begin(), packet.end());
+        expected = frame_size;
+    }
+}
+
+bool PacketStream::Receive()
+{
+    next = received = 0;
+    int count = ReceiveBatch(fd, batch, sizes);
+    if (count < 0) {
+        eof = !WouldBlock(errno);
+        return false;
+    }
+
+    // Empty packets are never sent, so one marks the end of the connection
+    received = std::ranges::find(sizes, sizes + count, 0) - sizes;
+    eof = received < static_cast<size_t>(count) || count == 0;
+    return received;
+}
+
+tb::error<int> PacketStream::TryWrite(std::span<const uint8_t> frame)
+{
+    if (!output.empty()) {
+        Queue(frame);
+        return Flush();
+    }
+
+    for (size_t offset = 0; offset < frame.size(); offset += MAX_PACKET_SIZE) {
+        size_t size = std::min(MAX_PACKET_SIZE, frame.size() - offset);
+        if (send(fd, frame.data() + offset, size, 0) == -1) {
+            int error = errno;
+            if (!WouldBlock(error)) return error;
+            Queue(frame.subspan(offset));
+            Account();
+            return error;
+        }
+    }
+
+    return tb::ok;
+}
+
+tb::error<int> PacketStream::Flush()
+{
+    while (!output.empty()) {
+        const std::vector<uint8_t>& packet = output.front();
+        if (send(fd, packet.data(), packet.size(), 0) == -1) {
+            int error = errno;
+            // Nothing more will get through
+            if (!WouldBlock(error)) {
+                output.clear();
+                pending_bytes = 0;
+            }
+            Account();
+            return error;
+        }
+
+        pending_bytes -= packet.size();
+        output.pop_front();
+    }
+
+    Account();
+    return tb::ok;
+}
+
+void PacketStream::Queue(std::span<const uint8_t> data)
+{
+    for (size_t offset = 0; offset < data.size(); offset += MAX_PACKET_SIZE) {
+        size_t size = std::min(MAX_PACKET_SIZE, data.size() - offset);
+        output.emplace_back(data.begin() + offset, data.begin() + offset + size);
+        pending_bytes += size;
+    }
+}
+
 }
@@ -0,0 +1,524 @@
+#include "parse.hpp"
+
+#include <charconv>
+
+namespace buxtehude
+{
+
+namespace
+{
+
+constexpr size_t NOT_FOUND = std::string_view::npos;
+
+// An array index in a JSON pointer
+bool ArrayIndex(const std::string& token, uint64_t& index)
+{
+    if (token.empty() || (token.size() > 1 && token[0] == '0')) return false;
+    auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), index);
+    return error == std::errc {} && end == token.data() + token.size();
+}
+
+json DecodeValue(MessageFormat format, std::string_view value)
+{
+    if (format == MessageFormat::JSON) return json::parse(value);
+    return json::from_msgpack(value);
+}
+
+// JSON scanning. Values are only checked for structure, anything else is left to
+// the decoder.
+
+size_t SkipSpace(std::string_view data, size_t pos)
+{
+    while (pos < data.size() && (data[pos] == ' ' || data[pos] == '\t'
+           || data[pos] == '\n' || data[pos] == '\r')) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Past the closing quote of the string starting at 'pos'
+size_t SkipString(std::string_view data, size_t pos)
+{
+    for (++pos; pos < data.size(); ++pos) {
+        if (data[pos] == '\\') ++pos;
+        else if (data[pos] == '"') return pos + 1;
+    }
+    return NOT_FOUND;
+}
+
+// Past the value starting at 'pos'
+size_t SkipJSON(std::string_view data, size_t pos)
+{
+    if (pos >= data.size()) return NOT_FOUND;
+    if (data[pos] == '"') return SkipString(data, pos);
+
+    if (data[pos] != '{' && data[pos] != '[') {
+        size_t end = data.find_first_of(",:]} \t\n\r", pos);
+        if (end == pos) return NOT_FOUND;
+        return end == NOT_FOUND ? data.size() : end;
+    }
+
+    std::string closers;
+    while (pos < data.size()) {
+        char c = data[pos];
+        if (c == '"') {
+            pos = SkipString(data, pos);
+            if (pos == NOT_FOUND) return NOT_FOUND;
+            continue;
+        }
+
+        if (c == '{') {
+            closers.push_back('}');
+        } else if (c == '[') {
+            closers.push_back(']');
+        } else if (c == '}' || c == ']') {
+            if (closers.empty() || closers.back() != c) return NOT_FOUND;
+            closers.pop_back();
+            if (closers.empty()) return pos + 1;
+        }
+        ++pos;
+    }
+    return NOT_FOUND;
+}
+
+// Compares a key, quotes excluded, to an unescaped string
+bool KeyEquals(std::string_view key, std::string_view other)
+{
+    if (key.find('\\') == NOT_FOUND) return key == other;
+    std::string quoted;
+    quoted.append(1, '"').append(key).append(1, '"');
+    return json::parse(quoted).get<std::string>() == other;
+}
+
+// Calls visit(key, value) for each member of the object until it returns true,
+// the key without its quotes. False if the object is malformed.
+template<typename Visit>
+bool VisitMembers(std::string_view object, Visit&& visit)
+{
+    size_t pos = SkipSpace(object, 1);
+    if (pos < object.size() && object[pos] == '}') return true;
+
+    while (pos < object.size()) {
+        if (object[pos] != '"') return false;
+        size_t key_end = SkipString(object, pos);
+        if (key_end == NOT_FOUND) return false;
+        std::string_view key = object.substr(pos + 1, key_end - pos - 2);
+
+        pos = SkipSpace(object, key_end);
+        if (pos >= object.size() || object[pos] != ':') return false;
+        pos = SkipSpace(object, pos + 1);
+        size_t value_end = SkipJSON(object, pos);
+        if (value_end == NOT_FOUND) return false;
+        if (visit(key, object.substr(pos, value_end - pos))) return true;
+
+        pos = SkipSpace(object, value_end);
+        if (pos < object.size() && object[pos] == '}') return true;
+        if (pos >= object.size() || object[pos] != ',') return false;
+        pos = SkipSpace(object, pos + 1);
+    }
+    return false;
+}
+
+template<typename Visit>
+bool VisitElements(std::string_view array, Visit&& visit)
+{
+    size_t pos = SkipSpace(array, 1);
+    if (pos < array.size() && array[pos] == ']') return true;
+
+    while (pos < array.size()) {
+        size_t end = SkipJSON(array, pos);
+        if (end == NOT_FOUND) return false;
+        if (visit(array.substr(pos, end - pos))) return true;
+
+        pos = SkipSpace(array, end);
+        if (pos < array.size() && array[pos] == ']') return true;
+        if (pos >= array.size() || array[pos] != ',') return false;
+        pos = SkipSpace(array, pos + 1);
+    }
+    return false;
+}
+
+bool JSONString(std::string_view value, std::string& out)
+{
+    if (value.size() < 2 || value[0] != '"') return false;
+    if (value.find('\\') == NOT_FOUND) out = value.substr(1, value.size() - 2);
+    else out = json::parse(value).get<std::string>();
+    return true;
+}
+
+// The member or element of 'value' named by the token, empty if there is none.
+// Of duplicate keys the last counts, as with the full decoder.
+std::string_view FindJSON(std::string_view value, const std::string& token)
+{
+    std::string_view found;
+    if (value[0] == '{') {
+        VisitMembers(value, [&] (std::string_view key, std::string_view member) {
+            if (KeyEquals(key, token)) found = member;
+            return false;
+        });
+    } else if (uint64_t index; value[0] == '[' && ArrayIndex(token, index)) {
+        VisitElements(value, [&] (std::string_view element) {
+            if (index-- > 0) return false;
+            found = element;
+            return true;
+        });
+    }
+    return found;
+}
+
+// MessagePack scanning
+
+enum class MsgpackKind { OTHER, STRING, ARRAY, MAP };
+
+struct MsgpackHeader
+{
+    MsgpackKind kind = MsgpackKind::OTHER;
+    size_t size = 1; // Including any length
+    uint64_t payload = 0; // Bytes following the header
+    uint64_t children = 0; // Values following the payload, for arrays & maps
+};
+
+// False if the header at 'pos' is truncated or invalid
+bool ReadHeader(std::string_view data, size_t pos, MsgpackHeader& header)
+{
+    if (pos >= data.size()) return false;
+    auto b = static_cast<uint8_t>(data[pos]);
+    header = {};
+
+    // A length of 'bytes' bytes, big-endian, following the first byte
+    auto length = [&] (size_t bytes) {
+        if (data.size() - pos - 1 < bytes) return false;
+        uint64_t value = 0;
+        for (size_t i = 1; i <= bytes; ++i)
+            value = value << 8 | static_cast<uint8_t>(data[pos + i]);
+        header.size = 1 + bytes;
+        header.payload = value;
+        return true;
+    };
+    auto container = [&] (MsgpackKind kind, size_t bytes) {
+        if (!length(bytes)) return false;
+        header.kind = kind;
+        header.children = header.payload * (kind == MsgpackKind::MAP ? 2 : 1);
+        header.payload = 0;
+        return true;
+    };
+
+    if (b <= 0x7f || b >= 0xe0 || b == 0xc0 || b == 0xc2 || b == 0xc3) return true;
+    if (b <= 0x8f) {
+        header.kind = MsgpackKind::MAP;
+        header.children = (b & 0x0f) * 2;
+        return true;
+    }
+    if (b <= 0x9f) {
+        header.kind = MsgpackKind::ARRAY;
+        header.children = b & 0x0f;
+        return true;
+    }
+    if (b <= 0xbf) {
+        header.kind = MsgpackKind::STRING;
+        header.payload = b & 0x1f;
+        return true;
+    }
+
+    switch (b) {
+    case 0xc4: return length(1);
+    case 0xc5: return length(2);
+    case 0xc6: return length(4);
+    // Extensions are followed by their type
+    case 0xc7: return length(1) && ++header.payload;
+    case 0xc8: return length(2) && ++header.payload;
+    case 0xc9: return length(4) && ++header.payload;
+    case 0xca: header.payload = 4; return true;
+    case 0xcb: header.payload = 8; return true;
+    case 0xcc: case 0xd0: header.payload = 1; return true;
+    case 0xcd: case 0xd1: header.payload = 2; return true;
+    case 0xce: case 0xd2: header.payload = 4; return true;
+    case 0xcf: case 0xd3: header.payload = 8; return true;
+    case 0xd4: header.payload = 2; return true;
+    case 0xd5: header.payload = 3; return true;
+    case 0xd6: header.payload = 5; return true;
+    case 0xd7: header.payload = 9; return true;
+    case 0xd8: header.payload = 17; return true;
+    case 0xd9: header.kind = MsgpackKind::STRING; return length(1);
+    case 0xda: header.kind = MsgpackKind::STRING; return length(2);
+    case 0xdb: header.kind = MsgpackKind::STRING; return length(4);
+    case 0xdc: return container(MsgpackKind::ARRAY, 2);
+    case 0xdd: return container(MsgpackKind::ARRAY, 4);
+    case 0xde: return container(MsgpackKind::MAP, 2);
+    case 0xdf: return container(MsgpackKind::MAP, 4);
+    default: return false;
+    }
+}
+
+// Past the value starting at 'pos', jumping over strings & binary data
+size_t SkipMsgpack(std::string_view data, size_t pos)
+{
+    MsgpackHeader header;
+    for (uint64_t remaining = 1; remaining > 0; --remaining) {
+        if (!ReadHeader(data, pos, header)) return NOT_FOUND;
+        if (header.payload > data.size() - pos - header.size) return NOT_FOUND;
+        pos += header.size + header.payload;
+        // Every value takes a byte at least, which bounds the count
+        if (header.children > data.size() - pos) return NOT_FOUND;
+        remaining += header.children;
+    }
+    return pos;
+}
+
+std::optional<std::string_view> MsgpackString(std::string_view value)
+{
+    MsgpackHeader header;
+    if (!ReadHeader(value, 0, header) || header.kind != MsgpackKind::STRING
+        || header.payload > value.size() - header.size) {
+        return std::nullopt;
+    }
+    return value.substr(header.size, header.payload);
+}
+
+// Calls visit(key, value) for each pair of the map until it returns true. False if
+// the map is malformed.
+template<typename Visit>
+bool VisitPairs(std::string_view map, const MsgpackHeader& header, Visit&& visit)
+{
+    size_t pos = header.size;
+    for (uint64_t i = 0; i < header.children / 2; ++i) {
+        size_t key_end = SkipMsgpack(map, pos);
+        if (key_end == NOT_FOUND) return false;
+        size_t value_end = SkipMsgpack(map, key_end);
+        if (value_end == NOT_FOUND) return false;
+
+        if (visit(map.substr(pos, key_end - pos), map.substr(key_end, value_end - key_end)))
+            return true;
+        pos = value_end;
+    }
+    return true;
+}
+
+// As FindJSON
+std::string_view FindMsgpack(std::string_view value, const std::string& token)
+{
+    MsgpackHeader header;
+    if (!ReadHeader(value, 0, header)) return {};
+
+    std::string_view found;
+    if (header.kind == MsgpackKind::MAP) {
+        VisitPairs(value, header, [&] (std::string_view key, std::string_view member) {
+            if (MsgpackString(key) == token) found = member;
+            return false;
+        });
+    } else if (uint64_t index; header.kind == MsgpackKind::ARRAY
+               && ArrayIndex(token, index) && index < header.children) {
+        size_t pos = header.size;
+        for (; index > 0 && pos != NOT_FOUND; --index) pos = SkipMsgpack(value, pos);
+        size_t end = pos == NOT_FOUND ? NOT_FOUND : SkipMsgpack(value, pos);
+        if (end != NOT_FOUND) found = value.substr(pos, end - pos);
+    }
+    return found;
+}
+
+}
+
+// LazyMessage
+
+LazyMessage::LazyMessage(MessageFormat format, std::string_view body) : format(format)
+{
+    bool scanned = format == MessageFormat::JSON ? ScanJSON(body) : ScanMsgpack(body);
+    if (scanned) return;
+
+    // Whatever the scan could not make sense of is left to the full decoder, which
+    // throws if the body is malformed
+    Message msg = Message::Deserialise(format, body);
+    dest = std::move(msg.dest);
+    src = std::move(msg.src);
+    type = std::move(msg.type);
+    only_first = msg.only_first;
+    idempotency_key = std::move(msg.idempotency_key);
+    owned = std::move(msg.content);
+    content = {};
+}
+
+LazyMessage::LazyMessage(const Message& message)
+    : dest(message.dest), src(message.src), type(message.type),
+      only_first(message.only_first), idempotency_key(message.idempotency_key),
+      borrowed(&message.content) {}
+
+std::optional<json> LazyMessage::At(const json::json_pointer& pointer) const
+{
+    if (const json* decoded = Decoded()) {
+        if (!decoded->contains(pointer)) return std::nullopt;
+        return decoded->at(pointer);
+    }
+    if (content.empty()) return std::nullopt;
+
+    // Tokens come off the back of a pointer
+    std::vector<std::string> tokens;
+    for (json::json_pointer rest = pointer; !rest.empty(); rest.pop_back())
+        tokens.push_back(rest.back());
+
+    std::string_view value = content;
+    for (auto token = tokens.rbegin(); token != tokens.rend(); ++token) {
+        value = format == MessageFormat::JSON ?
+            FindJSON(value, *token) : FindMsgpack(value, *token);
+        if (value.empty()) return std::nullopt;
+    }
+
+    return DecodeValue(format, value);
+}
+
+std::optional<json> LazyMessage::At(std::string_view pointer) const
+{
+    return At(json::json_pointer { std::string { pointer } });
+}
+
+json LazyMessage::Content() const
+{
+    if (const json* decoded = Decoded()) return *decoded;
+    if (content.empty()) return {};
+    return DecodeValue(format, content);
+}
+
+Message LazyMessage::Materialise() const
+{
+    Message msg;
+    msg.dest = dest;
+    msg.src = src;
+    msg.type = type;
+    msg.only_first = only_first;
+    msg.idempotency_key = idempotency_key;
+    msg.content = Content();
+    return msg;
+}
+
+// Only the structure of the body is checked, along with the fields other than
+// the content. Keys with escapes are left to the full decoder.
+bool LazyMessage::ScanJSON(std::string_view body)
+{
+    size_t start = SkipSpace(body, 0);
+    size_t end = SkipJSON(body, start);
+    if (end == NOT_FOUND || body[start] != '{' || SkipSpace(body, end) != body.size())
+        return false;
+
+    bool valid = true;
+    bool object = VisitMembers(body.substr(start, end - start),
+      [&] (std::string_view key, std::string_view value) {
+        if (key == "type") valid = JSONString(value, type);
+        else if (key == "dest") valid = JSONString(value, dest);
+        else if (key == "src") valid = JSONString(value, src);
+        else if (key == "idempotency_key") valid = JSONString(value, idempotency_key);
+        else if (key == "content") content = value;
+        else if (key == "only_first") {
+            valid = value == "true" || value == "false";
+            only_first = value == "true";
+        } else if (key.find('\\') != NOT_FOUND) valid = false;
+        return !valid;
+    });
+
+    return object && valid;
+}
+
+bool LazyMessage::ScanMsgpack(std::string_view body)
+{
+    MsgpackHeader header;
+    if (SkipMsgpack(body, 0) != body.size() || !ReadHeader(body, 0, header)
+        || header.kind != MsgpackKind::MAP) {
+        return false;
+    }
+
+    bool valid = true;
+    auto string = [&valid] (std::string_view value, std::string& out) {
+        auto s = MsgpackString(value);
+        if (s) out = *s;
+        valid = s.has_value();
+    };
+
+    VisitPairs(body, header, [&] (std::string_view key_value, std::string_view value) {
+        auto key = MsgpackString(key_value);
+        if (!key) valid = false;
+        else if (*key == "type") string(value, type);
+        else if (*key == "dest") string(value, dest);
+        else if (*key == "src") string(value, src);
+        else if (*key == "idempotency_key") string(value, idempotency_key);
+        else if (*key == "content") content = value;
+        else if (*key == "only_first") {
+            valid = value == "\xc2" || value == "\xc3";
+            only_first = value == "\xc3";
+        }
+        return !valid;
+    });
+
+    return valid;
+}
+
+ParsePool::~ParsePool()
+{
+    Stop();
+}
+
+void ParsePool::Start(uint32_t workers, Decoder new_decoder,
+                      std::function<void()>&& new_on_ready)
+{
+    Stop();
+    decoder = new_decoder;
+    on_ready = std::move(new_on_ready);
+    stopping = false;
+
+    for (uint32_t i = 0; i < workers; ++i)
+        threads.emplace_back(&ParsePool::Work, this);
+}
+
+void ParsePool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+}
+
+void ParsePool::Submit(std::shared_ptr<ParseJob> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void ParsePool::Decode(ParseJob& job, Decoder decoder)
+{
+    try {
+        job.message = decoder(job.format, job.Body());
+    } catch (const json::parse_error& e) {
+        job.error = e.what();
+    }
+
+    job.ready.store(true, std::memory_order_release);
+    job.ready.notify_all();
+}
+
+void ParsePool::Wait(const ParseJob& job)
+{
+    job.ready.wait(false, std::memory_order_acquire);
+}
+
+void ParsePool::Work()
+{
+    while (true) {
+        std::shared_ptr<ParseJob> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        Decode(*job, decoder);
+        on_ready();
+    }
+}
+
+}
@@ -0,0 +1,294 @@
+#include "ring.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#else
+#include <thread>
+#endif
+
+namespace buxtehude
+{
+
+constexpr uint32_t RING_MAGIC = 0x62757872; // "buxr"
+constexpr uint32_t RING_VERSION = 0;
+
+namespace detail
+{
+
+// RingMapping
+
+RingMapping::RingMapping(RingMapping&& other) noexcept
+    : header(other.header), data(other.data), size(other.size)
+{
+    other.header = nullptr;
+    other.data = nullptr;
+    other.size = 0;
+}
+
+RingMapping& RingMapping::operator=(RingMapping&& other) noexcept
+{
+    std::swap(header, other.header);
+    std::swap(data, other.data);
+    std::swap(size, other.size);
+    return *this;
+}
+
+RingMapping::~RingMapping()
+{
+    if (header) munmap(header, size);
+}
+
+tb::error<int> RingMapping::Map(int fd, size_t map_size)
+{
+    void* ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) return errno;
+
+    if (header) munmap(header, size);
+    header = static_cast<RingHeader*>(ptr);
+    data = static_cast<uint8_t*>(ptr) + sizeof(RingHeader);
+    size = map_size;
+    return tb::ok;
+}
+
+bool RingMapping::Next(uint64_t& pos, uint64_t end, std::string_view team, int slot,
+                       std::span<const uint8_t>& frame) const
+{
+    uint64_t capacity = header->capacity;
+
+    while (pos < end) {
+        uint64_t offset = pos % capacity;
+        uint64_t remaining = capacity - offset;
+        // Too little space for a padding record was left unmarked
+        if (remaining < sizeof(RecordHeader)) {
+            pos += remaining;
+            continue;
+        }
+
+        RecordHeader record;
+        memcpy(&record, data + offset, sizeof(RecordHeader));
+        // Only possible if the record was overwritten as it was being read
+        if (record.size < sizeof(RecordHeader) || record.size > remaining) return false;
+
+        uint64_t record_pos = pos;
+        pos += record.size;
+        if (record.frame_size == UINT32_MAX) continue;
+        if (sizeof(RecordHeader) + record.dest_size + record.frame_size > record.size)
+            return false;
+
+        const uint8_t* body = data + record_pos % capacity + sizeof(RecordHeader);
+        std::string_view dest { reinterpret_cast<const char*>(body), record.dest_size };
+        if (record.exclude == slot || (dest != team && dest != MSG_ALL)) continue;
+
+        frame = { body + record.dest_size, record.frame_size };
+        return true;
+    }
+
+    return false;
+}
+
+}
+
+// BroadcastRing
+
+std::string BroadcastRing::UniqueName()
+{
+    // Shared by servers of every kind, which differ in their policies only
+    static std::atomic<uint32_t> created = 0;
+    return "/buxtehude-" + std::to_string(getpid()) + "-" + std::to_string(created++);
+}
+
+tb::error<int> BroadcastRing::Create(std::string_view ring_name, size_t capacity)
+{
+    Destroy();
+
+    capacity = (capacity + 7) & ~size_t { 7 };
+    name = ring_name;
+    size_t size = sizeof(detail::RingHeader) + capacity;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) return errno;
+    tb::scoped_guard fd_guard = [fd] () { close(fd); };
+
+    if (ftruncate(fd, size) == -1 || mapping.Map(fd, size).is_error()) {
+        int error = errno;
+        shm_unlink(name.c_str());
+        name.clear();
+        return error;
+    }
+
+    detail::RingHeader* header = mapping.header;
+    header->magic = RING_MAGIC;
+    header->version = RING_VERSION;
+    header->capacity = capacity;
+    header->write_pos.store(0, std::memory_order_relaxed);
+    for (auto& cursor : header->cursors) cursor.store(RING_DETACHED);
+
+    write_pos = 0;
+    readers = 0;
+    std::fill(std::begin(attached), std::end(attached), false);
+    return tb::ok;
+}
+
+void BroadcastRing::Destroy()
+{
+    if (!mapping.header) return;
+
+    // Wakes readers, who find themselves detached
+    for (auto& cursor : mapping.header->cursors) cursor.store(RING_DETACHED);
+    Notify();
+
+    shm_unlink(name.c_str());
+    mapping = {};
+    name.clear();
+}
+
+int BroadcastRing::Attach()
+{
+    if (!mapping.header) return -1;
+
+    auto iter = std::ranges::find(attached, false);
+    if (iter == std::end(attached)) return -1;
+
+    int slot = iter - std::begin(attached);
+    *iter = true;
+    ++readers;
+    mapping.header->cursors[slot].store(write_pos, std::memory_order_release);
+    return slot;
+}
+
+uint64_t BroadcastRing::Detach(int slot)
+{
+    if (!mapping.header || slot < 0 || !attached[slot]) return RING_DETACHED;
+    attached[slot] = false;
+    --readers;
+    return mapping.header->cursors[slot].exchange(RING_DETACHED,
+                                                  std::memory_order_acq_rel);
+}
+
+void BroadcastRing::Unread(uint64_t pos, std::string_view team, int slot,
+                           std::vector<std::vector<uint8_t>>& frames) const
+{
+    std::span<const uint8_t> frame;
+    while (mapping.Next(pos, write_pos, team, slot, frame))
+        frames.emplace_back(frame.begin(), frame.end());
+}
+
+auto BroadcastRing::DetachBefore(uint64_t pos) -> std::vector<std::pair<int, uint64_t>>
+{
+    std::vector<std::pair<int, uint64_t>> detached;
+    for (int slot = 0; slot < static_cast<int>(RING_READERS); ++slot) {
+        if (!attached[slot]) continue;
+
+        std::atomic<uint64_t>& cursor = mapping.header->cursors[slot];
+        if (cursor.load(std::memory_order_acquire) >= pos) continue;
+
+        // The reader may have moved on since, the exchange says where it stopped
+        uint64_t last = cursor.exchange(RING_DETACHED, std::memory_order_acq_rel);
+        attached[slot] = false;
+        --readers;
+        detached.emplace_back(slot, last);
+    }
+    return detached;
+}
+
+void BroadcastRing::Write(uint64_t pos, const detail::RecordHeader& record,
+                          std::string_view dest, std::span<const uint8_t> frame)
+{
+    uint8_t* target = mapping.data + pos % mapping.header->capacity;
+    memcpy(target, &record, sizeof(record));
+    memcpy(target + sizeof(record), dest.data(), dest.size());
+    memcpy(target + sizeof(record) + dest.size(), frame.data(), frame.size());
+}
+
+void BroadcastRing::Notify()
+{
+    detail::RingHeader* header = mapping.header;
+    // Sequentially consistent, so either the waiter sees the new sequence or we
+    // see the waiter
+    header->sequence.fetch_add(1);
+#ifdef __linux__
+    if (header->waiters.load()) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->sequence), FUTEX_WAKE,
+                INT_MAX, nullptr, nullptr, 0);
+    }
+#endif
+}
+
+// RingReader
+
+tb::error<int> RingReader::Open(std::string_view name, int reader_slot)
+{
+    Close();
+    if (reader_slot < 0 || reader_slot >= static_cast<int>(RING_READERS)) return EINVAL;
+
+    int fd = shm_open(std::string { name }.c_str(), O_RDWR, 0);
+    if (fd == -1) return errno;
+    tb::scoped_guard fd_guard = [fd] () { close(fd); };
+
+    struct stat info;
+    if (fstat(fd, &info) == -1) return errno;
+    if (static_cast<size_t>(info.st_size) < sizeof(detail::RingHeader)) return EINVAL;
+    if (mapping.Map(fd, info.st_size).is_error()) return errno;
+
+    detail::RingHeader* header = mapping.header;
+    if (header->magic != RING_MAGIC || header->version != RING_VERSION
+        || header->capacity + sizeof(detail::RingHeader) > mapping.size) {
+        mapping = {};
+        return EINVAL;
+    }
+
+    slot = reader_slot;
+    return tb::ok;
+}
+
+void RingReader::Close()
+{
+    mapping = {};
+    slot = -1;
+}
+
+bool RingReader::Pending() const
+{
+    if (!Attached()) return false;
+    uint64_t cursor = mapping.header->cursors[slot].load(std::memory_order_acquire);
+    return cursor == RING_DETACHED
+        || cursor != mapping.header->write_pos.load(std::memory_order_acquire);
+}
+
+uint32_t RingReader::Sequence() const
+{
+    return mapping.header->sequence.load(std::memory_order_acquire);
+}
+
+void RingReader::Wait(uint32_t sequence, std::chrono::milliseconds timeout)
+{
+    detail::RingHeader* header = mapping.header;
+#ifdef __linux__
+    timespec ts {
+        .tv_sec = static_cast<time_t>(timeout.count() / 1000),
+        .tv_nsec = static_cast<long>(timeout.count() % 1000 * 1'000'000)
+    };
+    header->waiters.fetch_add(1);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->sequence), FUTEX_WAIT,
+            sequence, &ts, nullptr, 0);
+    header->waiters.fetch_sub(1);
+#else
+    // Without futexes, poll at a short interval
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (header->sequence.load(std::memory_order_acquire) == sequence
+           && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
+    }
+#endif
+}
+
+}
@@ -0,0 +1,80 @@
+#include "schedule.hpp"
+
+#include <algorithm>
+
+namespace buxtehude
+{
+
+void FairScheduler::SetQoS(std::string_view team, TeamQoS qos)
+{
+    if (qos.weight == 0) qos.weight = 1;
+    configured.insert_or_assign(std::string { team }, qos);
+
+    // Teams that are currently queued keep their class until they are drained
+    auto iter = teams.find(std::string { team });
+    if (iter != teams.end()) iter->second.qos.weight = qos.weight;
+}
+
+void FairScheduler::Enqueue(std::string_view team, int id)
+{
+    TeamQueue& queue = GetTeam(team);
+    queue.ready.push_back(id);
+    ++pending;
+
+    if (queue.active) return;
+    queue.active = true;
+    active[static_cast<size_t>(queue.qos.qos_class)].push_back(&queue);
+}
+
+void FairScheduler::Remove(int id)
+{
+    for (auto& [name, queue] : teams)
+        pending -= std::erase(queue.ready, id);
+}
+
+auto FairScheduler::GetTeam(std::string_view team) -> TeamQueue&
+{
+    std::string name { team };
+    auto iter = teams.find(name);
+    if (iter != teams.end()) {
+        if (!iter->second.active) {
+            auto qos = configured.find(name);
+            if (qos != configured.end()) iter->second.qos = qos->second;
+        }
+        return iter->second;
+    }
+
+    TeamQueue& queue = teams[name];
+    auto qos = configured.find(name);
+    if (qos != configured.end()) queue.qos = qos->second;
+    return queue;
+}
+
+// Sampler
+
+Sampler::Sampler(uint32_t every, uint32_t rate, double fraction)
+    : every(every ? every : 1), rate(rate)
+{
+    if (fraction >= 1) threshold = UINT64_MAX;
+    else if (fraction <= 0) threshold = 0;
+    else threshold = static_cast<uint64_t>(fraction * static_cast<double>(UINT64_MAX));
+}
+
+bool Sampler::Take(uint64_t key_hash, Clock::time_point now)
+{
+    if (threshold != UINT64_MAX && key_hash >= threshold) return false;
+
+    if (++skipped < every) return false;
+    skipped = 0;
+
+    if (!rate) return true;
+    if (now - second_start >= std::chrono::seconds { 1 }) {
+        second_start = now;
+        taken_this_second = 0;
+    }
+    if (taken_this_second == rate) return false;
+    ++taken_this_second;
+    return true;
+}
+
+}
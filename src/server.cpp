@@ -5,22 +5,86 @@
 #include "client.hpp"
 #include "tb.hpp"
 
+#include <cassert>
 #include <ranges>
 
+#include <poll.h>
 #include <unistd.h>
 
 namespace buxtehude
 {
 
+// Transports
+
+tb::error<WriteError> SocketTransport::Write(const Message& m, MessageFormat f)
+{
+    return Write(Message::Encode(m, f));
+}
+
+tb::error<WriteError> SocketTransport::Write(const std::vector<uint8_t>& frame)
+{
+    TryWrite(frame).if_err([&] (int) {
+        event_add(write_event.get(), nullptr);
+    });
+
+    return tb::ok;
+}
+
+void SocketTransport::Close()
+{
+    if (Packets()) close(packets.fd);
+    else fclose(stream.file);
+}
+
+tb::error<int> SocketTransport::TryWrite(std::span<const uint8_t> frame)
+{
+    if (Packets()) return packets.TryWrite(frame);
+    clearerr(stream.file);
+    return stream.TryWrite(frame);
+}
+
+tb::error<int> SocketTransport::Flush()
+{
+    if (Packets()) return packets.Flush();
+    clearerr(stream.file);
+    return stream.Flush();
+}
+
+size_t SocketTransport::Pending() const
+{
+    return Packets() ? packets.Pending() : stream.Pending();
+}
+
+size_t SocketTransport::Held() const
+{
+    size_t bytes = stream.Charged() + packets.Charged() + datagram_charge.Bytes();
+    for (const std::shared_ptr<ParseJob>& job : parsing) bytes += job->charge.Bytes();
+    return bytes;
+}
+
+tb::error<WriteError> InternalTransport::Write(const Message& m)
+{
+    client->Internal_Receive(m);
+    return tb::ok;
+}
+
+void InternalTransport::Close()
+{
+    client->Internal_Disconnect();
+}
+
+// ClientHandle
+
 ClientHandle::ClientHandle(Client& iclient, std::string_view teamname)
-    : client_ptr(&iclient), conn_type(ConnectionType::INTERNAL), connected(true)
+    : transport(InternalTransport { &iclient }), connected(true)
 {
     preferences.teamname = teamname;
 }
 
-ClientHandle::ClientHandle(ConnectionType conn_type, FILE* ptr, uint32_t max_msg_len)
-    : conn_type(conn_type)
+ClientHandle::ClientHandle(FILE* ptr, uint32_t max_msg_len, const Capabilities& supported)
+    : transport(std::in_place_type<SocketTransport>)
 {
+    Stream& stream = Sock().stream;
     stream.file = ptr;
     setvbuf(stream.file, nullptr, _IONBF, 0);
     stream.Await<MessageFormat>().Await<uint32_t>()
@@ -40,19 +104,30 @@ ClientHandle::ClientHandle(ConnectionType conn_type, FILE* ptr, uint32_t max_msg
         s.Await(size);
     });
 
-    socket = fileno(ptr);
+    Sock().socket = fileno(ptr);
+    connected = true;
+    if (Handshake(supported).is_error()) Disconnect_NoWrite();
+}
+
+ClientHandle::ClientHandle(int packet_socket, uint32_t max_msg_len,
+                           const Capabilities& supported)
+    : transport(std::in_place_type<SocketTransport>)
+{
+    Sock().packets = PacketStream { packet_socket, max_msg_len };
+    Sock().socket = packet_socket;
     connected = true;
-    if (Handshake().is_error()) Disconnect_NoWrite();
+    if (Handshake(supported).is_error()) Disconnect_NoWrite();
 }
 
 // Common ClientHandle functions
 
-tb::error<WriteError> ClientHandle::Handshake()
+tb::error<WriteError> ClientHandle::Handshake(const Capabilities& supported)
 {
     return Write({
         .type { MSG_HANDSHAKE },
         .content = {
-            { "version", CURRENT_VERSION }
+            { "version", CURRENT_VERSION },
+            { "capabilities", supported }
         }
     });
 }
@@ -61,18 +136,40 @@ tb::error<WriteError> ClientHandle::Write(const Message& msg)
 {
     if (!connected) return WriteError {};
 
-    if (conn_type == ConnectionType::INTERNAL) {
-        client_ptr->Internal_Receive(msg);
-        return tb::ok;
-    }
+    return std::visit(tb::overloaded {
+        [&] (SocketTransport& t) { return t.Write(msg, preferences.format); },
+        [&] (InternalTransport& t) { return t.Write(msg); }
+    }, transport);
+}
 
-    clearerr(stream.file);
+tb::error<WriteError> ClientHandle::Write(EncodedMessage& m)
+{
+    if (!connected) return WriteError {};
 
-    Message::WriteToStream(stream, msg, preferences.format).if_err([&] (int) {
-        event_add(write_event.get(), nullptr);
-    });
+    return std::visit(tb::overloaded {
+        [&] (SocketTransport& t) { return t.Write(m.Frame(ChooseFormat(m))); },
+        [&] (InternalTransport& t) { return t.Write(m.message); }
+    }, transport);
+}
 
-    return tb::ok;
+MessageFormat ClientHandle::ChooseFormat(EncodedMessage& m)
+{
+    if (!accepted_formats) return preferences.format;
+
+    // Whichever accepted format is already at hand, the smaller if both are
+    std::optional<MessageFormat> best;
+    size_t best_size = SIZE_MAX;
+    for (MessageFormat f : { MessageFormat::JSON, MessageFormat::MSGPACK }) {
+        if (!(accepted_formats & (1 << static_cast<uint8_t>(f))) || !m.Ready(f))
+            continue;
+        size_t size = m.Frame(f).size();
+        if (size < best_size) {
+            best = f;
+            best_size = size;
+        }
+    }
+
+    return best.value_or(preferences.format);
 }
 
 void ClientHandle::Error(std::string_view errstr)
@@ -100,11 +197,7 @@ void ClientHandle::Disconnect(std::string_view reason)
 void ClientHandle::Disconnect_NoWrite()
 {
     if (!connected) return;
-    if (conn_type == ConnectionType::UNIX || conn_type == ConnectionType::INTERNET) {
-        fclose(stream.file);
-    } else if (conn_type == ConnectionType::INTERNAL) {
-        client_ptr->Internal_Disconnect();
-    }
+    std::visit([] (auto& t) { t.Close(); }, transport);
     logger(LogLevel::DEBUG, fmt::format("Disconnecting client {}",
         preferences.teamname));
     connected = false;
@@ -115,48 +208,151 @@ bool ClientHandle::Available(std::string_view type)
     return std::ranges::find(unavailable, type) == unavailable.end();
 }
 
+bool ClientHandle::Watching(std::string_view ns)
+{
+    return std::ranges::find(watching, ns) != watching.end();
+}
+
+bool ClientHandle::Subscribed(std::string_view team)
+{
+    return std::ranges::find_if(subscriptions, [team] (const std::string& s) {
+        return s == team || s == MSG_ALL;
+    }) != subscriptions.end();
+}
+
+int ClientHandle::Socket() const
+{
+    auto* t = std::get_if<SocketTransport>(&transport);
+    return t ? t->socket : -1;
+}
+
+Client* ClientHandle::InternalClient() const
+{
+    auto* t = std::get_if<InternalTransport>(&transport);
+    return t ? t->client : nullptr;
+}
+
+int ClientHandle::RingSlot() const
+{
+    auto* t = std::get_if<SocketTransport>(&transport);
+    return t ? t->ring_slot : -1;
+}
+
 // ClientHandle functions specific to stream-based connections
 
+template<typename Codec>
 tb::result<Message, ReadError> ClientHandle::Read()
 {
-    if (!stream.Read()) {
-        if (stream.Status() == StreamStatus::REACHED_EOF) {
+    auto frame = ReadFrame();
+    if (frame.is_error()) return { frame.get_error() };
+
+    auto [format, body] = frame.get_unchecked();
+    try {
+        return { Codec::Decode(format, body) };
+    } catch (const json::parse_error& e) {
+        ParseError(e.what());
+    }
+
+    return { ReadError::PARSE_ERROR };
+}
+
+tb::result<std::pair<MessageFormat, std::string_view>, ReadError> ClientHandle::ReadFrame()
+{
+    SocketTransport& t = Sock();
+
+    // The previous message's body is kept around for forwarding until now
+    if (t.frame_pending && !t.Packets()) {
+        t.stream.Delete(t.stream[2]);
+        t.stream.Reset();
+    }
+    t.frame_pending = false;
+
+    if (!t.Packets()) {
+        if (!t.stream.Read()) {
+            if (t.stream.Status() == StreamStatus::REACHED_EOF) {
+                Disconnect();
+                return { ReadError::CONNECTION_ERROR };
+            }
+            return { ReadError::INCOMPLETE_MESSAGE };
+        }
+
+        t.frame_pending = true;
+        t.bytes_read += FRAME_HEADER_SIZE + t.stream[2].length;
+        return { *LastFrame() };
+    }
+
+    // Packets are read whole, leaving only the format byte to check
+    auto packet = t.packets.Read();
+    if (packet.is_error()) {
+        switch (packet.get_error()) {
+        case PacketError::REACHED_EOF:
             Disconnect();
             return { ReadError::CONNECTION_ERROR };
-        } else {
-            return { ReadError::INCOMPLETE_MESSAGE };
+        case PacketError::TOO_LONG:
+            Error("Buffer size too big!");
+            break;
+        case PacketError::MALFORMED:
+            Error("Malformed packet!");
+            break;
+        case PacketError::NONE_READY:
+            break;
         }
+        return { ReadError::INCOMPLETE_MESSAGE };
     }
 
-    std::string_view data = stream[2].GetView();
-    tb::scoped_guard reset_stream = [this] {
-        stream.Delete(stream[2]);
-        stream.Reset();
-    };
+    std::span<const uint8_t> frame = packet.get_unchecked();
+    MessageFormat format;
+    memcpy(&format, frame.data(), sizeof(MessageFormat));
+    if (format != MessageFormat::JSON && format != MessageFormat::MSGPACK) {
+        Error("Invalid message type!");
+        return { ReadError::INCOMPLETE_MESSAGE };
+    }
 
-    try {
-        return { Message::Deserialise(stream[0].Get<MessageFormat>(), data) };
-    } catch (const json::parse_error& e) {
-        std::string error = fmt::format("Error parsing message from {}: {}",
-            preferences.teamname, e.what());
-        logger(LogLevel::WARNING, error);
-        Error(error);
+    t.packet_frame = frame.subspan(FRAME_HEADER_SIZE);
+    t.frame_pending = true;
+    t.bytes_read += frame.size();
+    return { *LastFrame() };
+}
+
+auto ClientHandle::LastFrame() -> std::optional<std::pair<MessageFormat, std::string_view>>
+{
+    auto* t = std::get_if<SocketTransport>(&transport);
+    if (!t || !t->frame_pending) return std::nullopt;
+
+    if (t->Packets()) {
+        MessageFormat format;
+        memcpy(&format, t->packet_frame.data() - FRAME_HEADER_SIZE, sizeof(MessageFormat));
+        return std::pair { format, std::string_view {
+            reinterpret_cast<const char*>(t->packet_frame.data()), t->packet_frame.size()
+        } };
     }
 
-    return { ReadError::PARSE_ERROR };
+    Stream& stream = t->stream;
+    return std::pair { stream[0].Get<MessageFormat>(), stream[2].GetView() };
+}
+
+void ClientHandle::ParseError(std::string_view what)
+{
+    std::string error = fmt::format("Error parsing message from {}: {}",
+        preferences.teamname, what);
+    logger(LogLevel::WARNING, error);
+    Error(error);
 }
 
 // Server
 // Server constructors & destructor
 
-Server::~Server()
+template<typename Policies>
+BasicServer<Policies>::~BasicServer()
 {
     Close();
 }
 
 // Listening socket setup
 
-tb::error<ListenError> Server::UnixServer(std::string_view path)
+template<typename Policies>
+tb::error<ListenError> BasicServer<Policies>::UnixServer(std::string_view path,
+                                                         SocketMode mode)
 {
     if (SetupEvents().is_error())
         return ListenError { ListenErrorType::LIBEVENT_ERROR };
@@ -171,11 +367,30 @@ tb::error<ListenError> Server::UnixServer(std::string_view path)
 
     unix_path = addr.sun_path;
 
-    unix_listener = make<UEvconnListener>(
-        evconnlistener_new_bind(ebase.get(), callbacks::ConnectionCallback,
-                                &callback_data, LEV_OPT_CLOSE_ON_FREE,
-                                -1, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
-    );
+    if (mode == SocketMode::SEQPACKET) {
+        // libevent only creates stream sockets itself
+        int fd = socket(PF_LOCAL, SOCK_SEQPACKET, 0);
+        if (fd != -1 && (evutil_make_socket_nonblocking(fd) == -1
+            || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)) {
+            int error = errno;
+            close(fd);
+            fd = -1;
+            errno = error;
+        }
+        if (fd != -1) {
+            unix_listener = make<UEvconnListener>(
+                evconnlistener_new(ebase.get(), callbacks::ConnectionCallback,
+                                   &callback_data, LEV_OPT_CLOSE_ON_FREE, -1, fd)
+            );
+            if (!unix_listener) close(fd);
+        }
+    } else {
+        unix_listener = make<UEvconnListener>(
+            evconnlistener_new_bind(ebase.get(), callbacks::ConnectionCallback,
+                                    &callback_data, LEV_OPT_CLOSE_ON_FREE, -1,
+                                    reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+        );
+    }
 
     if (!unix_listener) {
         logger(LogLevel::WARNING,
@@ -187,13 +402,25 @@ tb::error<ListenError> Server::UnixServer(std::string_view path)
 
     unix_server = evconnlistener_get_fd(unix_listener.get());
 
+    if (broadcast_ring_size) {
+        std::string name = BroadcastRing::UniqueName();
+        ring.Create(name, broadcast_ring_size).if_ok([&] () {
+            capabilities.Add(Feature::SHARED_MEMORY);
+            logger(LogLevel::DEBUG, fmt::format("Broadcasting through {}", name));
+        }).if_err([&] (int error) {
+            logger(LogLevel::WARNING, fmt::format(
+                "Failed to create broadcast ring {}: {}", name, strerror(error)));
+        });
+    }
+
     Run();
     logger(LogLevel::DEBUG, fmt::format("Listening on file {}", path));
 
     return tb::ok;
 }
 
-tb::error<ListenError> Server::IPServer(uint16_t port)
+template<typename Policies>
+tb::error<ListenError> BasicServer<Policies>::IPServer(uint16_t port)
 {
     if (SetupEvents().is_error())
         return ListenError { ListenErrorType::LIBEVENT_ERROR };
@@ -228,7 +455,8 @@ tb::error<ListenError> Server::IPServer(uint16_t port)
     return tb::ok;
 }
 
-tb::error<AllocError> Server::InternalServer()
+template<typename Policies>
+tb::error<AllocError> BasicServer<Policies>::InternalServer()
 {
     if (SetupEvents().is_error()) return AllocError {};
 
@@ -236,161 +464,1536 @@ tb::error<AllocError> Server::InternalServer()
     return tb::ok;
 }
 
+template<typename Policies>
+tb::error<ListenError> BasicServer<Policies>::UnixDatagramServer(std::string_view path)
+{
+    if (SetupEvents().is_error())
+        return ListenError { ListenErrorType::LIBEVENT_ERROR };
+
+    sockaddr_un addr;
+    addr.sun_family = PF_LOCAL;
+
+    size_t path_len = path.size() < sizeof(addr.sun_path) - 1 ?
+        path.size() : sizeof(addr.sun_path) - 1;
+    memcpy(addr.sun_path, path.data(), path_len);
+    addr.sun_path[path_len] = '\0';
+
+    int fd = socket(PF_LOCAL, SOCK_DGRAM, 0);
+    auto result = ListenDatagrams(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr),
+                                  unix_datagram_event);
+    if (result.is_error()) {
+        logger(LogLevel::WARNING, fmt::format(
+            "Failed to listen for UNIX domain datagrams at {}: {}", path,
+            strerror(errno)));
+        return result;
+    }
+
+    unix_datagram = fd;
+    unix_datagram_path = addr.sun_path;
+    logger(LogLevel::DEBUG, fmt::format("Listening for datagrams on file {}", path));
+
+    return tb::ok;
+}
+
+template<typename Policies>
+tb::error<ListenError> BasicServer<Policies>::UDPServer(uint16_t port)
+{
+    if (SetupEvents().is_error())
+        return ListenError { ListenErrorType::LIBEVENT_ERROR };
+
+    sockaddr_in addr = {0};
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    auto result = ListenDatagrams(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr),
+                                  udp_datagram_event);
+    if (result.is_error()) {
+        logger(LogLevel::WARNING, fmt::format(
+            "Failed to listen for datagrams on port {}: {}", port, strerror(errno)));
+        return result;
+    }
+
+    udp_datagram = fd;
+    udp_port = port;
+    logger(LogLevel::DEBUG, fmt::format("Listening for datagrams on port {}", port));
+
+    return tb::ok;
+}
+
+// Binds the socket & starts reading from it, closing it on failure
+template<typename Policies>
+tb::error<ListenError> BasicServer<Policies>::ListenDatagrams(int fd,
+    const sockaddr* addr, socklen_t addr_size, UEvent& event)
+{
+    if (fd == -1) return ListenError { ListenErrorType::BIND_ERROR, errno };
+
+    if (evutil_make_socket_nonblocking(fd) == -1 || bind(fd, addr, addr_size) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return ListenError { ListenErrorType::BIND_ERROR, error };
+    }
+
+    event = make<UEvent>(
+        event_new(ebase.get(), fd, EV_PERSIST | EV_READ, callbacks::ReadWriteCallback,
+                  &callback_data)
+    );
+    if (!event) {
+        close(fd);
+        return ListenError { ListenErrorType::LIBEVENT_ERROR };
+    }
+
+    event_add(event.get(), nullptr);
+    {
+        std::lock_guard<Lock> guard(clients_mutex);
+        capabilities.Add(Feature::DATAGRAM);
+    }
+
+    Run();
+    return tb::ok;
+}
+
 // Server initialisation & threaded logic
 
-void Server::Run()
+template<typename Policies>
+void BasicServer<Policies>::Run()
 {
     if (started) return;
     started = true;
 
+    // Servers without their own thread are driven by Poll()
+    if constexpr (!Policies::THREADED) return;
+
+    if (parse_workers && !parse_pool.Running()) {
+        parse_pool.Start(parse_workers, &Codec::Decode, [this] {
+            event_active(parse_event.get(), 0, 0);
+        });
+    }
+
     if (current_thread.joinable()) {
         event_active(interrupt_event.get(), 0, 0);
         current_thread.join();
     }
 
-    current_thread = std::thread(&Server::Listen, this);
+    current_thread = std::thread(&BasicServer::Listen, this);
 }
 
-void Server::Close()
+template<typename Policies>
+ShutdownStats BasicServer<Policies>::Close()
 {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+
     logger(LogLevel::DEBUG, "Shutting down server");
     if (current_thread.joinable()) {
         event_active(interrupt_event.get(), 0, 0);
         current_thread.join();
     }
 
+    // Frames still being parsed are dropped along with their clients
+    parse_pool.Stop();
+    parsing_clients.clear();
+
+    std::unique_lock<Lock> guard(clients_mutex);
+
+    // Every client receives the same frame, so it is encoded once per format
+    const Message disconnect {
+        .type { MSG_DISCONNECT },
+        .content = {
+            { "reason", "Shutting down server" },
+            { "who", MSG_YOU }
+        }
+    };
+    std::optional<std::vector<uint8_t>> frames[2];
+
+    // Events are freed before their file descriptor is closed
+    auto close_handle = [] (ClientHandle& handle) {
+        SocketTransport& t = handle.Sock();
+        t.read_event.reset();
+        t.write_event.reset();
+        t.Close();
+        handle.connected = false;
+    };
+
+    ShutdownStats stats;
+    std::vector<pollfd> pending_fds;
+    std::vector<ClientHandle*> pending;
+    std::vector<Client*> internal; // Told once the lock is released
+
     for (ClientHandle& handle : clients) {
-        handle.Disconnect("Shutting down server");
+        if (!handle.connected) continue;
+        ++stats.clients;
+
+        if (handle.Internal()) {
+            internal.push_back(handle.InternalClient());
+            handle.connected = false;
+            ++stats.drained;
+            continue;
+        }
+
+        auto& frame = frames[static_cast<size_t>(handle.preferences.format)];
+        if (!frame) frame = Message::Encode(disconnect, handle.preferences.format);
+
+        if (handle.Sock().TryWrite(*frame).is_ok()) {
+            close_handle(handle);
+            ++stats.drained;
+        } else {
+            pending_fds.push_back({ .fd = handle.Socket(), .events = POLLOUT });
+            pending.push_back(&handle);
+        }
+    }
+
+    // Close the remaining clients in batches as their output drains
+    auto deadline = start + shutdown_grace;
+    while (!pending.empty()) {
+        auto remaining = duration_cast<milliseconds>(deadline - steady_clock::now());
+        if (remaining.count() <= 0) break;
+        if (poll(pending_fds.data(), pending_fds.size(), remaining.count()) < 0
+            && errno != EINTR) break;
+
+        for (size_t i = 0; i < pending.size();) {
+            ClientHandle& handle = *pending[i];
+            SocketTransport& t = handle.Sock();
+            short revents = pending_fds[i].revents;
+            bool drained = false;
+
+            if (revents & POLLOUT) drained = t.Flush().is_ok();
+
+            if (!drained && !(revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                ++i;
+                continue;
+            }
+
+            if (drained) ++stats.drained;
+            else stats.bytes_dropped += t.Pending();
+            close_handle(handle);
+
+            pending[i] = pending.back();
+            pending.pop_back();
+            pending_fds[i] = pending_fds.back();
+            pending_fds.pop_back();
+        }
     }
 
+    for (ClientHandle* handle : pending) {
+        stats.bytes_dropped += handle->Sock().Pending();
+        close_handle(*handle);
+    }
+
+    clients.clear();
+    datagram_clients.clear();
+    PublishRoutes();
+    team_sizes.clear();
+    membership_changes.clear();
+    membership_due.reset();
+    budget_due.reset();
+
     if (unix_listener)
         unlink(unix_path.c_str());
 
+    if (ring.Open()) {
+        ring.Destroy();
+        capabilities.Remove(Feature::SHARED_MEMORY);
+    }
+
+    // Events are freed before their file descriptor is closed
+    unix_datagram_event.reset();
+    udp_datagram_event.reset();
+    for (int* fd : { &unix_datagram, &udp_datagram }) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+    }
+    if (!unix_datagram_path.empty()) unlink(unix_datagram_path.c_str());
+    unix_datagram_path.clear();
+    capabilities.Remove(Feature::DATAGRAM);
+
     started = false;
+
+    // Handlers of INTERNAL clients may call back into the server
+    guard.unlock();
+    for (Client* client : internal) {
+        InternalTransport transport { client };
+        transport.Write(disconnect).ignore_error();
+        transport.Close();
+    }
+
+    stats.duration = duration_cast<milliseconds>(steady_clock::now() - start);
+    if (stats.clients) {
+        logger(LogLevel::DEBUG, fmt::format(
+            "Disconnected {} clients in {} ms: {} drained, {} bytes dropped",
+            stats.clients, stats.duration.count(), stats.drained, stats.bytes_dropped));
+    }
+
+    return stats;
 }
 
-void Server::Broadcast_NoLock(const Message& m)
+template<typename Policies>
+void BasicServer<Policies>::Broadcast(const PreparedMessage& prepared)
 {
-    for (ClientHandle& handle : clients) {
-        if (handle.Write(m).is_error()) handle.Disconnect_NoWrite();
+    CheckThread();
+    const Message& msg = prepared.GetMessage();
+    const std::vector<uint8_t>& frame = prepared.Frame();
+    std::string_view dest = msg.dest.empty() ? MSG_ALL : msg.dest;
+
+    // The lock is only worth waiting for if the message has anywhere to go, which
+    // the published table cannot tell while clients it lacks have joined
+    if (!routes_stale && !routes.Read()->template Matches<Routing>(dest)) return;
+
+    EncodedMessage encoded { msg, Codec::Encode };
+    encoded.SetOriginal(prepared.Format(), {
+        reinterpret_cast<const char*>(frame.data()) + FRAME_HEADER_SIZE,
+        frame.size() - FRAME_HEADER_SIZE
+    });
+
+    std::lock_guard<Lock> guard(clients_mutex);
+    RoutesReader table = Routes();
+    std::optional<bool> published;
+    for (const RoutingTable::Team& team : table->teams) {
+        if (!Routing::Matches(team.name, dest)) continue;
+        for (const RoutingTable::Member& member : team.members) {
+            HandleIter iter = Resolve(member);
+            if (iter == clients.end()) continue;
+            ClientHandle& handle = *iter;
+            if (ServeFromRing(handle, -1, dest, encoded, published)) continue;
+            if (handle.Write(encoded).is_error()) handle.Disconnect_NoWrite();
+        }
     }
 }
 
 // Server connection management
 // INTERNAL only functions
 
-void Server::Internal_AddClient(Client& cl)
+template<typename Policies>
+void BasicServer<Policies>::Internal_AddClient(Client& cl)
 {
-    std::lock_guard<std::mutex> guard(clients_mutex);
+    CheckThread();
+    std::lock_guard<Lock> guard(clients_mutex);
     auto& handle = clients.emplace_back(cl, cl.preferences.teamname);
+    handle.id = next_client_id++;
 
-    if (handle.Handshake().is_error()) handle.Disconnect_NoWrite();
+    if (handle.Handshake(capabilities).is_error()) handle.Disconnect_NoWrite();
 }
 
-void Server::Internal_RemoveClient(Client& to_remove)
+template<typename Policies>
+void BasicServer<Policies>::Internal_RemoveClient(Client& to_remove)
 {
-    std::lock_guard<std::mutex> guard(clients_mutex);
-    std::erase_if(clients, [&to_remove] (ClientHandle& handle) {
-        return handle.client_ptr == &to_remove;
+    CheckThread();
+    std::lock_guard<Lock> guard(clients_mutex);
+    std::erase_if(clients, [this, &to_remove] (ClientHandle& handle) {
+        if (handle.InternalClient() != &to_remove) return false;
+        if (handle.handshaken) MemberLeft(handle.preferences.teamname);
+        routes_stale = true;
+        return true;
     });
+}
 
-    Broadcast_NoLock({
-        .type { MSG_DISCONNECT },
-        .content = {
-            { "who", to_remove.preferences.teamname }
-        }
-    });
+// Roughly the memory a value holds, without serialising it
+static size_t EstimateSize(const json& value)
+{
+    size_t size = sizeof(json);
+    switch (value.type()) {
+    case json::value_t::string:
+        return size + value.get_ref<const std::string&>().size();
+    case json::value_t::binary:
+        return size + value.get_binary().size();
+    case json::value_t::array:
+        for (const json& element : value) size += EstimateSize(element);
+        return size;
+    case json::value_t::object:
+        for (const auto& item : value.items())
+            size += item.key().size() + EstimateSize(item.value());
+        return size;
+    default:
+        return size;
+    }
 }
 
-void Server::Internal_ReceiveFrom(Client& cl, const Message& msg)
+static size_t EstimateSize(const Message& msg)
 {
-    std::lock_guard<std::mutex> guard(internal_mutex);
+    return sizeof(Message) + msg.dest.size() + msg.src.size() + msg.type.size()
+        + msg.idempotency_key.size() + EstimateSize(msg.content);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::Internal_ReceiveFrom(Client& cl, const Message& msg)
+{
+    CheckThread();
+    std::lock_guard<Lock> guard(internal_mutex);
+    if (MemoryBudget::Global().OverHard()) {
+        ++internal_dropped;
+        return;
+    }
+
     internal_messages.emplace_back(&cl, msg);
+    internal_charge.Set(internal_charge.Bytes() + sizeof(Client*) + EstimateSize(msg));
     event_active(read_internal_event.get(), 0, 0);
 }
 
 // Reading from socket-based clients
 
-void Server::Serve(HandleIter client_handle)
+template<typename Policies>
+bool BasicServer<Policies>::Serve(HandleIter client_handle)
 {
-    client_handle->Read().if_ok_mut([this, client_handle] (Message& message) {
-        HandleMessage(*client_handle, std::move(message));
-    });
-
-    if (!client_handle->connected) {
-        Broadcast_NoLock({
-            .type { MSG_DISCONNECT },
-            .content = {
-                { "who", client_handle->preferences.teamname }
-            }
-        });
+    // Datagrams queued by ReadDatagrams are served one per unit of work
+    SocketTransport& t = client_handle->Sock();
+    if (!t.datagrams.empty()) {
+        Message msg = std::move(t.datagrams.front());
+        t.datagrams.pop_front();
+        t.datagram_charge.Set(t.datagram_charge.Bytes() - EstimateSize(msg));
+        ++lossy_stats.datagrams;
+        HandleMessage(*client_handle, std::move(msg));
+        return Reap(client_handle);
+    }
 
-        clients.erase(client_handle);
+    bool read;
+    if (parse_pool.Running()) {
+        read = SubmitFrame(*client_handle);
+    } else {
+        auto result = client_handle->template Read<Codec>();
+        read = result.if_ok_mut([this, client_handle] (Message& message) {
+            HandleMessage(*client_handle, std::move(message), client_handle->LastFrame());
+        }).is_ok();
     }
+
+    // Packets received in a batch are read one at a time, the rest once the
+    // event fires again, or while the scheduler keeps calling
+    if (client_handle->connected && !t.paused && t.packets.Buffered()
+        && (!fair_scheduling || !read))
+        event_active(t.read_event.get(), EV_READ, 0);
+
+    return Reap(client_handle) && read;
 }
 
-void Server::HandleMessage(ClientHandle& client_handle, Message&& msg)
+// Clients are only removed once the frames they sent before disconnecting are routed
+template<typename Policies>
+bool BasicServer<Policies>::Reap(HandleIter client_handle)
 {
-    // Types of the JSON values are validated in checks
-    if (!client_handle.handshaken) {
-        if (msg.type != MSG_HANDSHAKE ||
-            !ValidateJSON(msg.content, VALIDATE_HANDSHAKE_SERVERSIDE)) {
-            client_handle.Disconnect("Failed handshake");
-            return;
-        }
+    if (client_handle->connected) return true;
+    RouteParsed(*client_handle, true);
 
-        client_handle.preferences.teamname = msg.content["teamname"];
-        client_handle.preferences.format = msg.content["format"];
-        client_handle.preferences.max_msg_length = msg.content["max-message-length"];
-        client_handle.handshaken = true;
-        return;
-    }
+    if (fair_scheduling) scheduler.Remove(client_handle->Socket());
+    ring.Detach(client_handle->RingSlot());
+    if (client_handle->handshaken) MemberLeft(client_handle->preferences.teamname);
+    datagram_clients.erase(client_handle->Sock().datagram_token);
 
-    if (msg.type == MSG_AVAILABLE) {
-        if (!ValidateJSON(msg.content, VALIDATE_AVAILABLE)) {
-            client_handle.Error("Incorrect format for $$available message");
-            return;
-        }
-        std::string type = msg.content["type"];
-        bool available = msg.content["available"];
-        auto iter = std::ranges::find(client_handle.unavailable, type);
-        if (available) {
-            if (iter != client_handle.unavailable.end())
-                client_handle.unavailable.erase(iter);
-        } else {
-            if (iter == client_handle.unavailable.end())
-                client_handle.unavailable.emplace_back(type);
-        }
-    }
+    clients.erase(client_handle);
+    routes_stale = true;
+    return false;
+}
 
-    if (msg.dest.empty()) return;
+// Parse workers
 
-    msg.src = client_handle.preferences.teamname;
-    if (msg.only_first) {
-        HandleIter destination = GetFirstAvailable(msg.dest, msg.type, client_handle);
-        if (destination != clients.end()) {
-            if (destination->Write(msg).is_error()) destination->Disconnect_NoWrite();
+// Frames too small to be worth handing over are decoded here, but still wait
+// behind the client's earlier frames
+template<typename Policies>
+bool BasicServer<Policies>::SubmitFrame(ClientHandle& client_handle)
+{
+    auto frame = client_handle.ReadFrame();
+    if (frame.is_error()) return false;
+
+    auto [format, body] = frame.get_unchecked();
+    ParseQueue& parsing = client_handle.Sock().parsing;
+
+    if (parsing.empty() && body.size() < parse_threshold) {
+        std::optional<Message> msg;
+        try {
+            msg = Codec::Decode(format, body);
+        } catch (const json::parse_error& e) {
+            client_handle.ParseError(e.what());
+            return false;
         }
-        return;
+        HandleMessage(client_handle, std::move(*msg), std::pair { format, body });
+        return true;
     }
 
-    auto recipients = clients | std::views::filter([&msg] (ClientHandle& handle) {
-        return handle.preferences.teamname == msg.dest || msg.dest == MSG_ALL;
-    });
+    auto job = std::make_shared<ParseJob>(format, body);
+    if (body.size() < parse_threshold) ParsePool::Decode(*job, &Codec::Decode);
+    else parse_pool.Submit(job);
 
-    for (ClientHandle& destination : recipients) {
-        if (&destination == &client_handle) continue;
-        if (destination.Write(msg).is_error()) destination.Disconnect_NoWrite();
+    if (parsing.empty()) parsing_clients.push_back(client_handle.Socket());
+    parsing.push_back(std::move(job));
+    return true;
+}
+
+template<typename Policies>
+void BasicServer<Policies>::RouteParsed()
+{
+    std::vector<int> fds = std::move(parsing_clients);
+    parsing_clients.clear();
+
+    for (int fd : fds) {
+        HandleIter iter = GetClientBySocket(fd);
+        if (iter == clients.end()) continue;
+
+        RouteParsed(*iter, false);
+        if (Reap(iter) && !iter->Sock().parsing.empty()) parsing_clients.push_back(fd);
+    }
+}
+
+// Routes the client's frames in order, up to the first still being decoded
+// unless waiting for it
+template<typename Policies>
+void BasicServer<Policies>::RouteParsed(ClientHandle& client_handle, bool wait)
+{
+    ParseQueue& parsing = client_handle.Sock().parsing;
+    while (!parsing.empty()) {
+        ParseJob& job = *parsing.front();
+        if (!job.ready.load(std::memory_order_acquire)) {
+            if (!wait) return;
+            ParsePool::Wait(job);
+        }
+
+        if (job.message) {
+            HandleMessage(client_handle, std::move(*job.message),
+                          std::pair { job.format, job.Body() });
+        } else if (client_handle.connected) {
+            client_handle.ParseError(job.error);
+        }
+        parsing.pop_front();
+    }
+}
+
+// Scheduling reads from socket-based clients
+
+template<typename Policies>
+void BasicServer<Policies>::SetTeamQoS(std::string_view team, TeamQoS qos)
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    scheduler.SetQoS(team, qos);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::Schedule(ClientHandle& client_handle)
+{
+    SocketTransport& t = client_handle.Sock();
+    if (t.scheduled) return;
+    t.scheduled = true;
+    scheduler.Enqueue(client_handle.preferences.teamname, t.socket);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::RunScheduler()
+{
+    scheduler.Run(schedule_budget, [this] (int fd) {
+        auto iter = std::ranges::find(clients, fd, &ClientHandle::Socket);
+        if (iter == clients.end()) return false;
+        if (Serve(iter)) return true;
+
+        // Nothing more to read for now, let libevent report when there is
+        iter = std::ranges::find(clients, fd, &ClientHandle::Socket);
+        if (iter == clients.end()) return false;
+        iter->Sock().scheduled = false;
+        if (!iter->Sock().paused)
+            event_add(iter->Sock().read_event.get(), &callbacks::DEFAULT_TIMEOUT);
+        return false;
+    });
+}
+
+template<typename Policies>
+void BasicServer<Policies>::HandleMessage(ClientHandle& client_handle, Message&& msg,
+    std::optional<std::pair<MessageFormat, std::string_view>> frame)
+{
+    // Types of the JSON values are validated in checks
+    Reserved reserved = Classify(msg.type);
+
+    if (!client_handle.handshaken) {
+        if (reserved != Reserved::HANDSHAKE ||
+            !ValidateJSON(msg.content, VALIDATE_HANDSHAKE_SERVERSIDE)) {
+            client_handle.Disconnect("Failed handshake");
+            return;
+        }
+
+        client_handle.preferences.teamname = msg.content["teamname"];
+        client_handle.preferences.format = msg.content["format"];
+        client_handle.preferences.max_msg_length = msg.content["max-message-length"];
+        // Clients predating capabilities advertise none
+        if (msg.content.contains("capabilities")) {
+            client_handle.capabilities = capabilities.Negotiate(
+                msg.content["capabilities"].get<Capabilities>());
+        }
+        if (client_handle.capabilities.Has(Feature::ADAPTIVE_FORMAT)) {
+            const json& params = client_handle.capabilities.Params(Feature::ADAPTIVE_FORMAT);
+            if (params.contains("formats")) {
+                for (const json& f : params["formats"]) {
+                    if (f == MessageFormat::JSON || f == MessageFormat::MSGPACK)
+                        client_handle.accepted_formats |= 1 << f.get<uint8_t>();
+                }
+            }
+        }
+        client_handle.handshaken = true;
+        routes_stale = true;
+        MemberJoined(client_handle.preferences.teamname);
+        AttachRing(client_handle);
+        OfferDatagrams(client_handle);
+        return;
+    }
+
+    bool modified = false;
+    if (!interceptors[static_cast<size_t>(InterceptStage::INGRESS)].empty()) [[unlikely]] {
+        Envelope envelope { InterceptStage::INGRESS, client_handle, msg };
+        if (!Intercept(envelope)) return;
+        modified = envelope.Modified();
+        // The type may have been rewritten
+        if (modified) reserved = Classify(msg.type);
+    }
+
+    switch (reserved) {
+    case Reserved::SUBSCRIBE:
+        HandleSubscribe(client_handle, msg);
+        return;
+    case Reserved::MEMBERS:
+        HandleMembers(client_handle, msg);
+        return;
+    case Reserved::CACHE:
+        HandleCache(client_handle, msg);
+        return;
+    case Reserved::SAMPLE:
+        HandleSample(client_handle, msg);
+        return;
+    case Reserved::RING:
+        HandleRing(client_handle, msg);
+        return;
+    case Reserved::GET:
+    case Reserved::SET:
+    case Reserved::CAS:
+    case Reserved::DELETE:
+    case Reserved::WATCH:
+        HandleKV(client_handle, msg, reserved);
+        return;
+    default:
+        break;
+    }
+
+    if (reserved == Reserved::AVAILABLE) {
+        if (!ValidateJSON(msg.content, VALIDATE_AVAILABLE)) {
+            client_handle.Error("Incorrect format for $$available message");
+            return;
+        }
+        std::string type = msg.content["type"];
+        bool available = msg.content["available"];
+        auto iter = std::ranges::find(client_handle.unavailable, type);
+        if (available) {
+            if (iter != client_handle.unavailable.end())
+                client_handle.unavailable.erase(iter);
+        } else {
+            if (iter == client_handle.unavailable.end())
+                client_handle.unavailable.emplace_back(type);
+        }
+    }
+
+    if (msg.dest.empty()) return;
+
+    if (!msg.idempotency_key.empty()) {
+        dedup.window = dedup_window;
+        dedup.capacity = dedup_capacity;
+        if (dedup.Seen(client_handle.preferences.teamname, msg.idempotency_key,
+                       Clock::now())) {
+            logger(LogLevel::DEBUG, fmt::format("Dropped duplicate message {} from {}",
+                msg.idempotency_key, client_handle.preferences.teamname));
+            return;
+        }
+    }
+
+    // The frame the message arrived in can be forwarded as is if the sender
+    // already filled in its own teamname.
+    bool original = msg.src == client_handle.preferences.teamname;
+    msg.src = client_handle.preferences.teamname;
+
+    if (!interceptors[static_cast<size_t>(InterceptStage::ROUTING)].empty()) [[unlikely]] {
+        Envelope envelope { InterceptStage::ROUTING, client_handle, msg };
+        if (!Intercept(envelope)) return;
+        modified = modified || envelope.Modified();
+    }
+    original = original && !modified;
+
+    if (!client_handle.cacheable_requests.empty()) CacheReply(client_handle, msg);
+
+    bool cacheable = msg.only_first && response_cache.Cacheable(msg.dest, msg.type);
+    if (cacheable && AnswerFromCache(client_handle, msg)) return;
+
+    EncodedMessage encoded { msg, Codec::Encode };
+    if (original && frame) encoded.SetOriginal(frame->first, frame->second);
+    bool lossy = !lossy_types.empty() && lossy_types.contains(msg.type);
+
+    if (sampling) DeliverSamples(client_handle, msg, encoded);
+
+    if (msg.only_first) {
+        HandleIter destination = GetFirstAvailable(msg.dest, msg.type, client_handle);
+        if (destination == clients.end()) return;
+
+        if (cacheable) {
+            auto& requests = destination->cacheable_requests;
+            if (requests.size() == MAX_CACHEABLE_REQUESTS) requests.pop_front();
+            requests.push_back({ client_handle.preferences.teamname, msg.type,
+                                 msg.content });
+        }
+        Deliver(*destination, client_handle, encoded, lossy);
+        return;
+    }
+
+    // Interceptors may tell recipients apart, which the ring cannot
+    bool use_ring = ring.Readers()
+        && interceptors[static_cast<size_t>(InterceptStage::EGRESS)].empty();
+    std::optional<bool> published;
+
+    RoutesReader table = Routes();
+    for (const RoutingTable::Team& team : table->teams) {
+        if (!Routing::Matches(team.name, msg.dest)) continue;
+
+        // Handlers of INTERNAL clients may remove clients as they go
+        for (const RoutingTable::Member& member : team.members) {
+            HandleIter iter = Resolve(member);
+            if (iter == clients.end()) continue;
+            ClientHandle& destination = *iter;
+            if (&destination == &client_handle) continue;
+            if (use_ring && ServeFromRing(destination, client_handle.RingSlot(),
+                                          msg.dest, encoded, published)) continue;
+            Deliver(destination, client_handle, encoded, lossy);
+        }
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::Deliver(ClientHandle& destination, ClientHandle& source,
+                                    EncodedMessage& encoded, bool lossy)
+{
+    // Rather than queue up behind what the recipient has yet to take
+    if (!destination.Internal() && destination.Sock().Pending()) {
+        if (lossy) {
+            ++lossy_stats.dropped;
+            return;
+        }
+        if (shed_policy == ShedPolicy::DROP && MemoryBudget::Global().OverHard()) {
+            ++budget_stats.dropped;
+            return;
+        }
+    }
+
+    bool success;
+    if (interceptors[static_cast<size_t>(InterceptStage::EGRESS)].empty()) [[likely]] {
+        success = destination.Write(encoded).is_ok();
+    } else {
+        Envelope envelope { source, destination, encoded.message };
+        if (!Intercept(envelope)) return;
+        if (envelope.Modified()) success = destination.Write(envelope.View()).is_ok();
+        else success = destination.Write(encoded).is_ok();
+    }
+
+    if (!success) destination.Disconnect_NoWrite();
+}
+
+// Interceptors
+
+Envelope::Envelope(InterceptStage stage, const ClientHandle& from, Message& msg)
+    : stage(stage), from(from), message(msg), mutable_message(&msg) {}
+
+Envelope::Envelope(const ClientHandle& from, const ClientHandle& to, const Message& msg)
+    : stage(InterceptStage::EGRESS), from(from), to(&to), message(msg) {}
+
+Message& Envelope::Modify()
+{
+    modified = true;
+    if (mutable_message) return *mutable_message;
+    if (!copy) copy = message;
+    return *copy;
+}
+
+template<typename Policies>
+void BasicServer<Policies>::AddInterceptor(InterceptStage stage,
+                                           Interceptor&& interceptor)
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    interceptors[static_cast<size_t>(stage)].emplace_back(std::move(interceptor));
+}
+
+// Returns whether the message should still be delivered
+template<typename Policies>
+bool BasicServer<Policies>::Intercept(Envelope& envelope)
+{
+    for (Interceptor& interceptor : interceptors[static_cast<size_t>(envelope.stage)]) {
+        switch (interceptor(envelope)) {
+        case Verdict::PASS:
+            break;
+        case Verdict::DROP:
+            return false;
+        case Verdict::REDIRECT:
+            if (envelope.stage == InterceptStage::EGRESS) return false;
+            envelope.Modify().dest = envelope.redirect;
+            break;
+        }
+    }
+
+    return true;
+}
+
+// Team membership
+
+template<typename Policies>
+void BasicServer<Policies>::HandleSubscribe(ClientHandle& client_handle,
+                                            const Message& msg)
+{
+    if (!ValidateJSON(msg.content, VALIDATE_SUBSCRIBE)) {
+        client_handle.Error("Incorrect format for $$subscribe message");
+        return;
+    }
+    std::string team = msg.content["team"];
+    bool subscribe = msg.content["subscribe"];
+    auto iter = std::ranges::find(client_handle.subscriptions, team);
+    if (subscribe) {
+        if (iter == client_handle.subscriptions.end())
+            client_handle.subscriptions.emplace_back(team);
+    } else {
+        if (iter != client_handle.subscriptions.end())
+            client_handle.subscriptions.erase(iter);
+    }
+}
+
+// Response cache & deduplication
+
+template<typename Policies>
+void BasicServer<Policies>::SetCacheCapacity(size_t bytes)
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    response_cache.SetCapacity(bytes);
+}
+
+template<typename Policies>
+DedupStats BasicServer<Policies>::DeduplicationStats()
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    return dedup.Stats();
+}
+
+// Lossy datagrams
+
+template<typename Policies>
+void BasicServer<Policies>::SetLossy(std::string_view type, bool lossy)
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    if (lossy) lossy_types.emplace(type);
+    else lossy_types.erase(std::string { type });
+}
+
+template<typename Policies>
+LossyStats BasicServer<Policies>::LossyDeliveryStats()
+{
+    std::lock_guard<Lock> guard(clients_mutex);
+    return lossy_stats;
+}
+
+// Clients are told where to send datagrams & the token to prefix them with
+template<typename Policies>
+void BasicServer<Policies>::OfferDatagrams(ClientHandle& client_handle)
+{
+    if (!client_handle.capabilities.Has(Feature::DATAGRAM)) return;
+    auto* t = std::get_if<SocketTransport>(&client_handle.transport);
+    if (!t) return;
+
+    json content = { { "types", lossy_types } };
+    if (t->local && unix_datagram != -1) {
+        content["path"] = unix_datagram_path;
+    } else if (!t->local && udp_datagram != -1) {
+        // Datagrams are only accepted on the loopback interface
+        sockaddr_storage peer;
+        socklen_t peer_size = sizeof(peer);
+        if (getpeername(t->socket, reinterpret_cast<sockaddr*>(&peer), &peer_size) == -1)
+            return;
+        bool loopback = peer.ss_family == AF_INET
+            && ntohl(reinterpret_cast<sockaddr_in*>(&peer)->sin_addr.s_addr) >> 24 == 127;
+        if (!loopback) return;
+        content["port"] = udp_port;
+    } else {
+        return;
+    }
+
+    uint64_t token;
+    do token = static_cast<uint64_t>(token_source()) << 32 | token_source();
+    while (token == 0 || datagram_clients.contains(token));
+    content["token"] = token;
+
+    bool success = client_handle.Write({
+        .type { MSG_DATAGRAM },
+        .content = std::move(content)
+    }).is_ok();
+    if (!success) return;
+
+    t->datagram_token = token;
+    auto position = std::ranges::find(clients, client_handle.id, &ClientHandle::id)
+        - clients.begin();
+    datagram_clients.emplace(token, RoutingTable::Member {
+        static_cast<uint32_t>(position), client_handle.id
+    });
+}
+
+// Each datagram holds a client's token followed by a frame
+template<typename Policies>
+void BasicServer<Policies>::ReadDatagrams(int fd)
+{
+    size_t sizes[PACKET_BATCH];
+    int count = ReceiveBatch(fd, datagram_batch, sizes);
+
+    for (int i = 0; i < count; ++i) {
+        const uint8_t* data = datagram_batch[i].data();
+        size_t size = sizes[i];
+        if (size == SIZE_MAX || size < sizeof(uint64_t) + FRAME_HEADER_SIZE) {
+            ++lossy_stats.rejected;
+            continue;
+        }
+
+        uint64_t token;
+        MessageFormat format;
+        uint32_t length;
+        memcpy(&token, data, sizeof(uint64_t));
+        memcpy(&format, data + sizeof(uint64_t), sizeof(MessageFormat));
+        memcpy(&length, data + sizeof(uint64_t) + sizeof(MessageFormat),
+               sizeof(uint32_t));
+
+        auto sender = datagram_clients.find(token);
+        HandleIter iter = sender == datagram_clients.end()
+            ? clients.end() : Resolve(sender->second);
+        if (iter != clients.end())
+            sender->second.position = static_cast<uint32_t>(iter - clients.begin());
+
+        if (iter == clients.end() || !iter->connected || length > max_msg_length
+            || length != size - sizeof(uint64_t) - FRAME_HEADER_SIZE
+            || (format != MessageFormat::JSON && format != MessageFormat::MSGPACK)) {
+            ++lossy_stats.rejected;
+            continue;
+        }
+
+        std::string_view body {
+            reinterpret_cast<const char*>(data) + sizeof(uint64_t) + FRAME_HEADER_SIZE,
+            length
+        };
+
+        Message msg;
+        try {
+            msg = Codec::Decode(format, body);
+        } catch (const json::parse_error& e) {
+            ++lossy_stats.rejected;
+            continue;
+        }
+
+        if (msg.dest.empty() || Classify(msg.type) != Reserved::NONE
+            || !lossy_types.contains(msg.type)) {
+            ++lossy_stats.rejected;
+            continue;
+        }
+
+        if (!fair_scheduling) {
+            ++lossy_stats.datagrams;
+            HandleMessage(*iter, std::move(msg), std::pair { format, body });
+            continue;
+        }
+
+        // Served in turn with the sender's team, so that a flood of datagrams
+        // from one client cannot crowd out the others
+        SocketTransport& t = iter->Sock();
+        if (t.datagrams.size() >= MAX_QUEUED_DATAGRAMS) {
+            ++lossy_stats.overflowed;
+            continue;
+        }
+        t.datagram_charge.Set(t.datagram_charge.Bytes() + EstimateSize(msg));
+        t.datagrams.push_back(std::move(msg));
+        Schedule(*iter);
+    }
+
+    ReleaseBatch(datagram_batch);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::HandleCache(ClientHandle& client_handle, const Message& msg)
+{
+    if (!ValidateJSON(msg.content, VALIDATE_CACHE)) {
+        client_handle.Error("Incorrect format for $$cache message");
+        return;
+    }
+
+    uint64_t ttl = std::min<uint64_t>(msg.content["ttl"].get<uint64_t>(),
+                                      std::chrono::milliseconds::max().count());
+    response_cache.SetTTL(client_handle.preferences.teamname,
+        msg.content["type"].get_ref<const std::string&>(),
+        std::chrono::milliseconds { static_cast<int64_t>(ttl) });
+}
+
+template<typename Policies>
+bool BasicServer<Policies>::AnswerFromCache(ClientHandle& client_handle,
+                                            const Message& msg)
+{
+    const json* cached = response_cache.Find(msg.dest, msg.type, msg.content,
+                                             Clock::now());
+    if (!cached) return false;
+
+    Message reply;
+    reply.dest = client_handle.preferences.teamname;
+    reply.src = msg.dest;
+    reply.type = msg.type;
+    reply.content = *cached;
+    if (client_handle.Write(reply).is_error()) client_handle.Disconnect_NoWrite();
+    return true;
+}
+
+// Replies are matched to the earliest request of the same type forwarded by the
+// recipient's team
+template<typename Policies>
+void BasicServer<Policies>::CacheReply(ClientHandle& client_handle, const Message& msg)
+{
+    auto& requests = client_handle.cacheable_requests;
+    auto iter = std::ranges::find_if(requests, [&msg] (const CacheableRequest& r) {
+        return r.from == msg.dest && r.type == msg.type;
+    });
+    if (iter == requests.end()) return;
+
+    response_cache.Insert(client_handle.preferences.teamname, msg.type, iter->content,
+                          msg.content, Clock::now());
+    requests.erase(iter);
+}
+
+// Memory budget
+
+template<typename Policies>
+BudgetStats BasicServer<Policies>::MemoryBudgetStats()
+{
+    BudgetStats stats;
+    {
+        std::lock_guard<Lock> guard(clients_mutex);
+        stats = budget_stats;
+        stats.paused = std::ranges::count_if(clients, [] (ClientHandle& handle) {
+            return !handle.Internal() && handle.Sock().paused;
+        });
+    }
+    {
+        std::lock_guard<Lock> guard(internal_mutex);
+        stats.dropped += internal_dropped;
+    }
+    stats.used = MemoryBudget::Global().Used();
+    return stats;
+}
+
+template<typename Policies>
+void BasicServer<Policies>::CheckBudget()
+{
+    MemoryBudget& budget = MemoryBudget::Global();
+    if (shed_policy == ShedPolicy::DISCONNECT && budget.OverHard()) ShedLargest();
+
+    if (budget.OverSoft()) PauseProducers();
+    else ResumeProducers();
+
+    for (ClientHandle& handle : clients)
+        if (!handle.Internal()) handle.Sock().bytes_read = 0;
+}
+
+// Pauses the clients that sent the most since the last check, until those paused
+// account for half of what was read
+template<typename Policies>
+void BasicServer<Policies>::PauseProducers()
+{
+    std::vector<ClientHandle*> producers;
+    uint64_t total = 0;
+    for (ClientHandle& handle : clients) {
+        if (handle.Internal() || !handle.connected) continue;
+        SocketTransport& t = handle.Sock();
+        if (t.paused || !t.bytes_read) continue;
+        producers.push_back(&handle);
+        total += t.bytes_read;
+    }
+
+    std::ranges::sort(producers, std::ranges::greater {}, [] (ClientHandle* handle) {
+        return handle->Sock().bytes_read;
+    });
+
+    uint64_t paused_bytes = 0;
+    for (ClientHandle* handle : producers) {
+        if (paused_bytes * 2 >= total) break;
+
+        SocketTransport& t = handle->Sock();
+        paused_bytes += t.bytes_read;
+        t.paused = true;
+        event_del(t.read_event.get());
+        if (fair_scheduling) scheduler.Remove(handle->Socket());
+        ++budget_stats.pauses;
+
+        logger(LogLevel::DEBUG, fmt::format("Pausing reads from {} over the memory "
+            "budget's soft limit", handle->preferences.teamname));
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::ResumeProducers()
+{
+    for (ClientHandle& handle : clients) {
+        if (handle.Internal() || !handle.Sock().paused) continue;
+
+        SocketTransport& t = handle.Sock();
+        t.paused = false;
+        event_add(t.read_event.get(), &callbacks::DEFAULT_TIMEOUT);
+        // Readable data may have arrived in the meantime, or be buffered already
+        event_active(t.read_event.get(), EV_READ, 0);
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::ShedLargest()
+{
+    // Buffers read into count as much as those waiting to be written
+    auto queued = [] (ClientHandle& handle) -> size_t {
+        return handle.Internal() || !handle.connected ? 0 : handle.Sock().Held();
+    };
+
+    while (MemoryBudget::Global().OverHard()) {
+        HandleIter largest = std::ranges::max_element(clients, {}, queued);
+        if (largest == clients.end() || !queued(*largest)) return;
+
+        logger(LogLevel::WARNING, fmt::format("Disconnecting {} past the memory "
+            "budget's hard limit, with {} bytes queued", largest->preferences.teamname,
+            queued(*largest)));
+        largest->Disconnect_NoWrite();
+        ++budget_stats.disconnected;
+        Reap(largest);
+    }
+}
+
+// Broadcast ring
+
+template<typename Policies>
+void BasicServer<Policies>::AttachRing(ClientHandle& client_handle)
+{
+    if (!ring.Open() || !client_handle.capabilities.Has(Feature::SHARED_MEMORY))
+        return;
+
+    auto* t = std::get_if<SocketTransport>(&client_handle.transport);
+    if (!t || !t->local) return;
+
+    int slot = ring.Attach();
+    if (slot < 0) return;
+
+    t->ring_slot = slot;
+    bool success = client_handle.Write({
+        .type { MSG_RING },
+        .content = { { "name", ring.Name() }, { "slot", slot } }
+    }).is_ok();
+    if (!success) DetachRing(client_handle);
+}
+
+// Frames the client has yet to read from the ring are sent over its socket
+template<typename Policies>
+void BasicServer<Policies>::DetachRing(ClientHandle& client_handle)
+{
+    int slot = client_handle.RingSlot();
+    if (slot < 0) return;
+
+    uint64_t pos = ring.Detach(slot);
+    if (pos != RING_DETACHED) ReplayRing(client_handle, pos);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::HandleRing(ClientHandle& client_handle, const Message& msg)
+{
+    if (!ValidateJSON(msg.content, VALIDATE_RING)) {
+        client_handle.Error("Incorrect format for $$ring message");
+        return;
+    }
+
+    // Clients may only leave the ring, joining it is up to the server
+    if (!msg.content["attached"].get<bool>()) DetachRing(client_handle);
+}
+
+// Sends a detached client the frames it had yet to read, from 'pos' onwards
+template<typename Policies>
+void BasicServer<Policies>::ReplayRing(ClientHandle& client_handle, uint64_t pos)
+{
+    SocketTransport& t = client_handle.Sock();
+    std::vector<std::vector<uint8_t>> frames;
+    ring.Unread(pos, client_handle.preferences.teamname, t.ring_slot, frames);
+    t.ring_slot = -1;
+
+    for (const auto& frame : frames) {
+        if (t.Write(frame).is_error()) {
+            client_handle.Disconnect_NoWrite();
+            return;
+        }
+    }
+}
+
+// Recipients reading the ring share one copy of the message, published when the
+// first of them comes up. Returns whether 'destination' was served that way.
+template<typename Policies>
+bool BasicServer<Policies>::ServeFromRing(ClientHandle& destination, int exclude,
+    std::string_view dest, EncodedMessage& encoded, std::optional<bool>& published)
+{
+    // The ring matches destinations the way TeamRouting does
+    if constexpr (!std::is_same_v<Routing, TeamRouting>) return false;
+    if (destination.RingSlot() < 0) return false;
+
+    if (!published) {
+        MessageFormat f = encoded.Ready(MessageFormat::JSON)
+            && !encoded.Ready(MessageFormat::MSGPACK)
+            ? MessageFormat::JSON : MessageFormat::MSGPACK;
+        published = ring.Publish(dest, exclude, encoded.Frame(f),
+            [this] (int slot, uint64_t pos) {
+                auto iter = std::ranges::find(clients, slot, &ClientHandle::RingSlot);
+                if (iter == clients.end()) return;
+                logger(LogLevel::DEBUG, fmt::format(
+                    "{} fell behind on the broadcast ring", iter->preferences.teamname));
+                ReplayRing(*iter, pos);
+            });
+    }
+
+    // Readers detached while publishing still need this message over their socket
+    return *published && destination.RingSlot() >= 0;
+}
+
+// Sampled delivery
+
+template<typename Policies>
+void BasicServer<Policies>::HandleSample(ClientHandle& client_handle, const Message& msg)
+{
+    if (!ValidateJSON(msg.content, VALIDATE_SAMPLE)) {
+        client_handle.Error("Incorrect format for $$sample message");
+        return;
+    }
+
+    const std::string& team = msg.content["team"].get_ref<const std::string&>();
+    auto stop = [&client_handle, &team] {
+        std::erase_if(client_handle.samples, [&team] (const SampleSubscription& s) {
+            return s.team == team;
+        });
+    };
+    if (!msg.content["sample"]) {
+        stop();
+        return;
+    }
+
+    // The optional fields are rejected if out of range, rather than clamped. A
+    // rejected update leaves the team's current sample in place.
+    const json& content = msg.content;
+    auto count = [&content] (const char* name, uint32_t fallback)
+        -> std::optional<uint32_t> {
+        auto iter = content.find(name);
+        if (iter == content.end()) return fallback;
+        if (!iter->is_number_integer()) return std::nullopt;
+        if (!iter->is_number_unsigned() && iter->get<int64_t>() < 0) return std::nullopt;
+        if (iter->get<uint64_t>() > UINT32_MAX) return std::nullopt;
+        return iter->get<uint32_t>();
+    };
+
+    std::optional<uint32_t> every = count("every", 1), rate = count("rate", 0);
+    if (!every || !rate) {
+        client_handle.Error("$$sample every and rate must be 32-bit unsigned integers");
+        return;
+    }
+
+    double fraction = 1;
+    if (auto iter = content.find("fraction"); iter != content.end()) {
+        if (iter->is_number()) fraction = iter->get<double>();
+        if (!iter->is_number() || !(fraction >= 0 && fraction <= 1)) {
+            client_handle.Error("$$sample fraction must be a number from 0 to 1");
+            return;
+        }
+    }
+
+    SampleSubscription subscription {
+        .team = team,
+        .sampler = Sampler { *every, *rate, fraction }
+    };
+
+    if (content.contains("key")) {
+        try {
+            subscription.key.emplace(content["key"].get<std::string>());
+        } catch (const json::exception& e) {
+            client_handle.Error(fmt::format("Invalid $$sample key: {}", e.what()));
+            return;
+        }
+    }
+
+    stop();
+    client_handle.samples.push_back(std::move(subscription));
+    sampling = true;
+}
+
+// Observers that are not recipients of the message already, sampling its destination
+template<typename Policies>
+void BasicServer<Policies>::DeliverSamples(ClientHandle& source, const Message& msg,
+                                           EncodedMessage& encoded)
+{
+    auto now = Clock::now();
+    for (ClientHandle& observer : clients) {
+        if (observer.samples.empty() || &observer == &source
+            || Routing::Matches(observer.preferences.teamname, msg.dest)) continue;
+
+        auto iter = std::ranges::find_if(observer.samples,
+            [&msg] (const SampleSubscription& s) {
+                return s.team == msg.dest || s.team == MSG_ALL;
+            });
+        if (iter == observer.samples.end()) continue;
+
+        uint64_t key_hash = 0;
+        if (iter->key) {
+            if (!msg.content.contains(*iter->key)) continue;
+            // Spread the hash over the whole range before it is compared
+            key_hash = std::hash<json> {}(msg.content.at(*iter->key));
+            key_hash = (key_hash ^ (key_hash >> 31)) * 0x9e3779b97f4a7c15;
+            key_hash ^= key_hash >> 29;
+        }
+
+        if (iter->sampler.Take(key_hash, now)) Deliver(observer, source, encoded);
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::HandleMembers(ClientHandle& client_handle,
+                                          const Message& msg)
+{
+    json teams = json::object();
+    if (msg.content.contains("team") && msg.content["team"].is_string()) {
+        const std::string& team = msg.content["team"].get_ref<const std::string&>();
+        auto iter = team_sizes.find(team);
+        teams[team] = iter == team_sizes.end() ? 0 : iter->second;
+    } else {
+        for (auto& [team, size] : team_sizes) teams[team] = size;
+    }
+
+    Message reply { .type { MSG_MEMBERS }, .content = { { "teams", std::move(teams) } } };
+    if (client_handle.Write(reply).is_error()) client_handle.Disconnect_NoWrite();
+}
+
+// Timers
+
+template<typename Policies>
+void BasicServer<Policies>::StartTimer(UEvent& event, const timeval& interval,
+                                       std::optional<TimePoint>& due)
+{
+    if constexpr (VIRTUAL_TIME) {
+        // Libevent's timers run on real time, so only the deadline is kept
+        due = Clock::now() + std::chrono::seconds { interval.tv_sec }
+            + std::chrono::microseconds { interval.tv_usec };
+    } else {
+        event_add(event.get(), &interval);
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::RunDueTimers()
+{
+    TimePoint now = Clock::now();
+    std::lock_guard<Lock> guard(clients_mutex);
+    if (membership_due && *membership_due <= now) {
+        membership_due.reset();
+        FlushMembership_NoLock();
+    }
+    if (budget_due && *budget_due <= now) {
+        StartTimer(budget_event, budget_interval, budget_due);
+        CheckBudget();
+    }
+}
+
+template<typename Policies>
+auto BasicServer<Policies>::NextTimer() const -> std::optional<TimePoint>
+    requires (VIRTUAL_TIME)
+{
+    if (!membership_due) return budget_due;
+    if (!budget_due) return membership_due;
+    return std::min(*membership_due, *budget_due);
+}
+
+template<typename Policies>
+void BasicServer<Policies>::MemberJoined(std::string_view team)
+{
+    std::string name { team };
+    ++team_sizes[name];
+    if (membership_changes.empty())
+        StartTimer(membership_event, membership_interval, membership_due);
+    ++membership_changes[name].joined;
+}
+
+template<typename Policies>
+void BasicServer<Policies>::MemberLeft(std::string_view team)
+{
+    std::string name { team };
+    auto iter = team_sizes.find(name);
+    if (iter != team_sizes.end() && --iter->second == 0) team_sizes.erase(iter);
+
+    if (membership_changes.empty())
+        StartTimer(membership_event, membership_interval, membership_due);
+    ++membership_changes[name].left;
+}
+
+template<typename Policies>
+void BasicServer<Policies>::FlushMembership_NoLock()
+{
+    if (membership_changes.empty()) return;
+
+    // Subscribers to every team share a single message
+    json all_changes = json::array();
+    for (auto& [team, delta] : membership_changes) {
+        auto size = team_sizes.find(team);
+        all_changes.push_back({
+            { "team", team },
+            { "joined", delta.joined },
+            { "left", delta.left },
+            { "members", size == team_sizes.end() ? 0 : size->second }
+        });
+    }
+
+    Message all { .type { MSG_MEMBERSHIP }, .content = { { "changes", all_changes } } };
+
+    for (ClientHandle& handle : clients) {
+        if (handle.subscriptions.empty()) continue;
+
+        bool success;
+        if (handle.Subscribed(MSG_ALL)) {
+            success = handle.Write(all).is_ok();
+        } else {
+            json changes = json::array();
+            for (const json& change : all_changes) {
+                if (handle.Subscribed(change["team"].get_ref<const std::string&>()))
+                    changes.push_back(change);
+            }
+            if (changes.empty()) continue;
+            success = handle.Write({
+                .type { MSG_MEMBERSHIP },
+                .content = { { "changes", std::move(changes) } }
+            }).is_ok();
+        }
+
+        if (!success) handle.Disconnect_NoWrite();
+    }
+
+    membership_changes.clear();
+}
+
+// Key-value store
+
+template<typename Policies>
+void BasicServer<Policies>::HandleKV(ClientHandle& client_handle, const Message& msg,
+                                     Reserved op)
+{
+    if (op == Reserved::WATCH) {
+        if (!ValidateJSON(msg.content, VALIDATE_WATCH)) {
+            client_handle.Error("Incorrect format for $$watch message");
+            return;
+        }
+        std::string ns = msg.content["namespace"];
+        bool watch = msg.content["watch"];
+        auto iter = std::ranges::find(client_handle.watching, ns);
+        if (watch) {
+            if (iter == client_handle.watching.end())
+                client_handle.watching.emplace_back(ns);
+        } else {
+            if (iter != client_handle.watching.end())
+                client_handle.watching.erase(iter);
+        }
+        return;
+    }
+
+    const ValidationSeries& checks =
+        op == Reserved::SET ? VALIDATE_KV_SET :
+        op == Reserved::CAS ? VALIDATE_KV_CAS : VALIDATE_KV_KEY;
+
+    if (!ValidateJSON(msg.content, checks)) {
+        client_handle.Error(fmt::format("Incorrect format for {} message", msg.type));
+        return;
+    }
+
+    const std::string& ns = msg.content["namespace"].get_ref<const std::string&>();
+    const std::string& key = msg.content["key"].get_ref<const std::string&>();
+
+    std::string full_key;
+    full_key.reserve(ns.size() + key.size() + 1);
+    full_key.append(ns).push_back('\0');
+    full_key.append(key);
+
+    json reply = { { "namespace", ns }, { "key", key }, { "success", true } };
+    auto iter = kv_store.find(full_key);
+
+    if (op == Reserved::GET) {
+        if (iter == kv_store.end()) {
+            reply["success"] = false;
+            reply["version"] = 0;
+        } else {
+            reply["value"] = iter->second.value;
+            reply["version"] = iter->second.version;
+        }
+    } else if (op == Reserved::DELETE) {
+        if (iter == kv_store.end()) {
+            reply["success"] = false;
+        } else {
+            KVEntry removed = std::move(iter->second);
+            kv_store.erase(iter);
+            kv_charge.Set(kv_charge.Bytes() - removed.bytes);
+            removed.version = ++kv_version;
+            NotifyWatchers_NoLock(ns, key, removed, true);
+        }
+    } else {
+        // A compare-and-set with version 0 only succeeds if the key does not exist
+        uint64_t current = iter == kv_store.end() ? 0 : iter->second.version;
+        size_t bytes = sizeof(KVEntry) + full_key.size()
+            + EstimateSize(msg.content["value"]);
+        size_t replaced = iter == kv_store.end() ? 0 : iter->second.bytes;
+        bool fits = kv_charge.Bytes() - replaced + bytes <= kv_capacity;
+
+        if (!fits || (op == Reserved::CAS && msg.content["version"] != current)) {
+            reply["success"] = false;
+            reply["version"] = current;
+            if (iter != kv_store.end()) reply["value"] = iter->second.value;
+        } else {
+            if (iter == kv_store.end())
+                iter = kv_store.emplace(std::move(full_key), KVEntry {}).first;
+            kv_charge.Set(kv_charge.Bytes() - iter->second.bytes + bytes);
+            iter->second.bytes = bytes;
+            iter->second.value = msg.content["value"];
+            iter->second.version = ++kv_version;
+            reply["version"] = iter->second.version;
+            NotifyWatchers_NoLock(ns, key, iter->second, false);
+        }
+    }
+
+    if (client_handle.Write({ .type = msg.type, .content = std::move(reply) }).is_error())
+        client_handle.Disconnect_NoWrite();
+}
+
+template<typename Policies>
+void BasicServer<Policies>::NotifyWatchers_NoLock(std::string_view ns,
+    std::string_view key, const KVEntry& entry, bool deleted)
+{
+    Message change {
+        .type { MSG_CHANGED },
+        .content = {
+            { "namespace", ns },
+            { "key", key },
+            { "version", entry.version },
+            { "deleted", deleted }
+        }
+    };
+    if (!deleted) change.content["value"] = entry.value;
+
+    for (ClientHandle& handle : clients) {
+        if (!handle.Watching(ns)) continue;
+        if (handle.Write(change).is_error()) handle.Disconnect_NoWrite();
     }
 }
 
 // Libevent setup
 
-tb::error<AllocError> Server::SetupEvents()
+template<typename Policies>
+tb::error<AllocError> BasicServer<Policies>::SetupEvents()
 {
     if (ebase) return tb::ok;
-
-    ebase = make<UEventBase>(event_base_new());
+    CheckThread();
+
+    if constexpr (Policies::THREADED) {
+        ebase = make<UEventBase>(event_base_new());
+    } else {
+        // Nothing else touches the base, so libevent need not lock it
+        event_config* config = event_config_new();
+        if (config) {
+            event_config_set_flag(config, EVENT_BASE_FLAG_NOLOCK);
+            ebase = make<UEventBase>(event_base_new_with_config(config));
+            event_config_free(config);
+        }
+    }
     callback_data.ebase = ebase.get();
 
     interrupt_event = make<UEvent>(
@@ -402,106 +2005,217 @@ tb::error<AllocError> Server::SetupEvents()
         event_new(ebase.get(), -1, 0, callbacks::InternalReadCallback, &callback_data)
     );
 
-    if (!ebase || !interrupt_event || !read_internal_event) {
+    membership_event = make<UEvent>(
+        event_new(ebase.get(), -1, 0, callbacks::MembershipTimerCallback,
+                  &callback_data)
+    );
+
+    parse_event = make<UEvent>(
+        event_new(ebase.get(), -1, 0, callbacks::ParseReadyCallback, &callback_data)
+    );
+
+    budget_event = make<UEvent>(
+        event_new(ebase.get(), -1, EV_PERSIST, callbacks::BudgetTimerCallback,
+                  &callback_data)
+    );
+
+    if (!ebase || !interrupt_event || !read_internal_event || !membership_event
+        || !parse_event || !budget_event) {
         logger(LogLevel::WARNING, "Failed to allocate one or more libevent structures");
         return AllocError {};
     }
 
+    if (MemoryBudget::Global().Limited())
+        StartTimer(budget_event, budget_interval, budget_due);
+
     return tb::ok;
 }
 
-void Server::Listen()
+template<typename Policies>
+void BasicServer<Policies>::Listen()
+{
+    while (true) {
+        // Poll without blocking while there is scheduled work, so that newly
+        // readable clients join the queues between rounds.
+        int flags = EVLOOP_NO_EXIT_ON_EMPTY;
+        if (scheduler.Pending()) flags |= EVLOOP_NONBLOCK;
+
+        if (HandleEvent(flags) == EventType::INTERRUPT) return;
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::Poll() requires (!Policies::THREADED)
+{
+    if (!ebase) return;
+    CheckThread();
+
+    if constexpr (VIRTUAL_TIME) RunDueTimers();
+
+    while (true) {
+        EventType type = HandleEvent(EVLOOP_NO_EXIT_ON_EMPTY | EVLOOP_NONBLOCK);
+        if (type == EventType::INTERRUPT) return;
+        if (type == EventType::NO_EVENT && !scheduler.Pending()) return;
+    }
+}
+
+template<typename Policies>
+void BasicServer<Policies>::CheckThread()
+{
+#ifndef NDEBUG
+    if constexpr (!Policies::THREADED) {
+        if (owner_thread == std::thread::id {}) owner_thread = std::this_thread::get_id();
+        assert(owner_thread == std::this_thread::get_id()
+               && "SingleThreadedServer used from more than one thread");
+    }
+#endif
+}
+
+// Waits for a single event according to the event_base_loop flags and handles it
+template<typename Policies>
+EventType BasicServer<Policies>::HandleEvent(int flags)
 {
-    while (event_base_loop(ebase.get(), EVLOOP_NO_EXIT_ON_EMPTY) == 0) {
-        switch (callback_data.type) {
-        case EventType::NEW_CONNECTION: {
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            AddConnection(callback_data.fd, callback_data.address.sa_family);
+    callback_data.type = EventType::NO_EVENT;
+    if (event_base_loop(ebase.get(), flags) != 0) return EventType::INTERRUPT;
+
+    EventType type = callback_data.type;
+    switch (type) {
+    case EventType::NEW_CONNECTION: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        AddConnection(callback_data.fd, callback_data.address.sa_family);
+        break;
+    }
+    case EventType::READ_READY: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        if (callback_data.fd == unix_datagram || callback_data.fd == udp_datagram) {
+            ReadDatagrams(callback_data.fd);
             break;
         }
-        case EventType::READ_READY: {
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            Server::HandleIter iter = GetClientBySocket(callback_data.fd);
-            if (iter == clients.end()) break;
-            Serve(iter);
 
-            break;
+        HandleIter iter = GetClientBySocket(callback_data.fd);
+        if (iter == clients.end()) break;
+
+        if (fair_scheduling) {
+            event_del(iter->Sock().read_event.get());
+            Schedule(*iter);
+        } else {
+            Serve(iter);
         }
-        case EventType::TIMEOUT: {
-            Server::HandleIter iter = GetClientBySocket(callback_data.fd);
-            if (iter == clients.end()) break;
 
-            if (!iter->handshaken) iter->Disconnect("Failed handshake");
-            break;
+        break;
+    }
+    case EventType::TIMEOUT: {
+        HandleIter iter = GetClientBySocket(callback_data.fd);
+        if (iter == clients.end()) break;
+
+        if (!iter->handshaken) iter->Disconnect("Failed handshake");
+        break;
+    }
+    case EventType::INTERNAL_READ_READY: {
+        event_del(read_internal_event.get());
+        std::vector<std::pair<Client*, Message>> messages;
+        {
+            std::lock_guard<Lock> guard(internal_mutex);
+            messages = std::move(internal_messages);
+            internal_messages.clear();
+            internal_charge.Set(0);
         }
-        case EventType::INTERNAL_READ_READY: {
-            event_del(read_internal_event.get());
-            std::vector<std::pair<Client*, Message>> messages;
-            {
-                std::lock_guard<std::mutex> guard(internal_mutex);
-                messages = std::move(internal_messages);
-            }
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            for (auto& [client_ptr, message] : messages) {
-                Server::HandleIter iter = GetClientByPointer(client_ptr);
-                if (iter == clients.end()) continue;
-                HandleMessage(*iter, std::move(message));
-            }
-            break;
+        std::lock_guard<Lock> guard(clients_mutex);
+        for (auto& [client_ptr, message] : messages) {
+            HandleIter iter = GetClientByPointer(client_ptr);
+            if (iter == clients.end()) continue;
+            HandleMessage(*iter, std::move(message));
         }
-        case EventType::INTERRUPT:
-            return;
-        case EventType::WRITE_READY:
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            Server::HandleIter iter = GetClientBySocket(callback_data.fd);
-            if (iter == clients.end()) break;
+        break;
+    }
+    case EventType::INTERRUPT:
+        return type;
+    case EventType::WRITE_READY: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        HandleIter iter = GetClientBySocket(callback_data.fd);
+        if (iter == clients.end()) break;
+
+        SocketTransport& t = iter->Sock();
+        t.Flush().if_err([&] (int) {
+            event_add(t.write_event.get(), nullptr);
+        });
+        break;
+    }
+    case EventType::MEMBERSHIP_TIMER: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        FlushMembership_NoLock();
+        break;
+    }
+    case EventType::PARSE_READY: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        RouteParsed();
+        break;
+    }
+    case EventType::BUDGET_TIMER: {
+        std::lock_guard<Lock> guard(clients_mutex);
+        CheckBudget();
+        break;
+    }
+    case EventType::NO_EVENT:
+        break;
+    }
 
-            iter->stream.Flush().if_err([&] (int) {
-                event_add(iter->write_event.get(), nullptr);
-            });
-            break;
-        }
+    if (scheduler.Pending()) {
+        std::lock_guard<Lock> guard(clients_mutex);
+        RunScheduler();
+    }
+
+    // So that readers off this thread see joins and leaves once they are handled
+    if (routes_stale) {
+        std::lock_guard<Lock> guard(clients_mutex);
+        if (routes_stale) PublishRoutes();
     }
+
+    return type;
 }
 
-void Server::AddConnection(int fd, sa_family_t addr_family)
+template<typename Policies>
+void BasicServer<Policies>::AddConnection(int fd, sa_family_t addr_family)
 {
-    FILE* stream = fdopen(fd, "r+");
-
-    setvbuf(stream, nullptr, _IONBF, 0);
     int flags = fcntl(fd, F_GETFL);
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-    ConnectionType conn_type;
+    int socket_type = SOCK_STREAM;
+    socklen_t type_size = sizeof(socket_type);
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &socket_type, &type_size);
+
     std::string_view debug_string;
 
     switch (addr_family) {
     case AF_LOCAL:
-        conn_type = ConnectionType::UNIX;
         evconnlistener_enable(unix_listener.get());
         debug_string = "UNIX";
         break;
     case AF_INET:
     default:
-        conn_type = ConnectionType::INTERNET;
         evconnlistener_enable(ip_listener.get());
         debug_string = "internet";
         break;
     }
 
-    auto& handle_ref = clients.emplace_back(conn_type, stream, max_msg_length);
+    auto& handle_ref = socket_type == SOCK_SEQPACKET
+        ? clients.emplace_back(fd, max_msg_length, capabilities)
+        : clients.emplace_back(fdopen(fd, "r+"), max_msg_length, capabilities);
+    handle_ref.id = next_client_id++;
+    SocketTransport& t = handle_ref.Sock();
+    t.local = addr_family == AF_LOCAL;
 
-    handle_ref.read_event = make<UEvent>(
+    t.read_event = make<UEvent>(
         event_new(ebase.get(), fd, EV_PERSIST | EV_READ,
                   callbacks::ReadWriteCallback, &callback_data)
     );
 
-    handle_ref.write_event = make<UEvent>(
+    t.write_event = make<UEvent>(
         event_new(ebase.get(), fd, EV_WRITE,
                   callbacks::ReadWriteCallback, static_cast<void*>(&callback_data))
     );
 
-    event_add(handle_ref.read_event.get(), &callbacks::DEFAULT_TIMEOUT);
+    event_add(t.read_event.get(), &callbacks::DEFAULT_TIMEOUT);
 
     logger(LogLevel::DEBUG,
         fmt::format("New client connected on {} domain, fd = {}", debug_string, fd));
@@ -509,11 +2223,12 @@ void Server::AddConnection(int fd, sa_family_t addr_family)
 
 // ClientHandle iteration
 
-auto Server::GetClientBySocket(int fd) -> HandleIter
+template<typename Policies>
+auto BasicServer<Policies>::GetClientBySocket(int fd) -> HandleIter
 {
     auto iter = std::ranges::find_if(clients,
         [fd] (ClientHandle& handle) {
-            return handle.socket == fd;
+            return handle.Socket() == fd;
         }
     );
 
@@ -524,11 +2239,12 @@ auto Server::GetClientBySocket(int fd) -> HandleIter
     return iter;
 }
 
-auto Server::GetClientByPointer(Client* ptr) -> HandleIter
+template<typename Policies>
+auto BasicServer<Policies>::GetClientByPointer(Client* ptr) -> HandleIter
 {
     auto iter = std::ranges::find_if(clients,
         [ptr] (ClientHandle& handle) {
-            return handle.client_ptr == ptr;
+            return handle.InternalClient() == ptr;
         }
     );
 
@@ -540,19 +2256,71 @@ auto Server::GetClientByPointer(Client* ptr) -> HandleIter
     return iter;
 }
 
-auto Server::GetFirstAvailable(std::string_view team, std::string_view type,
-                               const ClientHandle& exclude) -> HandleIter
+template<typename Policies>
+auto BasicServer<Policies>::GetFirstAvailable(std::string_view team,
+    std::string_view type, const ClientHandle& exclude) -> HandleIter
 {
     HandleIter result = clients.end();
 
-    for (auto it = clients.begin(); it != clients.end(); ++it) {
-        if ((it->preferences.teamname == team || team == MSG_ALL) && &(*it) != &exclude)
+    RoutesReader table = Routes();
+    for (const RoutingTable::Team& entry : table->teams) {
+        if (!Routing::Matches(entry.name, team)) continue;
+        for (const RoutingTable::Member& member : entry.members) {
+            HandleIter it = Resolve(member);
+            if (it == clients.end()) continue;
+            if (&(*it) == &exclude) continue;
             result = it;
-        else continue;
-        if (result->Available(type)) return result;
+            if (result->Available(type)) return result;
+        }
     }
 
     return result;
 }
 
+// Routing table
+
+template<typename Policies>
+auto BasicServer<Policies>::Routes() -> RoutesReader
+{
+    if (routes_stale) PublishRoutes();
+    return routes.Read();
+}
+
+template<typename Policies>
+void BasicServer<Policies>::PublishRoutes()
+{
+    auto table = std::make_unique<RoutingTable>();
+    std::unordered_map<std::string_view, size_t> positions;
+
+    for (uint32_t i = 0; i < clients.size(); ++i) {
+        const ClientHandle& handle = clients[i];
+        if (!handle.handshaken) continue;
+
+        auto [iter, added] = positions.try_emplace(handle.preferences.teamname,
+                                                   table->teams.size());
+        if (added) table->teams.push_back({ handle.preferences.teamname, {} });
+        table->teams[iter->second].members.push_back({ i, handle.id });
+    }
+
+    routes.Publish(std::move(table));
+    routes_stale = false;
+}
+
+template<typename Policies>
+auto BasicServer<Policies>::Resolve(const RoutingTable::Member& member) -> HandleIter
+{
+    if (member.position < clients.size() && clients[member.position].id == member.id)
+        return clients.begin() + member.position;
+
+    // Clients only move towards the front, and stay in order of id
+    auto end = clients.begin() + std::min<size_t>(member.position, clients.size());
+    HandleIter iter = std::ranges::lower_bound(clients.begin(), end, member.id, {},
+                                               &ClientHandle::id);
+    return iter != end && iter->id == member.id ? iter : clients.end();
+}
+
+template class BasicServer<ThreadedPolicies>;
+template class BasicServer<SingleThreadedPolicies>;
+template class BasicServer<SimulatedPolicies>;
+
 }
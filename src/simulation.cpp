@@ -0,0 +1,159 @@
+#include "simulation.hpp"
+
+#include <algorithm>
+
+namespace buxtehude
+{
+
+struct Simulation::Link
+{
+    Link(Simulation& sim, const ClientPreferences& preferences, LinkProfile profile)
+        : sim(sim), client(preferences), profile(profile) {}
+
+    Simulation& sim;
+    Client client;
+    LinkProfile profile;
+    Direction up, down; // To & from the server
+};
+
+// The earliest event is at the top of the heap
+template<typename Event>
+static bool Later(const Event& a, const Event& b)
+{
+    if (a.due != b.due) return a.due > b.due;
+    if (a.tiebreak != b.tiebreak) return a.tiebreak > b.tiebreak;
+    return a.sequence > b.sequence;
+}
+
+Simulation::Simulation(uint64_t seed) : random(seed) {}
+
+Simulation::~Simulation() = default;
+
+tb::error<AllocError> Simulation::Start()
+{
+    return server.InternalServer();
+}
+
+Client& Simulation::AddClient(const ClientPreferences& preferences, LinkProfile profile)
+{
+    static constexpr InternalServerLink LINK {
+        .add = [] (void* l, Client& cl) {
+            static_cast<Link*>(l)->sim.server.Internal_AddClient(cl);
+        },
+        .remove = [] (void* l, Client& cl) {
+            static_cast<Link*>(l)->sim.server.Internal_RemoveClient(cl);
+        },
+        .receive = [] (void* l, Client&, const Message& msg) {
+            Link& link = *static_cast<Link*>(l);
+            link.sim.Send(link, link.up, msg, true);
+        },
+        .deliver = [] (void* l, Client&, const Message& msg) {
+            Link& link = *static_cast<Link*>(l);
+            link.sim.Send(link, link.down, msg, false);
+        }
+    };
+
+    Link& link = *links.emplace_back(std::make_unique<Link>(*this, preferences, profile));
+    link.client.ConnectInternal(&link, LINK).if_err([] (const ConnectError&) {
+        logger(LogLevel::WARNING, "Failed to connect simulated client");
+    });
+    WakeServer();
+    return link.client;
+}
+
+// Events
+
+void Simulation::Schedule(Clock::duration delay, Event&& event)
+{
+    Schedule(Clock::now() + delay, std::move(event));
+}
+
+void Simulation::Schedule(Clock::time_point due, Event&& event)
+{
+    events.push_back({ due, random(), sequence++, std::move(event) });
+    std::push_heap(events.begin(), events.end(), Later<Scheduled>);
+}
+
+bool Simulation::Step()
+{
+    if (events.empty()) return false;
+
+    std::pop_heap(events.begin(), events.end(), Later<Scheduled>);
+    Scheduled next = std::move(events.back());
+    events.pop_back();
+
+    Clock::Advance(next.due - Clock::now());
+    next.event();
+    WakeServer();
+    return true;
+}
+
+void Simulation::RunFor(Clock::duration duration)
+{
+    Clock::time_point end = Clock::now() + duration;
+    while (!events.empty() && events.front().due <= end) Step();
+    Clock::Advance(end - Clock::now());
+}
+
+bool Simulation::RunUntil(const std::function<bool()>& done, Clock::duration limit)
+{
+    Clock::time_point end = Clock::now() + limit;
+    while (!done() && !events.empty() && events.front().due <= end) Step();
+    return done();
+}
+
+void Simulation::RunUntilIdle()
+{
+    while (Step());
+}
+
+// Messages are sent one after another at the link's bandwidth, then take its
+// latency to arrive. Each event delivers the oldest message in flight, so jitter
+// never reorders a direction.
+void Simulation::Send(Link& link, Direction& direction, const Message& msg,
+                      bool upstream)
+{
+    const LinkProfile& profile = link.profile;
+    Clock::time_point now = Clock::now();
+
+    Clock::time_point sent = std::max(now, direction.busy_until);
+    if (profile.bandwidth) {
+        size_t size = Message::Encode(msg, link.client.preferences.format).size();
+        sent += std::chrono::microseconds(size * 1'000'000 / profile.bandwidth);
+    }
+    direction.busy_until = sent;
+
+    Clock::duration delay = profile.latency;
+    if (profile.jitter.count() > 0) {
+        uint64_t range = profile.jitter.count() + 1;
+        delay += std::chrono::microseconds(random() % range);
+    }
+    direction.last_due = std::max(direction.last_due, sent + delay);
+
+    direction.in_flight.push_back(msg);
+    Schedule(direction.last_due, [this, &link, &direction, upstream] {
+        Message arrived = std::move(direction.in_flight.front());
+        direction.in_flight.pop_front();
+
+        Client& client = link.client;
+        if (!client.connected) return;
+        if (upstream) server.Internal_ReceiveFrom(client, arrived);
+        else client.HandleMessage(arrived);
+    });
+}
+
+// Runs whatever the server has to do, and wakes it again for its next timer
+void Simulation::WakeServer()
+{
+    server.Poll();
+
+    std::optional<Clock::time_point> next = server.NextTimer();
+    if (!next || (server_wake && *server_wake <= *next)) return;
+
+    server_wake = next;
+    Schedule(*next, [this, due = *next] {
+        if (server_wake == due) server_wake.reset();
+    });
+}
+
+}
@@ -0,0 +1,272 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <buxtehude.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+    using namespace std::chrono_literals;
+
+    Initialise([] (LogLevel level, std::string_view message) {
+        if (level >= LogLevel::WARNING) printf("(buxtehude) %.*s\n",
+            static_cast<int>(message.size()), message.data());
+    });
+
+    MemoryBudget& budget = MemoryBudget::Global();
+
+    // (1) Charges follow their owner and are released with it
+    {
+        size_t before = budget.Used();
+        {
+            MemoryCharge charge;
+            charge.Set(1000);
+            assert(budget.Used() == before + 1000);
+            charge.Set(400);
+            assert(budget.Used() == before + 400);
+
+            MemoryCharge moved = std::move(charge);
+            assert(charge.Bytes() == 0 && moved.Bytes() == 400);
+            assert(budget.Used() == before + 400);
+        }
+        assert(budget.Used() == before);
+
+        budget.SetLimits(before + 10, before + 20);
+        MemoryCharge charge;
+        charge.Set(15);
+        assert(budget.OverSoft() && !budget.OverHard());
+        charge.Set(25);
+        assert(budget.OverHard());
+        budget.SetLimits(0, 0);
+        assert(!budget.OverSoft() && !budget.OverHard());
+    }
+
+    // (2) Streams are charged for what arrives, not for what is announced. Over the
+    // soft limit, buffers are freed rather than pooled.
+    {
+        int fds[2];
+        assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, fds) == 0);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        FILE* file = fdopen(fds[1], "r");
+        setvbuf(file, nullptr, _IONBF, 0);
+
+        MemoryCharge pressure;
+        pressure.Set(2);
+        budget.SetLimits(1, 0);
+        size_t before = budget.Used();
+        {
+            Stream stream(file);
+            stream.Await(1024 * 1024 * 16);
+
+            std::string data(1024 * 100, 'b');
+            assert(write(fds[0], data.data(), data.size()) == ssize_t(data.size()));
+            assert(stream.Read() == false);
+
+            size_t charged = budget.Used() - before;
+            assert(charged >= data.size() && charged < data.size() * 4);
+        }
+        assert(budget.Used() == before);
+        budget.SetLimits(0, 0);
+
+        close(fds[0]);
+        fclose(file);
+    }
+
+    // (3) Past the hard limit, the client with the most output queued is
+    // disconnected. Over the soft limit, the producer is paused instead, until the
+    // backed up recipient catches up.
+    for (bool hard : { true, false }) {
+        constexpr int MESSAGES = 96;
+        const char* path = hard ? "_unix_budget_hard" : "_unix_budget_soft";
+
+        size_t limit = budget.Used() + 1024 * 1024;
+        if (hard) budget.SetLimits(0, limit);
+        else budget.SetLimits(limit, 0);
+
+        Server server;
+        server.budget_interval = { 0, 10'000 };
+        assert(server.UnixServer(path).is_ok());
+
+        std::atomic<bool> release = false;
+        std::atomic<int> received = 0;
+        Client sink({ .teamname = "sink" });
+        sink.AddHandler("bulk", [&release, &received] (Client&, const Message&) {
+            // Stops reading, so the server's output for it piles up
+            while (!release) std::this_thread::sleep_for(1ms);
+            ++received;
+        });
+        assert(sink.UnixConnect(path).is_ok());
+
+        // Over a bare socket, so that its own unsent output is not charged
+        int producer = socket(AF_LOCAL, SOCK_STREAM, 0);
+        sockaddr_un address { .sun_family = AF_LOCAL };
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        assert(connect(producer, reinterpret_cast<sockaddr*>(&address),
+                       sizeof(address)) == 0);
+
+        auto send_all = [producer] (const std::vector<uint8_t>& frame) {
+            for (size_t sent = 0; sent < frame.size();) {
+                ssize_t result = send(producer, frame.data() + sent,
+                                      frame.size() - sent, MSG_NOSIGNAL);
+                if (result <= 0) return;
+                sent += result;
+            }
+        };
+
+        send_all(Message::Encode({
+            .type { MSG_HANDSHAKE },
+            .content = {
+                { "format", MessageFormat::JSON },
+                { "teamname", "producer" },
+                { "version", CURRENT_VERSION },
+                { "max-message-length", DEFAULT_MAX_MESSAGE_LENGTH }
+            }
+        }, MessageFormat::JSON));
+
+        Message bulk;
+        bulk.dest = "sink";
+        bulk.type = "bulk";
+        bulk.content = std::string(1024 * 64, 'x');
+        std::vector<uint8_t> frame = Message::Encode(bulk, MessageFormat::JSON);
+        std::thread writer([&send_all, &frame] {
+            for (int i = 0; i < MESSAGES; ++i) send_all(frame);
+        });
+
+        auto wait_for = [] (auto&& condition) {
+            auto deadline = std::chrono::steady_clock::now() + 10s;
+            while (!condition() && std::chrono::steady_clock::now() < deadline)
+                std::this_thread::sleep_for(5ms);
+            return condition();
+        };
+
+        if (hard) {
+            assert(wait_for([&server] {
+                return server.MemoryBudgetStats().disconnected == 1;
+            }));
+            release = true;
+        } else {
+            assert(wait_for([&server] { return server.MemoryBudgetStats().paused == 1; }));
+            release = true;
+            assert(wait_for([&received] { return received == MESSAGES; }));
+
+            BudgetStats stats = server.MemoryBudgetStats();
+            assert(stats.pauses >= 1 && stats.paused == 0 && stats.disconnected == 0);
+        }
+
+        writer.join();
+        close(producer);
+        server.Close();
+        budget.SetLimits(0, 0);
+    }
+
+    // (4) Past the hard limit, a client is also disconnected for what it has sent
+    // the server, with no output queued for it at all
+    {
+        const char* path = "_unix_budget_inbound";
+        budget.SetLimits(0, budget.Used() + 1024 * 32);
+
+        Server server;
+        server.budget_interval = { 0, 10'000 };
+        assert(server.UnixServer(path).is_ok());
+
+        int producer = socket(AF_LOCAL, SOCK_STREAM, 0);
+        sockaddr_un address { .sun_family = AF_LOCAL };
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        assert(connect(producer, reinterpret_cast<sockaddr*>(&address),
+                       sizeof(address)) == 0);
+
+        std::vector<uint8_t> hello = Message::Encode({
+            .type { MSG_HANDSHAKE },
+            .content = {
+                { "format", MessageFormat::JSON },
+                { "teamname", "producer" },
+                { "version", CURRENT_VERSION },
+                { "max-message-length", DEFAULT_MAX_MESSAGE_LENGTH }
+            }
+        }, MessageFormat::JSON);
+        assert(write(producer, hello.data(), hello.size()) == ssize_t(hello.size()));
+
+        // Most of a frame, which the server holds on to until the rest arrives
+        Message bulk;
+        bulk.dest = "nobody";
+        bulk.type = "bulk";
+        bulk.content = std::string(1024 * 96, 'x');
+        std::vector<uint8_t> frame = Message::Encode(bulk, MessageFormat::JSON);
+        frame.resize(frame.size() - 1);
+        for (size_t sent = 0; sent < frame.size();) {
+            ssize_t result = send(producer, frame.data() + sent, frame.size() - sent,
+                                  MSG_NOSIGNAL);
+            assert(result > 0);
+            sent += result;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (server.MemoryBudgetStats().disconnected == 0
+               && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(5ms);
+        assert(server.MemoryBudgetStats().disconnected == 1);
+
+        close(producer);
+        server.Close();
+        budget.SetLimits(0, 0);
+    }
+
+    // (5) Frames copied for parse workers, cached replies, remembered idempotency
+    // keys and the key-value store are charged too
+    {
+        size_t before = budget.Used();
+        {
+            std::string body(1024 * 10, 'j');
+            ParseJob job(MessageFormat::JSON, body);
+            assert(budget.Used() >= before + body.size());
+        }
+        assert(budget.Used() == before);
+
+        {
+            ResponseCache cache;
+            cache.SetTTL("team", "type", 1min);
+            cache.Insert("team", "type", 1, std::string(1024 * 10, 'c'),
+                         ResponseCache::Clock::now());
+            assert(budget.Used() == before + cache.Bytes() && cache.Bytes() > 1024 * 10);
+            cache.SetTTL("team", "type", 0ms);
+            assert(budget.Used() == before);
+
+            DedupWindow window;
+            window.Seen("team", "key", DedupWindow::Clock::now());
+            assert(budget.Used() == before + window.Stats().bytes);
+        }
+        assert(budget.Used() == before);
+
+        SingleThreadedServer server;
+        assert(server.InternalServer().is_ok());
+        Client client({ .teamname = "kv" });
+        assert(client.InternalConnect(server).is_ok());
+        server.Poll();
+
+        size_t connected = budget.Used();
+        assert(client.Set("ns", "key", std::string(1024 * 10, 'v')).is_ok());
+        server.Poll();
+        assert(budget.Used() >= connected + 1024 * 10);
+        assert(client.Delete("ns", "key").is_ok());
+        server.Poll();
+        assert(budget.Used() == connected);
+
+        client.Disconnect();
+        server.Close();
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
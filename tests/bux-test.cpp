@@ -1,17 +1,29 @@
 #include <buxtehude.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
 
 #include <string_view>
+#include <vector>
 
 #include <fmt/core.h>
 
 #include <chrono>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 namespace bux = buxtehude;
 
+// Readers the server reported as falling behind on its broadcast ring
+static std::atomic<int> lagging_readers = 0;
+
 int main()
 {
     fmt::print("Starting test ({})\n", __FILE__);
@@ -20,6 +32,7 @@ int main()
     constexpr std::string_view UNIX_FILE = "_unix_bux";
 
     bux::Initialise([] (auto level, auto msg) {
+        if (msg.find("fell behind on the broadcast ring") != msg.npos) ++lagging_readers;
         if (level < bux::LogLevel::WARNING) return;
         fmt::print("(buxtehude) {}\n", msg);
     });
@@ -46,6 +59,14 @@ int main()
         fmt::print("Started INET server OK\n");
     });
 
+    server.SetLossy("metric", true);
+    server.UDPServer(PORT).if_err([fail_test] (bux::ListenError e) {
+        fmt::print("Failed to start UDP server: {}\n", e.What());
+        fail_test();
+    }).if_ok([] {
+        fmt::print("Started UDP server OK\n");
+    });
+
     bux::Client client_ip({
         .teamname = "ip-client",
         .format = bux::MessageFormat::MSGPACK
@@ -95,6 +116,14 @@ int main()
         });
     });
 
+    bool unix_got_metric = false;
+
+    client_unix.AddHandler("metric",
+      [&unix_got_metric] (bux::Client&, const bux::Message&) {
+        fmt::print("unix-client received metric OK\n");
+        unix_got_metric = true;
+    });
+
     client_unix.UnixConnect(UNIX_FILE).if_err([&fail_test] (bux::ConnectError e) {
         fmt::print("unix-client failed to connect to unix server: {}\n", e.What());
         fail_test();
@@ -133,6 +162,47 @@ int main()
         fmt::print("internal-client connected to server OK\n");
     });
 
+    // Key-value store
+
+    bool internal_got_change = false;
+
+    client_internal.AddHandler(std::string { bux::MSG_CHANGED },
+      [&internal_got_change] (bux::Client&, const bux::Message& m) {
+        if (m.content["key"] != "organist" || m.content["value"] != "Buxtehude")
+            return;
+        fmt::print("internal-client received key-value change OK\n");
+        internal_got_change = true;
+    });
+
+    client_internal.Watch("lübeck", true).if_err([&fail_test] (bux::WriteError) {
+        fmt::print("internal-client failed to watch namespace\n");
+        fail_test();
+    });
+
+    // Team membership - a socket client leaving is counted like any other
+
+    bux::Client client_leaver({ .teamname = "leaver" });
+    int leaver_left = 0, leaver_members = -1;
+
+    client_internal.AddHandler(std::string { bux::MSG_MEMBERSHIP },
+      [&leaver_left, &leaver_members] (bux::Client&, const bux::Message& m) {
+        for (const bux::json& change : m.content["changes"]) {
+            if (change["team"] != "leaver") continue;
+            leaver_left += change["left"].get<int>();
+            leaver_members = change["members"];
+        }
+    });
+
+    client_internal.Subscribe("leaver", true).if_err([&fail_test] (bux::WriteError) {
+        fmt::print("internal-client failed to subscribe\n");
+        fail_test();
+    });
+
+    client_leaver.UnixConnect(UNIX_FILE).if_err([&fail_test] (bux::ConnectError e) {
+        fmt::print("leaver failed to connect to unix server: {}\n", e.What());
+        fail_test();
+    });
+
     // Test ping pong
 
     using namespace std::chrono_literals;
@@ -150,10 +220,720 @@ int main()
         fail_test();
     });
 
+    // Sent as a datagram, the IP client being on the loopback interface
+    client_ip.Write({
+        .type = "metric", .dest = "unix-client", .content = 1
+    }).if_err([&fail_test] (bux::WriteError) {
+        fmt::print("ip-client failed to write metric\n");
+        fail_test();
+    });
+
+    client_ip.Set("lübeck", "organist", "Buxtehude").if_err([&fail_test] (bux::WriteError) {
+        fmt::print("ip-client failed to set key\n");
+        fail_test();
+    });
+
+    client_leaver.Disconnect();
+
     fmt::print("Sleeping for 1s...\n");
     std::this_thread::sleep_for(1s);
 
-    assert(ip_got_pong && unix_got_ping);
+    assert(leaver_left == 1 && leaver_members == 0);
+    assert(ip_got_pong && unix_got_ping && internal_got_change && unix_got_metric);
+    assert(server.LossyDeliveryStats().datagrams == 1);
+
+    // Shutting down - INTERNAL clients' handlers may call back into the server
+    bool internal_closed = false;
+    client_internal.SetDisconnectHandler([&server, &internal_closed] (bux::Client&) {
+        internal_closed = server.LossyDeliveryStats().datagrams == 1;
+    });
+    server.Close();
+    assert(internal_closed);
+
+    // Waits up to 5s for done() to hold
+    auto wait_until = [] (auto&& done) {
+        for (int i = 0; i < 500 && !done(); ++i) std::this_thread::sleep_for(10ms);
+        return done();
+    };
+
+    // Client decode workers - messages decoded off the listening thread reach
+    // handlers whole & in order, and disconnecting with decodes queued is safe
+    {
+        bux::Server decode_server;
+        decode_server.UnixServer("_unix_decode").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start decode server\n");
+            fail_test();
+        });
+
+        bux::Client sender({ .teamname = "decode-sender" });
+        bux::Client receiver({
+            .teamname = "decode-receiver",
+            .format = bux::MessageFormat::JSON,
+            .decode_workers = 2,
+            .decode_threshold = 1024
+        });
+
+        std::vector<bux::json> received;
+        std::atomic<size_t> count = 0;
+        receiver.AddHandler("decode", [&] (bux::Client&, const bux::Message& m) {
+            received.push_back(m.content);
+            ++count;
+        });
+
+        for (bux::Client* c : { &sender, &receiver }) {
+            c->UnixConnect("_unix_decode").if_err([&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to decode server\n");
+                fail_test();
+            });
+        }
+        std::this_thread::sleep_for(100ms);
+
+        // Every third message is large enough for the workers
+        auto content = [] (int n, size_t padding) {
+            return bux::json {
+                { "n", n }, { "padding", std::string(padding, 'a' + n % 26) }
+            };
+        };
+        std::vector<bux::json> sent;
+        for (int n = 0; n < 60; ++n) {
+            sent.push_back(content(n, n % 3 ? 16 : 64 * 1024));
+            sender.Write({
+                .type = "decode", .dest = "decode-receiver", .content = sent.back()
+            }).if_err([&fail_test] (bux::WriteError) {
+                fmt::print("decode-sender failed to write\n");
+                fail_test();
+            });
+        }
+        assert(wait_until([&count] { return count == 60; }));
+        assert(received == sent);
+
+        // Disconnecting before the workers catch up drops what they are decoding
+        for (int n = 0; n < 40; ++n) {
+            sender.Write({
+                .type = "decode", .dest = "decode-receiver",
+                .content = content(n, 96 * 1024)
+            }).ignore_error();
+        }
+        assert(wait_until([&count] { return count > 60; }));
+        receiver.Disconnect();
+        std::this_thread::sleep_for(100ms);
+        size_t handled = count;
+        std::this_thread::sleep_for(200ms);
+        assert(count == handled && handled <= 100);
+        for (size_t i = 60; i < handled; ++i) assert(received[i]["n"] == i - 60);
+
+        decode_server.Close();
+    }
+
+    // Parse workers - frames decoded off the server thread keep their order
+    {
+        bux::Server parse_server;
+        parse_server.parse_workers = 2;
+        parse_server.UnixServer("_unix_parse").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start parse server\n");
+            fail_test();
+        });
+
+        std::vector<int> sequence;
+        std::atomic<size_t> count = 0;
+        bux::Client sink({ .teamname = "parse-sink" });
+        sink.AddHandler("sequence", [&] (bux::Client&, const bux::Message& m) {
+            sequence.push_back(m.content["n"]);
+            ++count;
+        });
+        sink.InternalConnect(parse_server).if_err([&fail_test] (bux::ConnectError) {
+            fmt::print("parse-sink failed to connect\n");
+            fail_test();
+        });
+
+        bux::Client source({ .teamname = "parse-source" });
+        source.UnixConnect("_unix_parse").if_err([&fail_test] (bux::ConnectError) {
+            fmt::print("parse-source failed to connect\n");
+            fail_test();
+        });
+        std::this_thread::sleep_for(100ms);
+
+        // Every other frame is large enough for the workers
+        for (int n = 0; n < 20; ++n) {
+            source.Write({
+                .type = "sequence", .dest = "parse-sink",
+                .content = {
+                    { "n", n },
+                    { "padding", std::string(n % 2 ? 0 : 4 * parse_server.parse_threshold,
+                                             'x') }
+                }
+            }).if_err([&fail_test] (bux::WriteError) {
+                fmt::print("parse-source failed to write\n");
+                fail_test();
+            });
+        }
+
+        assert(wait_until([&count] { return count == 20; }));
+        for (int n = 0; n < 20; ++n) assert(sequence[n] == n);
+        parse_server.Close();
+    }
+
+    // UNIX datagrams - served through the fair scheduler, and rejected unless they
+    // carry a client's token, fit the server's limits & are of a lossy type
+    {
+        bux::Server dgram_server;
+        dgram_server.fair_scheduling = true;
+        dgram_server.max_msg_length = 4096;
+        dgram_server.SetLossy("metric", true);
+        dgram_server.UnixServer("_unix_dgram").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start datagram server\n");
+            fail_test();
+        });
+        dgram_server.UnixDatagramServer("_unix_dgram_d").if_err(
+          [&fail_test] (bux::ListenError) {
+            fmt::print("Failed to listen for UNIX datagrams\n");
+            fail_test();
+        });
+
+        std::atomic<int> metrics = 0;
+        bux::Client sink({ .teamname = "dgram-sink" });
+        sink.AddHandler("metric", [&metrics] (bux::Client&, const bux::Message&) {
+            ++metrics;
+        });
+        bux::Client sender({ .teamname = "dgram-sender" });
+        for (bux::Client* c : { &sink, &sender }) {
+            c->UnixConnect("_unix_dgram").if_err([&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to datagram server\n");
+                fail_test();
+            });
+        }
+        std::this_thread::sleep_for(100ms);
+
+        sender.Write({ .type = "metric", .dest = "dgram-sink", .content = 1 }).if_err(
+          [&fail_test] (bux::WriteError) {
+            fmt::print("dgram-sender failed to write metric\n");
+            fail_test();
+        });
+        assert(wait_until([&metrics] { return metrics == 1; }));
+        assert(dgram_server.LossyDeliveryStats().datagrams == 1);
+
+        // A client handshaking over a raw socket, to learn its token
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, "_unix_dgram");
+        int raw = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(connect(raw, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+        std::vector<uint8_t> hello = bux::Message::Encode({
+            .type = std::string { bux::MSG_HANDSHAKE },
+            .content = {
+                { "format", bux::MessageFormat::JSON },
+                { "teamname", "dgram-raw" },
+                { "version", bux::CURRENT_VERSION },
+                { "max-message-length", 4096 },
+                { "capabilities", bux::Capabilities {}.Add(bux::Feature::DATAGRAM) }
+            }
+        }, bux::MessageFormat::JSON);
+        assert(write(raw, hello.data(), hello.size()) == ssize_t(hello.size()));
+        std::this_thread::sleep_for(100ms);
+
+        std::vector<uint8_t> replies(64 * 1024);
+        ssize_t replied = read(raw, replies.data(), replies.size());
+        uint64_t token = 0;
+        for (ssize_t i = 0; i + ssize_t(bux::FRAME_HEADER_SIZE) <= replied;) {
+            bux::MessageFormat format;
+            uint32_t length;
+            memcpy(&format, replies.data() + i, sizeof(format));
+            memcpy(&length, replies.data() + i + sizeof(format), sizeof(length));
+            bux::Message reply = bux::Message::Deserialise(format, {
+                reinterpret_cast<const char*>(replies.data()) + i + bux::FRAME_HEADER_SIZE,
+                length
+            });
+            if (reply.type == bux::MSG_DATAGRAM) token = reply.content["token"];
+            i += bux::FRAME_HEADER_SIZE + length;
+        }
+        assert(token != 0);
+
+        strcpy(addr.sun_path, "_unix_dgram_d");
+        int dgram = socket(AF_UNIX, SOCK_DGRAM, 0);
+        auto send_datagram = [&] (uint64_t with_token, const bux::Message& m) {
+            std::vector<uint8_t> datagram(sizeof(uint64_t));
+            memcpy(datagram.data(), &with_token, sizeof(uint64_t));
+            std::vector<uint8_t> frame = bux::Message::Encode(m, bux::MessageFormat::JSON);
+            datagram.insert(datagram.end(), frame.begin(), frame.end());
+            sendto(dgram, datagram.data(), datagram.size(), 0,
+                   reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        };
+
+        send_datagram(token, { .type = "metric", .dest = "dgram-sink", .content = 2 });
+        assert(wait_until([&metrics] { return metrics == 2; }));
+
+        send_datagram(token + 1, { .type = "metric", .dest = "dgram-sink", .content = 3 });
+        send_datagram(token, {
+            .type = "metric", .dest = "dgram-sink", .content = std::string(5000, 'x')
+        });
+        send_datagram(token, { .type = "status", .dest = "dgram-sink" });
+        send_datagram(token, {
+            .type = std::string { bux::MSG_MEMBERS }, .dest = "dgram-sink"
+        });
+        assert(wait_until([&dgram_server] {
+            return dgram_server.LossyDeliveryStats().rejected == 4;
+        }));
+        assert(metrics == 2 && dgram_server.LossyDeliveryStats().datagrams == 2);
+
+        close(dgram);
+        close(raw);
+        dgram_server.Close();
+    }
+
+    // Adaptive egress - a recipient accepting both formats is forwarded the sender's
+    // frame byte for byte, while one that only accepts its own is sent a re-encoding
+    {
+        bux::Server adaptive_server;
+        adaptive_server.UnixServer("_unix_adaptive").if_err(
+          [&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start adaptive server\n");
+            fail_test();
+        });
+
+        auto raw_connect = [] (const char* team, const bux::Capabilities& capabilities) {
+            sockaddr_un addr {};
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, "_unix_adaptive");
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+            std::vector<uint8_t> hello = bux::Message::Encode({
+                .type = std::string { bux::MSG_HANDSHAKE },
+                .content = {
+                    { "format", bux::MessageFormat::MSGPACK },
+                    { "teamname", team },
+                    { "version", bux::CURRENT_VERSION },
+                    { "max-message-length", 4096 },
+                    { "capabilities", capabilities }
+                }
+            }, bux::MessageFormat::MSGPACK);
+            assert(write(fd, hello.data(), hello.size()) == ssize_t(hello.size()));
+            return fd;
+        };
+        // Every frame read so far, as its format and body
+        auto read_frames = [] (int fd) {
+            std::vector<std::pair<bux::MessageFormat, std::string>> frames;
+            std::vector<char> buffer(64 * 1024);
+            ssize_t got = read(fd, buffer.data(), buffer.size());
+            for (ssize_t i = 0; i + ssize_t(bux::FRAME_HEADER_SIZE) <= got;) {
+                bux::MessageFormat format;
+                uint32_t length;
+                memcpy(&format, buffer.data() + i, sizeof(format));
+                memcpy(&length, buffer.data() + i + sizeof(format), sizeof(length));
+                frames.emplace_back(format,
+                    std::string { buffer.data() + i + bux::FRAME_HEADER_SIZE, length });
+                i += bux::FRAME_HEADER_SIZE + length;
+            }
+            return frames;
+        };
+
+        int adaptive = raw_connect("adaptive-both", bux::DefaultCapabilities());
+        int fixed = raw_connect("adaptive-fixed", {});
+        int sender = raw_connect("adaptive-sender", {});
+        std::this_thread::sleep_for(100ms);
+        for (int fd : { adaptive, fixed, sender }) read_frames(fd);
+
+        // Spacing and key order that encoding the message again would not reproduce
+        auto send_body = [sender] (std::string_view dest) {
+            std::string body = fmt::format(
+                R"({{ "src": "adaptive-sender", "type": "tempo", "dest": "{}", )"
+                R"("content": {{ "z": 1, "a": [1, 2] }} }})", dest);
+            std::vector<uint8_t> frame(bux::FRAME_HEADER_SIZE + body.size());
+            bux::MessageFormat format = bux::MessageFormat::JSON;
+            uint32_t length = body.size();
+            memcpy(frame.data(), &format, sizeof(format));
+            memcpy(frame.data() + sizeof(format), &length, sizeof(length));
+            memcpy(frame.data() + bux::FRAME_HEADER_SIZE, body.data(), body.size());
+            assert(write(sender, frame.data(), frame.size()) == ssize_t(frame.size()));
+            return body;
+        };
+
+        std::string sent = send_body("adaptive-both");
+        std::this_thread::sleep_for(100ms);
+        auto received = read_frames(adaptive);
+        assert(received.size() == 1);
+        assert(received[0].first == bux::MessageFormat::JSON && received[0].second == sent);
+
+        send_body("adaptive-fixed");
+        std::this_thread::sleep_for(100ms);
+        received = read_frames(fixed);
+        assert(received.size() == 1 && received[0].first == bux::MessageFormat::MSGPACK);
+        bux::Message decoded
+            = bux::Message::Deserialise(received[0].first, received[0].second);
+        assert(decoded.type == "tempo" && decoded.src == "adaptive-sender");
+        assert(decoded.content == bux::json({ { "z", 1 }, { "a", { 1, 2 } } }));
+
+        for (int fd : { adaptive, fixed, sender }) close(fd);
+        adaptive_server.Close();
+    }
+
+    // Broadcast rings - servers of different kinds in one process each get their own
+    {
+        bux::Server threaded;
+        bux::SingleThreadedServer single;
+        threaded.broadcast_ring_size = single.broadcast_ring_size = 64 * 1024;
+        threaded.UnixServer("_unix_ring_threaded").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start threaded ring server\n");
+            fail_test();
+        });
+        single.UnixServer("_unix_ring_single").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start single-threaded ring server\n");
+            fail_test();
+        });
+
+        assert(threaded.capabilities.Has(bux::Feature::SHARED_MEMORY));
+        assert(single.capabilities.Has(bux::Feature::SHARED_MEMORY));
+        threaded.Close();
+        single.Close();
+    }
+
+    // Broadcast ring - messages reach a local client through shared memory, and a
+    // reader the writer laps is sent what it missed over its socket
+    {
+        bux::Server ring_server;
+        ring_server.broadcast_ring_size = 8 * 1024;
+        ring_server.UnixServer("_unix_ring").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start ring server\n");
+            fail_test();
+        });
+
+        bux::Client reader({
+            .teamname = "ring-reader",
+            .capabilities = bux::DefaultCapabilities().Add(bux::Feature::SHARED_MEMORY)
+        });
+        bux::Client writer({ .teamname = "ring-writer" });
+
+        std::vector<int> sequence;
+        std::atomic<size_t> count = 0;
+        reader.AddHandler("lap", [&] (bux::Client&, const bux::Message& m) {
+            // Long enough for the writer to lap the reader
+            if (count == 0) std::this_thread::sleep_for(200ms);
+            sequence.push_back(m.content["n"]);
+            ++count;
+        });
+
+        for (bux::Client* c : { &reader, &writer }) {
+            c->UnixConnect("_unix_ring").if_err([&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to ring server\n");
+                fail_test();
+            });
+        }
+        std::this_thread::sleep_for(100ms);
+        assert(reader.Negotiated().Has(bux::Feature::SHARED_MEMORY));
+
+        // Several times the ring's size in all
+        for (int n = 0; n < 100; ++n) {
+            writer.Write({
+                .type = "lap", .dest = "ring-reader",
+                .content = { { "n", n }, { "padding", std::string(200, 'x') } }
+            }).if_err([&fail_test] (bux::WriteError) {
+                fmt::print("ring-writer failed to write\n");
+                fail_test();
+            });
+        }
+
+        assert(wait_until([&count] { return count == 100; }));
+        for (int n = 0; n < 100; ++n) assert(sequence[n] == n);
+        assert(lagging_readers == 1);
+        ring_server.Close();
+    }
+
+    // Single-threaded server - driven by Poll() alone, with a socket client and an
+    // INTERNAL client exchanging messages through it
+    {
+        bux::SingleThreadedServer single;
+        single.UnixServer("_unix_poll").if_err([&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start single-threaded server\n");
+            fail_test();
+        });
+        single.InternalServer().if_err([&fail_test] (bux::AllocError) {
+            fmt::print("Failed to start single-threaded internal server\n");
+            fail_test();
+        });
+
+        std::atomic<int> pings = 0;
+        int pongs = 0; // Only touched by Poll(), on this thread
+        bux::Client remote({ .teamname = "poll-socket" }),
+                    local({ .teamname = "poll-internal" });
+        remote.AddHandler("ping",
+          [&pings, &fail_test] (bux::Client& c, const bux::Message& m) {
+            ++pings;
+            c.Write({ .type = "pong", .dest = m.src, .content = m.content }).if_err(
+              [&fail_test] (bux::WriteError) {
+                fmt::print("poll-socket failed to write\n");
+                fail_test();
+            });
+        });
+        local.AddHandler("pong", [&pongs] (bux::Client&, const bux::Message& m) {
+            pongs += m.content.get<int>();
+        });
+
+        remote.UnixConnect("_unix_poll").if_err([&fail_test] (bux::ConnectError) {
+            fmt::print("Failed to connect to single-threaded server\n");
+            fail_test();
+        });
+        local.InternalConnect(single).if_err([&fail_test] (bux::ConnectError) {
+            fmt::print("Failed to connect internally to single-threaded server\n");
+            fail_test();
+        });
+
+        auto poll_until = [&single, &wait_until] (auto&& done) {
+            return wait_until([&single, &done] { single.Poll(); return done(); });
+        };
+        assert(poll_until([&remote] { return !remote.Negotiated().Empty(); }));
+
+        for (int n = 1; n <= 10; ++n) {
+            local.Write({ .type = "ping", .dest = "poll-socket", .content = n }).if_err(
+              [&fail_test] (bux::WriteError) {
+                fmt::print("poll-internal failed to write\n");
+                fail_test();
+            });
+        }
+        assert(poll_until([&pings, &pongs] { return pings == 10 && pongs == 55; }));
+
+        // Nothing moves between calls to Poll()
+        local.Write({ .type = "ping", .dest = "poll-socket", .content = 1 }).if_err(
+          [&fail_test] (bux::WriteError) {
+            fmt::print("poll-internal failed to write\n");
+            fail_test();
+        });
+        std::this_thread::sleep_for(100ms);
+        assert(pings == 10);
+        assert(poll_until([&pings, &pongs] { return pings == 11 && pongs == 56; }));
+
+        remote.Disconnect();
+        local.Disconnect();
+        single.Poll();
+        single.Close();
+    }
+
+    // Routing tables - members are still found after clients before them are
+    // removed mid-delivery, by the handlers of INTERNAL clients
+    {
+        bux::SingleThreadedServer routing_server;
+        routing_server.InternalServer().if_err([&fail_test] (bux::AllocError) {
+            fmt::print("Failed to start routing server\n");
+            fail_test();
+        });
+
+        constexpr int MEMBERS = 10;
+        std::vector<std::unique_ptr<bux::Client>> early, members;
+        std::vector<int> got(MEMBERS, 0);
+        int other_got = 0;
+        for (int i = 0; i < MEMBERS; ++i) {
+            early.push_back(std::make_unique<bux::Client>(
+                bux::ClientPreferences { .teamname = "routing-early" }));
+            members.push_back(std::make_unique<bux::Client>(
+                bux::ClientPreferences { .teamname = "routing-team" }));
+            members[i]->AddHandler("go",
+              [&early, &got, i] (bux::Client&, const bux::Message&) {
+                early[i]->Disconnect();
+                ++got[i];
+            });
+        }
+        bux::Client other({ .teamname = "routing-other" }),
+                    sender({ .teamname = "routing-sender" });
+        other.AddHandler("go", [&other_got] (bux::Client&, const bux::Message&) {
+            ++other_got;
+        });
+
+        auto connect = [&routing_server, &fail_test] (bux::Client& c) {
+            c.InternalConnect(routing_server).if_err([&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to routing server\n");
+                fail_test();
+            });
+        };
+        for (auto& c : early) connect(*c);
+        for (auto& c : members) connect(*c);
+        connect(other);
+        connect(sender);
+        routing_server.Poll();
+
+        sender.Write({ .type = "go", .dest = "routing-team" }).if_err(
+          [&fail_test] (bux::WriteError) {
+            fmt::print("routing-sender failed to write\n");
+            fail_test();
+        });
+        routing_server.Poll();
+        assert(std::ranges::all_of(got, [] (int n) { return n == 1; }));
+        assert(other_got == 0);
+
+        for (auto& c : members) c->Disconnect();
+        other.Disconnect();
+        sender.Disconnect();
+        routing_server.Close();
+    }
+
+    // Key-value store - reads, conditional writes, deletes & watches, within the
+    // store's capacity
+    {
+        bux::SingleThreadedServer kv_server;
+        kv_server.kv_capacity = 1024 * 4;
+        kv_server.InternalServer().if_err([&fail_test] (bux::AllocError) {
+            fmt::print("Failed to start key-value server\n");
+            fail_test();
+        });
+
+        std::vector<bux::Message> replies, changes;
+        bux::Client kv_client({ .teamname = "kv-client" }),
+                    kv_watcher({ .teamname = "kv-watcher" });
+        for (std::string_view type : { bux::MSG_GET, bux::MSG_SET, bux::MSG_CAS,
+                                       bux::MSG_DELETE }) {
+            kv_client.AddHandler(type, [&replies] (bux::Client&, const bux::Message& m) {
+                replies.push_back(m);
+            });
+        }
+        kv_watcher.AddHandler(bux::MSG_CHANGED,
+          [&changes] (bux::Client&, const bux::Message& m) {
+            changes.push_back(m);
+        });
+        for (bux::Client* c : { &kv_client, &kv_watcher }) {
+            c->InternalConnect(kv_server).if_err([&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to key-value server\n");
+                fail_test();
+            });
+        }
+        kv_server.Poll();
+
+        // Runs a request and returns the reply to it
+        auto request = [&kv_server, &replies, &fail_test]
+          (bux::tb::error<bux::WriteError> sent) {
+            sent.if_err([&fail_test] (bux::WriteError) {
+                fmt::print("kv-client failed to write\n");
+                fail_test();
+            });
+            kv_server.Poll();
+            assert(replies.size() == 1);
+            bux::json reply = replies.back().content;
+            replies.clear();
+            return reply;
+        };
+
+        kv_watcher.Watch("bach", true).if_err([&fail_test] (bux::WriteError) {
+            fmt::print("kv-watcher failed to watch namespace\n");
+            fail_test();
+        });
+        kv_server.Poll();
+
+        bux::json reply = request(kv_client.Get("bach", "cantor"));
+        assert(reply["success"] == false && reply["version"] == 0);
+
+        reply = request(kv_client.Set("bach", "cantor", "Leipzig"));
+        uint64_t set_version = reply["version"];
+        assert(reply["success"] == true && set_version > 0);
+
+        reply = request(kv_client.Get("bach", "cantor"));
+        assert(reply["success"] == true && reply["value"] == "Leipzig");
+        assert(reply["version"] == set_version);
+
+        // A stale version, and version 0 for a key that exists, both fail
+        for (uint64_t version : { set_version + 1, uint64_t { 0 } }) {
+            reply = request(kv_client.CompareAndSet("bach", "cantor", "Arnstadt", version));
+            assert(reply["success"] == false && reply["version"] == set_version);
+            assert(reply["value"] == "Leipzig");
+        }
+
+        reply = request(kv_client.CompareAndSet("bach", "cantor", "Thomaskirche",
+                                                set_version));
+        uint64_t cas_version = reply["version"];
+        assert(reply["success"] == true && cas_version > set_version);
+
+        // Past the capacity, neither the key nor the store's size changes
+        reply = request(kv_client.Set("bach", "cantor", std::string(1024 * 8, 'x')));
+        assert(reply["success"] == false && reply["version"] == cas_version);
+        reply = request(kv_client.Set("bach", "organ", std::string(1024 * 8, 'x')));
+        assert(reply["success"] == false);
+        reply = request(kv_client.Get("bach", "cantor"));
+        assert(reply["value"] == "Thomaskirche");
+
+        reply = request(kv_client.Delete("bach", "cantor"));
+        assert(reply["success"] == true);
+        reply = request(kv_client.Delete("bach", "cantor"));
+        assert(reply["success"] == false);
+        reply = request(kv_client.Get("bach", "cantor"));
+        assert(reply["success"] == false);
+
+        assert(changes.size() == 3);
+        assert(changes[0].content["value"] == "Leipzig" && !changes[0].content["deleted"]);
+        assert(changes[1].content["version"] == cas_version);
+        assert(changes[2].content["deleted"] == true);
+        assert(!changes[2].content.contains("value"));
+
+        kv_watcher.Watch("bach", false).if_err([&fail_test] (bux::WriteError) {
+            fmt::print("kv-watcher failed to stop watching namespace\n");
+            fail_test();
+        });
+        kv_server.Poll();
+        reply = request(kv_client.Set("bach", "cantor", "Leipzig"));
+        assert(reply["success"] == true && changes.size() == 3);
+
+        kv_client.Disconnect();
+        kv_watcher.Disconnect();
+        kv_server.Close();
+    }
+
+    // SEQPACKET sockets - frames arrive whole & in order, those over a packet's size
+    // pieced back together, and a frame over the server's limit skipped without
+    // losing the ones after it
+    {
+        bux::Server seq_server;
+        seq_server.UnixServer("_unix_seq", bux::SocketMode::SEQPACKET).if_err(
+          [&fail_test] (bux::ListenError) {
+            fmt::print("Failed to start SEQPACKET server\n");
+            fail_test();
+        });
+
+        std::vector<int> sequence;
+        std::vector<size_t> lengths;
+        std::atomic<int> received = 0, acks = 0;
+        bux::Client seq_sender({ .teamname = "seq-sender" }),
+                    seq_receiver({ .teamname = "seq-receiver" });
+        seq_receiver.AddHandler("seq",
+          [&sequence, &lengths, &received, &fail_test]
+          (bux::Client& c, const bux::Message& m) {
+            sequence.push_back(m.content["n"]);
+            lengths.push_back(m.content["padding"].get<std::string>().size());
+            ++received;
+            c.Write({ .type = "ack", .dest = m.src, .content = m.content["n"] }).if_err(
+              [&fail_test] (bux::WriteError) {
+                fmt::print("seq-receiver failed to write\n");
+                fail_test();
+            });
+        });
+        seq_sender.AddHandler("ack", [&acks] (bux::Client&, const bux::Message&) {
+            ++acks;
+        });
+        for (bux::Client* c : { &seq_sender, &seq_receiver }) {
+            c->UnixConnect("_unix_seq", bux::SocketMode::SEQPACKET).if_err(
+              [&fail_test] (bux::ConnectError) {
+                fmt::print("Failed to connect to SEQPACKET server\n");
+                fail_test();
+            });
+        }
+        std::this_thread::sleep_for(100ms);
+
+        auto padding_for = [] (int n) -> size_t {
+            if (n < 0) return 150 * 1024; // Over the default maximum message length
+            return n % 5 == 0 ? 100 * 1024 : 10;
+        };
+        for (int n : { 0, 1, 2, 3, 4, 5, -1, 6, 7, 8, 9, 10 }) {
+            seq_sender.Write({
+                .type = "seq", .dest = "seq-receiver",
+                .content = { { "n", n }, { "padding", std::string(padding_for(n), 'p') } }
+            }).if_err([&fail_test] (bux::WriteError) {
+                fmt::print("seq-sender failed to write\n");
+                fail_test();
+            });
+        }
+
+        assert(wait_until([&received, &acks] { return received == 11 && acks == 11; }));
+        for (int n = 0; n <= 10; ++n)
+            assert(sequence[n] == n && lengths[n] == padding_for(n));
+
+        seq_server.Close();
+    }
+
     fmt::print("Test ({}) completed successfully\n", __FILE__);
 
     return 0;
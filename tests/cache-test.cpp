@@ -0,0 +1,98 @@
+#include <cassert>
+#include <cstdio>
+
+#include <cache.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+    using namespace std::chrono_literals;
+
+    const json request = { { "key", "tempo" } };
+    const json other_request = { { "key", "metre" } };
+    const json reply = { { "value", "adagio" } };
+    auto now = ResponseCache::Clock::now();
+
+    // (1) Only types given a TTL are cached, and entries expire
+    {
+        ResponseCache cache;
+        cache.Insert("config", "lookup", request, reply, now);
+        assert(cache.Size() == 0 && !cache.Cacheable("config", "lookup"));
+
+        cache.SetTTL("config", "lookup", 100ms);
+        assert(cache.Cacheable("config", "lookup"));
+        assert(!cache.Cacheable("config", "other"));
+        cache.Insert("config", "lookup", request, reply, now);
+
+        const json* found = cache.Find("config", "lookup", request, now + 50ms);
+        assert(found && *found == reply);
+        assert(!cache.Find("config", "lookup", other_request, now + 50ms));
+        assert(!cache.Find("other", "lookup", request, now + 50ms));
+
+        assert(!cache.Find("config", "lookup", request, now + 100ms));
+        assert(cache.Size() == 0 && cache.Bytes() == 0);
+    }
+
+    // (2) The least recently used entries are evicted past the capacity
+    {
+        ResponseCache cache;
+        cache.SetTTL("config", "lookup", 1s);
+        cache.Insert("config", "lookup", request, reply, now);
+        size_t entry_size = cache.Bytes();
+        cache.SetCapacity(entry_size * 2);
+
+        cache.Insert("config", "lookup", other_request, reply, now);
+        assert(cache.Size() == 2);
+        assert(cache.Find("config", "lookup", request, now)); // Now the most recent
+
+        cache.Insert("config", "lookup", { { "key", "pitch" } }, reply, now);
+        assert(cache.Size() == 2 && cache.Bytes() <= entry_size * 2);
+        assert(cache.Find("config", "lookup", request, now));
+        assert(!cache.Find("config", "lookup", other_request, now));
+    }
+
+    // (3) Setting a TTL of 0 drops the type's entries
+    {
+        ResponseCache cache;
+        cache.SetTTL("config", "lookup", 1s);
+        cache.SetTTL("config", "list", 1s);
+        cache.Insert("config", "lookup", request, reply, now);
+        cache.Insert("config", "list", request, reply, now);
+
+        cache.SetTTL("config", "lookup", 0ms);
+        assert(!cache.Cacheable("config", "lookup"));
+        assert(cache.Size() == 1 && cache.Find("config", "list", request, now));
+    }
+
+    // (4) Idempotency keys are remembered per team, within the window & capacity
+    {
+        DedupWindow dedup;
+        dedup.window = 100ms;
+        dedup.capacity = 2;
+
+        assert(!dedup.Seen("producer", "order-1", now));
+        assert(dedup.Seen("producer", "order-1", now + 50ms));
+        assert(!dedup.Seen("other-producer", "order-1", now + 50ms));
+        assert(!dedup.Seen("producer", "order-1", now + 100ms));
+
+        assert(!dedup.Seen("producer", "order-2", now + 100ms));
+        assert(!dedup.Seen("producer", "order-3", now + 100ms));
+        assert(!dedup.Seen("producer", "order-1", now + 100ms)); // Evicted
+
+        DedupStats stats = dedup.Stats();
+        assert(stats.entries == 2 && stats.duplicates == 1);
+        assert(stats.bytes > 0 && stats.false_positive_rate < 1e-15);
+    }
+
+    // (5) TTLs too long for the clock never expire
+    {
+        ResponseCache cache;
+        cache.SetTTL("config", "lookup", std::chrono::milliseconds::max());
+        cache.Insert("config", "lookup", request, reply, now);
+        assert(cache.Find("config", "lookup", request, now + 24h * 365 * 100));
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
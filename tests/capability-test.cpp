@@ -0,0 +1,64 @@
+#include <cassert>
+#include <cstdio>
+
+#include <core.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    // (1) Only features both sides advertise are agreed on
+    {
+        Capabilities a, b;
+        a.Add(Feature::DATAGRAM).Add(Feature::HEARTBEAT);
+        b.Add(Feature::DATAGRAM).Add(Feature::SHARED_MEMORY);
+
+        Capabilities agreed = a.Negotiate(b);
+        assert(agreed.Has(Feature::DATAGRAM));
+        assert(!agreed.Has(Feature::HEARTBEAT) && !agreed.Has(Feature::SHARED_MEMORY));
+    }
+
+    // (2) Parameters agree field by field, nested objects included, and both sides
+    // reach the same result
+    {
+        Capabilities a, b;
+        a.Add(Feature::COMPRESSION, {
+            { "level", 9 }, { "dictionary", true }, { "codec", "zstd" },
+            { "codecs", { "zstd", "lz4", "zstd" } },
+            { "window", { { "bits", 22 }, { "shared", true }, { "only-a", 1 } } }
+        });
+        b.Add(Feature::COMPRESSION, {
+            { "level", 3 }, { "dictionary", false }, { "codec", "lz4" },
+            { "codecs", { "lz4", "zstd", "zstd", "brotli" } },
+            { "window", { { "bits", 18 }, { "shared", true } } }
+        });
+
+        json expected = {
+            { "level", 3 }, { "dictionary", false }, { "codecs", { "lz4", "zstd" } },
+            { "window", { { "bits", 18 }, { "shared", true } } }
+        };
+        assert(a.Negotiate(b).Params(Feature::COMPRESSION) == expected);
+        assert(b.Negotiate(a).Params(Feature::COMPRESSION) == expected);
+
+        Capabilities once, twice;
+        once.Add(Feature::BATCHING, { { "sizes", { 1 } } });
+        twice.Add(Feature::BATCHING, { { "sizes", { 1, 1 } } });
+        assert(once.Negotiate(twice).Params(Feature::BATCHING)
+               == twice.Negotiate(once).Params(Feature::BATCHING));
+    }
+
+    // (3) Peers predating capabilities advertise none, and agree on none
+    {
+        Capabilities ours = DefaultCapabilities().Add(Feature::DATAGRAM);
+        json handshake = { { "teamname", "old" }, { "format", MessageFormat::JSON } };
+        Capabilities theirs = handshake.value("capabilities", json {}).get<Capabilities>();
+
+        assert(theirs.Empty() && ours.Negotiate(theirs).Empty());
+        assert(json(nullptr).get<Capabilities>().Empty());
+        assert(json(ours).get<Capabilities>().Negotiate(ours).Has(Feature::DATAGRAM));
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
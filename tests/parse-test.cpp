@@ -0,0 +1,144 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <parse.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    Message msg;
+    msg.type = "order";
+    msg.dest = "warehouse";
+    msg.src = "shop";
+    msg.only_first = true;
+    msg.content = {
+        { "notes", std::string(4096, 'x') },
+        { "items", { { { "sku", "bwv-565" } }, { { "sku", "buxwv-161" } } } },
+        { "order", { { "id", 1637 }, { "a/b", "slash" }, { "quoted \"key\"", true } } }
+    };
+
+    auto body = [] (const std::vector<uint8_t>& frame) {
+        return std::string_view {
+            reinterpret_cast<const char*>(frame.data()) + FRAME_HEADER_SIZE,
+            frame.size() - FRAME_HEADER_SIZE
+        };
+    };
+
+    // (1) Lookups into undecoded content agree with the decoded message, in both
+    // formats and over a decoded message
+    for (MessageFormat format : { MessageFormat::JSON, MessageFormat::MSGPACK }) {
+        std::vector<uint8_t> frame = Message::Encode(msg, format);
+
+        for (const LazyMessage& lazy : { LazyMessage { format, body(frame) },
+                                         LazyMessage { msg } }) {
+            assert(lazy.type == "order" && lazy.dest == "warehouse");
+            assert(lazy.src == "shop" && lazy.only_first);
+
+            assert(lazy.At("/order/id") == json(1637));
+            assert(lazy.At("/order/a~1b") == json("slash"));
+            assert(lazy.At("/order/quoted \"key\"") == json(true));
+            assert(lazy.At("/items/1/sku") == json("buxwv-161"));
+            assert(lazy.At("/items/1") == msg.content["items"][1]);
+
+            assert(!lazy.At("/order/missing"));
+            assert(!lazy.At("/items/2"));
+            assert(!lazy.At("/items/01"));
+            assert(!lazy.At("/notes/0"));
+
+            assert(lazy.Content() == msg.content);
+            Message materialised = lazy.Materialise();
+            assert(materialised.content == msg.content && materialised.type == msg.type);
+        }
+    }
+
+    // (2) Escaped keys are left to the full decoder, and malformed bodies throw
+    {
+        std::string escaped = R"({"ty\u0070e": "order", "content": {"id": 1}})";
+        LazyMessage lazy { MessageFormat::JSON, escaped };
+        assert(lazy.type == "order" && lazy.At("/id") == json(1));
+
+        bool threw = false;
+        try {
+            LazyMessage { MessageFormat::JSON, R"({"type": "order", "content": {)" };
+        } catch (const json::parse_error&) {
+            threw = true;
+        }
+        assert(threw);
+
+        threw = false;
+        try {
+            LazyMessage { MessageFormat::MSGPACK, "\x81\xa4type\xd9\xff" };
+        } catch (const json::parse_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // (3) Frames decoded by the pool come back complete, with parse errors noted
+    {
+        std::atomic<int> done = 0;
+        ParsePool pool;
+        pool.Start(2, &Message::Deserialise, [&done] { ++done; });
+        assert(pool.Running());
+
+        std::vector<uint8_t> frame = Message::Encode(msg, MessageFormat::MSGPACK);
+        auto good = std::make_shared<ParseJob>(MessageFormat::MSGPACK, body(frame));
+        auto bad = std::make_shared<ParseJob>(MessageFormat::JSON, "{");
+        pool.Submit(good);
+        pool.Submit(bad);
+        ParsePool::Wait(*good);
+        ParsePool::Wait(*bad);
+
+        assert(good->message && good->message->content == msg.content);
+        assert(!bad->message && !bad->error.empty());
+
+        pool.Stop();
+        assert(!pool.Running() && done == 2);
+    }
+
+    // (4) Prepared messages patch their slots in place, and refuse slots they lose
+    for (MessageFormat format : { MessageFormat::JSON, MessageFormat::MSGPACK }) {
+        Message counter { .type { "count" }, .content = { { "n", 7u }, { "m", 0u } } };
+        PreparedMessage prepared { counter, format,
+                                   { "/n"_json_pointer, "/m"_json_pointer } };
+        prepared.Set(1, 1637);
+
+        LazyMessage lazy { format, body(prepared.Frame()) };
+        assert(lazy.Content() == json({ { "n", 7u }, { "m", 1637u } }));
+
+        bool threw = false;
+        try {
+            PreparedMessage { counter, format, { "/n"_json_pointer, "/n"_json_pointer } };
+        } catch (const std::invalid_argument&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // (5) Of duplicate keys the last counts, as with the full decoder
+    {
+        std::string duplicated = R"({"type": "order", "content": {"id": 1, "nested": )"
+            R"({"k": "a"}, "id": 2, "nested": {"k": "b"}}})";
+        LazyMessage lazy { MessageFormat::JSON, duplicated };
+        Message decoded = Message::Deserialise(MessageFormat::JSON, duplicated);
+        assert(lazy.At("/id") == json(2) && decoded.content["id"] == 2);
+        assert(lazy.At("/nested/k") == json("b") && decoded.content["nested"]["k"] == "b");
+
+        // {"type": "order", "content": {"id": 1, "id": 2}}
+        std::string packed = "\x82" "\xa4" "type" "\xa5" "order" "\xa7" "content"
+            "\x82" "\xa2" "id" "\x01" "\xa2" "id" "\x02";
+        LazyMessage lazy_packed { MessageFormat::MSGPACK, packed };
+        decoded = Message::Deserialise(MessageFormat::MSGPACK, packed);
+        assert(lazy_packed.At("/id") == json(2) && decoded.content["id"] == 2);
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
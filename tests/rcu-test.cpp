@@ -0,0 +1,86 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <rcu.hpp>
+
+struct Counted
+{
+    Counted(uint64_t n = 0) : n(n), copies(16, n) { ++live; }
+    ~Counted() { --live; }
+
+    bool Intact() const
+    {
+        for (uint64_t copy : copies) if (copy != n) return false;
+        return true;
+    }
+
+    uint64_t n;
+    std::vector<uint64_t> copies;
+
+    static inline std::atomic<int> live = 0;
+};
+
+int main()
+{
+    using namespace buxtehude;
+
+    // (1) A reader keeps what it read alive across publishes, and it is freed by
+    // the writer once released
+    {
+        Published<Counted> cell;
+        {
+            auto reader = cell.Read();
+            for (uint64_t i = 1; i <= 5; ++i) cell.Publish(std::make_unique<Counted>(i));
+
+            assert(reader->n == 0 && reader->Intact());
+            assert(cell.Read()->n == 5);
+            assert(cell.Retired() == 5 && Counted::live == 6);
+        }
+
+        cell.Publish(std::make_unique<Counted>(6));
+        cell.Publish(std::make_unique<Counted>(7));
+        assert(cell.Read()->n == 7);
+        assert(cell.Retired() == 1 && Counted::live == 2);
+    }
+    assert(Counted::live == 0);
+
+    // (2) Readers on other threads only ever see whole values, in the order they
+    // were published
+    {
+        constexpr uint64_t PUBLISHES = 20'000;
+        Published<Counted> cell;
+        std::atomic<bool> done = false;
+        std::atomic<bool> consistent = true;
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i) {
+            readers.emplace_back([&] {
+                uint64_t last = 0;
+                while (!done) {
+                    auto reader = cell.Read();
+                    if (!reader->Intact() || reader->n < last) consistent = false;
+                    last = reader->n;
+                }
+            });
+        }
+
+        for (uint64_t i = 1; i <= PUBLISHES; ++i)
+            cell.Publish(std::make_unique<Counted>(i));
+        done = true;
+        for (std::thread& t : readers) t.join();
+
+        assert(consistent);
+        cell.Publish(std::make_unique<Counted>(PUBLISHES + 1));
+        cell.Publish(std::make_unique<Counted>(PUBLISHES + 2));
+        assert(cell.Retired() <= 2 && Counted::live <= 3);
+    }
+    assert(Counted::live == 0);
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
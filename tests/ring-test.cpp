@@ -0,0 +1,87 @@
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <ring.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    std::string name = "/buxtehude-ring-test-" + std::to_string(getpid());
+    auto bytes = [] (std::string_view s) {
+        return std::span<const uint8_t> {
+            reinterpret_cast<const uint8_t*>(s.data()), s.size()
+        };
+    };
+    auto no_lag = [] (int, uint64_t) { assert(false); };
+
+    // (1) Readers receive the frames for their team & $$all, except their own
+    {
+        BroadcastRing ring;
+        assert(ring.Create(name, 4096).is_ok());
+        int slot = ring.Attach();
+        assert(slot >= 0 && ring.Readers() == 1);
+
+        RingReader reader;
+        assert(reader.Open(name, slot).is_ok());
+        assert(!reader.Pending());
+
+        ring.Publish("toccata", -1, bytes("one"), no_lag);
+        ring.Publish("fugue", -1, bytes("two"), no_lag);
+        ring.Publish(MSG_ALL, -1, bytes("three"), no_lag);
+        ring.Publish(MSG_ALL, slot, bytes("four"), no_lag);
+        assert(reader.Pending());
+
+        std::vector<std::string> received;
+        assert(reader.Drain("toccata", [&] (std::span<const uint8_t> frame) {
+            received.emplace_back(frame.begin(), frame.end());
+        }));
+        assert((received == std::vector<std::string> { "one", "three" }));
+        assert(!reader.Pending());
+
+        ring.Destroy();
+        assert(!reader.Drain("toccata", [] (auto) {}));
+    }
+
+    // (2) A lagging reader is detached & its unread frames handed back, once each
+    {
+        BroadcastRing ring;
+        assert(ring.Create(name, 256).is_ok());
+        int slot = ring.Attach();
+
+        RingReader reader;
+        assert(reader.Open(name, slot).is_ok());
+
+        std::vector<std::string> received, handed_back;
+        int published = 0;
+        auto on_lagging = [&] (int lagging, uint64_t pos) {
+            assert(lagging == slot);
+            std::vector<std::vector<uint8_t>> frames;
+            ring.Unread(pos, "toccata", lagging, frames);
+            for (auto& f : frames) handed_back.emplace_back(f.begin(), f.end());
+        };
+
+        for (; published < 5; ++published)
+            ring.Publish("toccata", -1, bytes(std::to_string(published)), on_lagging);
+        assert(reader.Drain("toccata", [&] (std::span<const uint8_t> frame) {
+            received.emplace_back(frame.begin(), frame.end());
+        }));
+
+        for (; published < 40; ++published)
+            ring.Publish("toccata", -1, bytes(std::to_string(published)), on_lagging);
+        assert(ring.Readers() == 0 && !handed_back.empty());
+        assert(!reader.Drain("toccata", [] (auto) {}));
+
+        received.insert(received.end(), handed_back.begin(), handed_back.end());
+        for (size_t i = 0; i < received.size(); ++i)
+            assert(received[i] == std::to_string(i));
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
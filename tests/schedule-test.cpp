@@ -0,0 +1,87 @@
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include <schedule.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+
+    // (1) Work is shared in proportion to team weights
+    {
+        FairScheduler scheduler;
+        scheduler.SetQoS("bach", { .weight = 3 });
+        scheduler.SetQoS("buxtehude", { .weight = 1 });
+
+        scheduler.Enqueue("bach", 1);
+        scheduler.Enqueue("bach", 2);
+        scheduler.Enqueue("buxtehude", 3);
+        assert(scheduler.Pending());
+
+        int bach = 0, buxtehude = 0;
+        for (int round = 0; round < 4; ++round) {
+            scheduler.Run(100, [&] (int id) {
+                if (id == 3) ++buxtehude;
+                else ++bach;
+                return true; // Always has more to read
+            });
+        }
+
+        assert(bach == 12 && buxtehude == 4);
+    }
+
+    // (2) Budgets are respected and higher classes go first
+    {
+        FairScheduler scheduler;
+        scheduler.SetQoS("organists", { .qos_class = QoSClass::HIGH, .weight = 2 });
+
+        scheduler.Enqueue("lutenists", 1);
+        scheduler.Enqueue("organists", 2);
+
+        std::string order;
+        uint32_t serviced = scheduler.Run(2, [&order] (int id) {
+            order += std::to_string(id);
+            return true;
+        });
+
+        assert(serviced == 2 && order == "22");
+    }
+
+    // (3) Finished and removed work leaves the queues
+    {
+        FairScheduler scheduler;
+        scheduler.Enqueue("gamba", 1);
+        scheduler.Enqueue("gamba", 2);
+        scheduler.Remove(2);
+
+        int count = 0;
+        scheduler.Run(10, [&count] (int) { ++count; return false; });
+
+        assert(count == 1 && !scheduler.Pending());
+    }
+
+    // (4) Samplers take one in N, cap the rate & sample keys consistently
+    {
+        using namespace std::chrono_literals;
+        auto now = Sampler::Clock::now();
+
+        Sampler one_in_three { 3 };
+        int taken = 0;
+        for (int i = 0; i < 9; ++i) taken += one_in_three.Take(0, now);
+        assert(taken == 3);
+
+        Sampler capped { 1, 2 };
+        taken = 0;
+        for (int i = 0; i < 5; ++i) taken += capped.Take(0, now);
+        assert(taken == 2 && capped.Take(0, now + 1s));
+
+        Sampler by_key { 1, 0, 0.5 };
+        assert(by_key.Take(1, now) && by_key.Take(1, now));
+        assert(!by_key.Take(UINT64_MAX - 1, now) && !by_key.Take(UINT64_MAX - 1, now));
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
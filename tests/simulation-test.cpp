@@ -0,0 +1,278 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <buxtehude.hpp>
+
+int main()
+{
+    using namespace buxtehude;
+    using namespace std::chrono_literals;
+
+    Initialise([] (LogLevel level, std::string_view message) {
+        if (level >= LogLevel::WARNING) printf("(buxtehude) %.*s\n",
+            static_cast<int>(message.size()), message.data());
+    });
+
+    auto note = [] (std::string_view type, json content = {}) {
+        Message msg;
+        msg.type = type;
+        msg.content = std::move(content);
+        return msg;
+    };
+
+    // (1) Messages take their links' latency both ways, and queue behind each other
+    // on a link with limited bandwidth
+    {
+        Simulation sim(1);
+        assert(sim.Start().is_ok());
+
+        std::vector<VirtualClock::time_point> arrivals;
+        Client& fast = sim.AddClient({ .teamname = "fast" }, { .latency = 10ms });
+        Client& slow = sim.AddClient({ .teamname = "slow" },
+                                     { .latency = 1ms, .bandwidth = 100'000 });
+        Client& sink = sim.AddClient({ .teamname = "sink" }, { .latency = 5ms });
+        sink.AddHandler("ping", [&sim, &arrivals] (Client&, const Message&) {
+            arrivals.push_back(sim.Now());
+        });
+        sim.RunUntilIdle();
+
+        Message ping = note("ping", std::string(10'000, 'x'));
+        ping.dest = "sink";
+
+        auto sent = sim.Now();
+        assert(fast.Write(ping).is_ok());
+        sim.RunUntilIdle();
+        assert(arrivals.size() == 1 && arrivals[0] - sent == 15ms);
+
+        sent = sim.Now();
+        assert(slow.Write(ping).is_ok() && slow.Write(ping).is_ok());
+        sim.RunUntilIdle();
+        assert(arrivals.size() == 3);
+        // 10 KB at 100 KB/s each
+        assert(arrivals[1] - sent >= 106ms && arrivals[1] - sent < 116ms);
+        assert(arrivals[2] - arrivals[1] >= 100ms && arrivals[2] - arrivals[1] < 110ms);
+    }
+
+    // (2) The same seed replays the same interleaving
+    auto trace = [&note] (uint64_t seed) {
+        Simulation sim(seed);
+        assert(sim.Start().is_ok());
+        auto start = sim.Now();
+
+        std::vector<std::string> seen;
+        Client& sink = sim.AddClient({ .teamname = "sink" });
+        sink.AddHandler("hello", [&] (Client&, const Message& msg) {
+            seen.push_back(fmt::format("{} {}", msg.content.get<std::string>(),
+                                       (sim.Now() - start).count()));
+        });
+
+        std::vector<Client*> senders;
+        for (int i = 0; i < 20; ++i) {
+            senders.push_back(&sim.AddClient({ .teamname = fmt::format("s{}", i) },
+                                             { .latency = 1ms, .jitter = 2ms }));
+        }
+        sim.RunUntilIdle();
+
+        for (int i = 0; i < 20; ++i) {
+            sim.Schedule(std::chrono::microseconds(sim.Random() % 1000), [&, i] {
+                Message hello = note("hello", fmt::format("s{}", i));
+                hello.dest = "sink";
+                assert(senders[i]->Write(hello).is_ok());
+            });
+        }
+        sim.RunUntilIdle();
+        assert(seen.size() == 20);
+        return seen;
+    };
+    assert(trace(7) == trace(7));
+    assert(trace(7) != trace(8));
+
+    // (3) Membership changes are batched over virtual time
+    {
+        Simulation sim(2);
+        sim.server.membership_interval = { 1, 0 };
+        assert(sim.Start().is_ok());
+
+        int batches = 0;
+        int64_t joined = 0;
+        Client& watcher = sim.AddClient({ .teamname = "watcher" });
+        watcher.AddHandler(std::string { MSG_MEMBERSHIP }, [&] (Client&, const Message& msg) {
+            ++batches;
+            for (const json& change : msg.content["changes"])
+                if (change["team"] == "worker") joined += change["joined"].get<int64_t>();
+        });
+        assert(watcher.Subscribe("worker", true).is_ok());
+        // Past the batch holding the watcher's own join
+        sim.RunFor(1500ms);
+
+        for (int i = 0; i < 10; ++i) sim.AddClient({ .teamname = "worker" });
+        sim.RunFor(999ms);
+        assert(batches == 0);
+        sim.RunFor(2ms);
+        assert(batches == 1 && joined == 10);
+    }
+
+    // (4) Thousands of clients run in virtual time, without sleeping
+    {
+        constexpr int CLIENTS = 2000;
+        auto wall_start = std::chrono::steady_clock::now();
+
+        Simulation sim(3);
+        assert(sim.Start().is_ok());
+
+        int received = 0;
+        Client& sink = sim.AddClient({ .teamname = "sink" });
+        sink.AddHandler("report", [&received] (Client&, const Message&) { ++received; });
+
+        LinkProfile wan { .latency = 40ms, .jitter = 20ms, .bandwidth = 1'000'000 };
+        for (int i = 0; i < CLIENTS; ++i) {
+            Client& client = sim.AddClient({ .teamname = "node" }, wan);
+            sim.Schedule(1s, [&client, &note] {
+                Message report = note("report", { { "load", 0.5 } });
+                report.dest = "sink";
+                assert(client.Write(report).is_ok());
+            });
+        }
+
+        auto start = sim.Now();
+        assert(sim.RunUntil([&received] { return received == CLIENTS; }, 10s));
+        assert(sim.Now() - start < 2s);
+        assert(std::chrono::steady_clock::now() - wall_start < 30s);
+    }
+
+    // (5) Malformed $$sample requests are answered with an error, and sample nothing
+    {
+        Simulation sim(4);
+        assert(sim.Start().is_ok());
+
+        int errors = 0, samples = 0;
+        Client& producer = sim.AddClient({ .teamname = "producer" });
+        Client& observer = sim.AddClient({ .teamname = "observer" });
+        observer.EraseHandler(std::string { MSG_ERROR });
+        observer.AddHandler(std::string { MSG_ERROR },
+            [&errors] (Client&, const Message&) { ++errors; });
+        observer.AddHandler("tick", [&samples] (Client&, const Message&) { ++samples; });
+
+        auto sample = [&note] (json fields) {
+            fields["team"] = "busy";
+            fields["sample"] = true;
+            return note(MSG_SAMPLE, std::move(fields));
+        };
+        auto tick = [&sim, &producer, &note] {
+            Message msg = note("tick");
+            msg.dest = "busy";
+            assert(producer.Write(msg).is_ok());
+            sim.RunUntilIdle();
+        };
+
+        for (const json& fields : {
+            json { { "fraction", "half" } },
+            json { { "fraction", 1.5 } },
+            json { { "every", 1ull << 32 } },
+            json { { "rate", -1 } },
+            json { { "every", "2" } }
+        }) {
+            assert(observer.Write(sample(fields)).is_ok());
+            sim.RunUntilIdle();
+            tick();
+        }
+        // Errors are sent at most once a second
+        assert(errors >= 1 && samples == 0);
+
+        assert(observer.Write(sample({ { "every", 1 }, { "fraction", 0.5 } })).is_ok());
+        sim.RunUntilIdle();
+        tick();
+        assert(samples == 1);
+    }
+
+    // (6) Server requests are recognised by the type INGRESS interceptors leave them
+    {
+        Simulation sim(5);
+        sim.server.AddInterceptor(InterceptStage::INGRESS, [] (Envelope& envelope) {
+            if (envelope.View().type == "who") envelope.Modify().type = MSG_MEMBERS;
+            return Verdict::PASS;
+        });
+        assert(sim.Start().is_ok());
+
+        json teams;
+        Client& asker = sim.AddClient({ .teamname = "asker" });
+        asker.AddHandler(std::string { MSG_MEMBERS }, [&teams] (Client&, const Message& msg) {
+            teams = msg.content["teams"];
+        });
+        sim.RunUntilIdle();
+
+        assert(asker.Write(note("who")).is_ok());
+        sim.RunUntilIdle();
+        assert(teams == json({ { "asker", 1 } }));
+    }
+
+    // (7) Observers receive one in every N messages, at most 'rate' a second, and
+    // the same share of keys each time, while malformed updates change nothing
+    {
+        Simulation sim(6);
+        assert(sim.Start().is_ok());
+
+        int errors = 0;
+        std::vector<int64_t> samples;
+        Client& producer = sim.AddClient({ .teamname = "producer" });
+        Client& observer = sim.AddClient({ .teamname = "observer" });
+        observer.EraseHandler(std::string { MSG_ERROR });
+        observer.AddHandler(std::string { MSG_ERROR },
+            [&errors] (Client&, const Message&) { ++errors; });
+        observer.AddHandler("tick", [&samples] (Client&, const Message& msg) {
+            samples.push_back(msg.content["user"].get<int64_t>());
+        });
+
+        auto sample = [&sim, &observer, &note] (json fields) {
+            fields["team"] = "busy";
+            fields["sample"] = true;
+            assert(observer.Write(note(MSG_SAMPLE, std::move(fields))).is_ok());
+            sim.RunUntilIdle();
+        };
+        auto tick = [&sim, &producer, &note] (int64_t user) {
+            Message msg = note("tick", { { "user", user } });
+            msg.dest = "busy";
+            assert(producer.Write(msg).is_ok());
+            sim.RunUntilIdle();
+        };
+
+        sample({ { "every", 3 } });
+        for (int i = 0; i < 9; ++i) tick(i);
+        assert((samples == std::vector<int64_t> { 2, 5, 8 }));
+
+        sample({ { "every", -1 } });
+        assert(errors == 1);
+        for (int i = 9; i < 12; ++i) tick(i);
+        assert(samples.size() == 4 && samples.back() == 11);
+
+        // No virtual time passes between ticks
+        samples.clear();
+        sample({ { "rate", 2 } });
+        for (int i = 0; i < 5; ++i) tick(i);
+        assert(samples.size() == 2);
+        sim.RunFor(1s);
+        for (int i = 0; i < 5; ++i) tick(i);
+        assert(samples.size() == 4);
+
+        samples.clear();
+        sample({ { "key", "/user" }, { "fraction", 0.5 } });
+        for (int round = 0; round < 2; ++round)
+            for (int user = 0; user < 100; ++user) tick(user);
+
+        std::vector<int> seen(100);
+        for (int64_t user : samples) ++seen[user];
+        int sampled = 0;
+        for (int times : seen) {
+            assert(times == 0 || times == 2);
+            sampled += times / 2;
+        }
+        assert(sampled > 25 && sampled < 75);
+    }
+
+    printf("Test (%s) completed successfully\n", __FILE__);
+
+    return 0;
+}
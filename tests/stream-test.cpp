@@ -1,7 +1,13 @@
 #include <cstdio>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 #include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <io.hpp>
 
@@ -106,6 +112,84 @@ int main()
         fclose(file);
     }
 
+    // (5) Packets: one frame each, large frames split & pieced back together, frames
+    // longer than the maximum skipped
+    {
+        using buxtehude::PacketStream, buxtehude::PacketError;
+
+        int fds[2];
+        assert(socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, fds) == 0);
+        PacketStream writer { fds[0], UINT32_MAX }, reader { fds[1], 1024 * 100 };
+
+        auto frame = [] (uint32_t length, uint8_t fill) {
+            std::vector<uint8_t> f(buxtehude::FRAME_HEADER_SIZE + length, fill);
+            f[0] = 0;
+            memcpy(f.data() + 1, &length, sizeof(length));
+            return f;
+        };
+
+        std::vector<uint8_t> small = frame(10, 1), large = frame(1024 * 90, 2),
+                             too_long = frame(1024 * 120, 3), last = frame(3, 4);
+        auto reads = [&reader] (const std::vector<uint8_t>& expected) {
+            auto read = reader.Read();
+            return read.is_ok() && std::ranges::equal(read.get_unchecked(), expected);
+        };
+        auto fails = [&reader] (PacketError error) {
+            auto read = reader.Read();
+            return read.is_error() && read.get_error() == error;
+        };
+
+        assert(writer.TryWrite(small).is_ok() && writer.TryWrite(large).is_ok());
+        // Only buffers that received a packet are kept: one for the small frame,
+        // two for the large
+        assert(reads(small) && reader.Held() == 3 * buxtehude::MAX_PACKET_SIZE);
+        assert(reads(large));
+
+        assert(writer.TryWrite(too_long).is_ok() && writer.TryWrite(last).is_ok());
+        assert(fails(PacketError::TOO_LONG) && reads(last));
+        // Nothing is held by an idle connection
+        assert(fails(PacketError::NONE_READY) && reader.Held() == 0);
+
+        close(fds[0]);
+        assert(fails(PacketError::REACHED_EOF));
+        close(fds[1]);
+    }
+
+    // (6) Bodies grow as their bytes arrive, not when their length is announced
+    {
+        int fds[2];
+        assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, fds) == 0);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        FILE* file = fdopen(fds[1], "r");
+        setvbuf(file, nullptr, _IONBF, 0);
+
+        std::vector<uint8_t> body(1024 * 1024);
+        for (size_t i = 0; i < body.size(); ++i) body[i] = i % 251;
+
+        Stream stream(file);
+        stream.Await(body.size());
+
+        assert(write(fds[0], body.data(), 100) == 100);
+        assert(stream.Read() == false);
+        assert(stream[0].data.capacity() < 1024 * 16);
+
+        size_t sent = 100;
+        bool done = false;
+        while (!done) {
+            size_t size = std::min(body.size() - sent, size_t { 1024 * 64 });
+            assert(write(fds[0], body.data() + sent, size) == ssize_t(size));
+            sent += size;
+            clearerr(file);
+            done = stream.Read();
+        }
+
+        assert(sent == body.size());
+        assert(memcmp(stream[0].data.data(), body.data(), body.size()) == 0);
+
+        close(fds[0]);
+        fclose(file);
+    }
+
     printf("Test (%s) completed successfully\n", __FILE__);
 
     return 0;